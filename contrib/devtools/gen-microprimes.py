@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+'''
+Regenerate the compiled in microprime tables (src/mpkeys.cpp and
+src/mpkeys_test.cpp).
+
+Each table is a sorted array of (hash160, group) entries that is searched
+with a binary search by CheckMicroPrime/IsMicroPrime, the address of every
+entry is kept as a trailing comment. To add or change a microprime edit or
+append a line of the form
+
+    { {}, 5000 }, // PAddress...
+
+anywhere in the table and run this script from the root of the repository.
+The legacy WriteMicroPrimeAddr(std::string("PAddress..."), (int64)5000) form
+is also accepted. Addresses are checked against their network version and
+checksum, the table is sorted by hash160 and the file is rewritten in place.
+'''
+import hashlib
+import re
+import sys
+
+B58_DIGITS = '123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz'
+
+TABLES = [
+    # file, table name, pubkey address version
+    ('src/mpkeys.cpp', 'microPrimeTable', 55),
+    ('src/mpkeys_test.cpp', 'testMicroPrimeTable', 111),
+]
+
+ENTRY_RE = re.compile(r'WriteMicroPrimeAddr\(std::string\("(\w+)"\), \(int64\)(\d+)\)'
+                      r'|\{ \{[0-9a-fx, ]*\}, (\d+) \}, // (\w+)')
+
+def b58decode_check(s):
+    n = 0
+    for c in s:
+        n = n * 58 + B58_DIGITS.index(c)
+    data = bytearray()
+    while n > 0:
+        data.insert(0, n & 0xff)
+        n >>= 8
+    for c in s:
+        if c != B58_DIGITS[0]:
+            break
+        data.insert(0, 0)
+    data = bytes(data)
+    if hashlib.sha256(hashlib.sha256(data[:-4]).digest()).digest()[:4] != data[-4:]:
+        raise ValueError('bad checksum for %s' % s)
+    return bytearray(data[:-4])
+
+def read_entries(filename, version):
+    entries = {}
+    for line in open(filename):
+        m = ENTRY_RE.search(line)
+        if not m:
+            continue
+        if m.group(1):
+            address, group = m.group(1), int(m.group(2))
+        else:
+            address, group = m.group(4), int(m.group(3))
+        payload = b58decode_check(address)
+        if len(payload) != 21 or payload[0] != version:
+            raise ValueError('%s is not a pubkey address for version %d' % (address, version))
+        entries[bytes(payload[1:])] = (address, group)
+    return entries
+
+def write_table(filename, name, entries):
+    out = open(filename, 'w')
+    out.write('// Generated by contrib/devtools/gen-microprimes.py, sorted by hash160.\n')
+    out.write('#include "primenodes.h"\n\n')
+    out.write('const CMicroPrimeEntry %s[] = {\n' % name)
+    for key in sorted(entries.keys()):
+        address, group = entries[key]
+        hexbytes = ', '.join('0x%02x' % b for b in bytearray(key))
+        out.write('    { { %s }, %d }, // %s\n' % (hexbytes, group, address))
+    out.write('};\n\n')
+    out.write('const unsigned int %sSize = sizeof(%s) / sizeof(%s[0]);\n' % (name, name, name))
+    out.close()
+
+def main():
+    for filename, name, version in TABLES:
+        entries = read_entries(filename, version)
+        if not entries:
+            sys.exit('%s: no microprime entries found' % filename)
+        write_table(filename, name, entries)
+        print('%s: %d microprimes' % (filename, len(entries)))
+
+if __name__ == '__main__':
+    main()
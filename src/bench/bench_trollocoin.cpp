@@ -0,0 +1,582 @@
+// Copyright (c) 2014-2015 The Trollocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Wallet benchmark: builds a synthetic chain and wallet, then times a rescan,
+// a key pool refill, loading the wallet and coin selection as sendtoaddress
+// does it, replays CreateCoinStake with mock time and spends every coin as
+// initial block download does, so that performance can be compared between
+// releases and settings (-stakethreads, -rescanthreads, -fastwalletload,
+// -coinscache, -txdb, -reservebalance, ...). It ends with the kernel search,
+// stake modifiers, stake weight and primenode key lookups of staking.
+//
+// Usage: bench_trollocoin [-coins=<n>] [-sends=<n>] [-rounds=<n>]
+//                         [-searchinterval=<n>] [-stakebits=<hex>]
+//                         [-stakethreads=<n>] [-rescanthreads=<n>]
+//                         [-keypoolrefill=<n>] [-fastwalletload=<0|1>]
+//                         [-coinscache=<n>] [-txdb=<bdb|log>] [-datadir=<dir>]
+//
+// The chain, keys and coins are derived deterministically from -coins, so runs
+// with the same options search the same kernels. Run with -coins=1000, 10000
+// and 100000 to see how latency grows with the size of the wallet.
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "kernel.h"
+#include "primenodes.h"
+#include "scrapesdb.h"
+#include "wallet.h"
+#include "walletdb.h"
+
+using namespace std;
+using namespace boost;
+
+int MIN_PROTO_VERSION = 70005;
+
+CWallet* pwalletMain;
+CScrapesDB* scrapesDB;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+static uint256 BenchHash(const string& str, unsigned int n)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << str << n;
+    return Hash(ss.begin(), ss.end());
+}
+
+// Blocks holding the wallet's coins are written to disk and indexed like
+// connected blocks, the rest of the chain only exists in the block index so
+// that stake modifiers can be selected for the coins.
+static CBlockIndex* AddBenchBlockIndex(const CBlock& block, unsigned int nFile, unsigned int nBlockPos, uint64 nStakeModifier)
+{
+    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *(CBlock*)&block);
+    uint256 hash = block.GetHash();
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    if (pindexBest)
+    {
+        pindexNew->pprev = pindexBest;
+        pindexNew->nHeight = pindexBest->nHeight + 1;
+        pindexBest->pnext = pindexNew;
+    }
+    else
+        pindexGenesisBlock = pindexNew;
+    pindexNew->nChainTrust = (pindexNew->pprev ? pindexNew->pprev->nChainTrust : 0) + pindexNew->GetBlockTrust();
+    pindexNew->SetStakeModifier(nStakeModifier, true);
+    pindexBest = pindexNew;
+    hashBestChain = hash;
+    nBestHeight = pindexNew->nHeight;
+    return pindexNew;
+}
+
+static bool CreateBenchChain(CWallet* pwallet, unsigned int nCoins, int64 nTimeStart, int64 nTimeEnd)
+{
+    const unsigned int nCoinsPerBlock = 100;
+    const unsigned int nCoinsPerKey = 10;
+    const unsigned int nBitsBench = CBigNum(~uint256(0) >> 20).GetCompact();
+
+    vector<CScript> vScripts;
+    for (unsigned int i = 0; i < (nCoins + nCoinsPerKey - 1) / nCoinsPerKey; i++)
+    {
+        uint256 hashSecret = BenchHash("key", i);
+        CKey key;
+        key.SetSecret(CSecret(hashSecret.begin(), hashSecret.end()), true);
+        if (!pwallet->AddKey(key))
+            return false;
+        CScript script;
+        script.SetDestination(key.GetPubKey().GetID());
+        vScripts.push_back(script);
+    }
+
+    CTxDB txdb("cr+");
+    int64 nTime = nTimeStart;
+    unsigned int nCoin = 0;
+    while (nCoin < nCoins)
+    {
+        CBlock block;
+        block.hashPrevBlock = (pindexBest ? pindexBest->GetBlockHash() : 0);
+        block.nTime = nTime;
+        block.nBits = nBitsBench;
+        block.nNonce = nCoin;
+        for (unsigned int i = 0; i < nCoinsPerBlock && nCoin < nCoins; i++, nCoin++)
+        {
+            CTransaction tx;
+            tx.nTime = nTime;
+            tx.vin.push_back(CTxIn(BenchHash("prevout", nCoin), 0));
+            tx.vout.push_back(CTxOut((100 + BenchHash("value", nCoin).Get64() % 900) * COIN, vScripts[nCoin / nCoinsPerKey]));
+            block.vtx.push_back(tx);
+        }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+
+        unsigned int nFile, nBlockPos;
+        if (!block.WriteToDisk(nFile, nBlockPos))
+            return false;
+        AddBenchBlockIndex(block, nFile, nBlockPos, BenchHash("modifier", nBestHeight + 1).Get64());
+
+        unsigned int nTxPos = nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            if (!txdb.UpdateTxIndex(tx.GetHash(), CTxIndex(CDiskTxPos(nFile, nBlockPos, nTxPos), tx.vout.size())))
+                return false;
+            if (!txdb.WriteCoins(tx.GetHash(), CCoins(tx, nBestHeight)))
+                return false;
+            nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+
+            CWalletTx wtx(pwallet, tx);
+            wtx.SetMerkleBranch(&block);
+            if (!pwallet->AddToWallet(wtx))
+                return false;
+        }
+        nTime += STAKE_TARGET_SPACING;
+    }
+
+    // Extend the chain up to the end of the benchmark
+    for (; nTime <= nTimeEnd; nTime += nModifierInterval)
+    {
+        CBlock block;
+        block.hashPrevBlock = pindexBest->GetBlockHash();
+        block.nTime = nTime;
+        block.nBits = nBitsBench;
+        AddBenchBlockIndex(block, 0, 0, BenchHash("modifier", nBestHeight + 1).Get64());
+    }
+    return true;
+}
+
+// Measures how long another thread waits for the locks CreateCoinStake takes
+class CLockProbe
+{
+public:
+    CWallet* pwallet;
+    bool fStop;
+    int64 nWaits;
+    int64 nWaitTotal;
+    int64 nWaitMax;
+
+    CLockProbe(CWallet* pwalletIn)
+    {
+        pwallet = pwalletIn;
+        fStop = false;
+        nWaits = 0;
+        nWaitTotal = 0;
+        nWaitMax = 0;
+    }
+
+    void Run()
+    {
+        while (!fStop)
+        {
+            int64 nStart = GetTimeMicros();
+            {
+                LOCK2(cs_main, pwallet->cs_wallet);
+            }
+            int64 nWait = GetTimeMicros() - nStart;
+            nWaits++;
+            nWaitTotal += nWait;
+            nWaitMax = max(nWaitMax, nWait);
+            this_thread::sleep(posix_time::milliseconds(1));
+        }
+    }
+};
+
+// Spends the first output of each transaction in blocks of 100 inputs, either
+// through the coins as ConnectBlock does now or through the transaction index
+// and the block files as it did before the coins existed
+static bool BenchSpendCoins(const vector<uint256>& vHashes, bool fCoins)
+{
+    CTxDB txdb("r+");
+    for (unsigned int i = 0; i < vHashes.size(); i += 100)
+    {
+        if (!txdb.TxnBegin())
+            return false;
+        for (unsigned int j = i; j < vHashes.size() && j < i + 100; j++)
+        {
+            const uint256& hash = vHashes[j];
+            if (fCoins)
+            {
+                CCoins coins;
+                if (!txdb.ReadCoins(hash, coins) || !coins.IsAvailable(0))
+                {
+                    txdb.TxnAbort();
+                    return false;
+                }
+                coins.Spend(0);
+                txdb.WriteCoins(hash, coins);
+            }
+            else
+            {
+                CTxIndex txindex;
+                CTransaction tx;
+                if (!txdb.ReadTxIndex(hash, txindex) || !tx.ReadFromDisk(txindex.pos) || txindex.vSpent.empty() || !txindex.vSpent[0].IsNull())
+                {
+                    txdb.TxnAbort();
+                    return false;
+                }
+                txindex.vSpent[0] = txindex.pos;
+                txdb.UpdateTxIndex(hash, txindex);
+            }
+        }
+        if (fCoins)
+            txdb.WriteHashBestChain(hashBestChain);
+        if (!txdb.TxnCommit())
+            return false;
+    }
+    return true;
+}
+
+// Coins old enough to stake at nTimeTx, derived from n like the chain
+static void CreateBenchKernels(vector<CStakeKernel>& vKernels, unsigned int nCoins, unsigned int nTimeTx)
+{
+    vKernels.clear();
+    for (unsigned int i = 0; i < nCoins; i++)
+    {
+        uint256 hash = BenchHash("kernel", i);
+        unsigned int nTimeTxPrev = nTimeTx - nStakeMinAge - hash.Get64(0) % STAKE_MAX_AGE;
+        vKernels.push_back(CStakeKernel(hash.Get64(1), nTimeTxPrev - hash.Get64(2) % 600, hash.Get64(3) % 1000000,
+            nTimeTxPrev, COutPoint(hash, i % 4), (1 + hash.Get64(0) % 10000) * COIN));
+    }
+}
+
+// Kernel search of CreateCoinStake with a target no coin meets, so that
+// every coin is hashed over the whole search interval
+static void BenchKernelSearch(const vector<CStakeKernel>& vKernels, unsigned int nTimeTx, unsigned int nSearchInterval)
+{
+    unsigned int nBitsNone = CBigNum(1).GetCompact();
+    for (int nThreads = 1; nThreads <= 8; nThreads *= 2)
+    {
+        unsigned int nKernel, nTimeTxFound;
+        uint256 hashProofOfStake;
+        int64 nStart = GetTimeMillis();
+        FindStakeKernel(nBitsNone, vKernels, nTimeTx, nSearchInterval, nThreads, nKernel, nTimeTxFound, hashProofOfStake);
+        fprintf(stdout, "search x%-3d %15"PRI64d"ms  %u hashes\n", nThreads, GetTimeMillis() - nStart, (unsigned int)vKernels.size() * nSearchInterval);
+    }
+}
+
+// Kernel hashes of a whole search interval one at a time and batched, for a
+// target no coin meets
+static void BenchKernelHashBatch(const vector<CStakeKernel>& vKernels, unsigned int nTimeTx, unsigned int nSearchInterval)
+{
+    unsigned int nBitsNone = CBigNum(1).GetCompact();
+    uint256 hashProofOfStake;
+    unsigned int nTimeTxFound;
+    int64 nStart = GetTimeMillis();
+    BOOST_FOREACH(const CStakeKernel& kernel, vKernels)
+        for (unsigned int n = 0; n < nSearchInterval; n++)
+            CheckStakeKernelHash(nBitsNone, kernel, nTimeTx - n, hashProofOfStake);
+    fprintf(stdout, "hash single %15"PRI64d"ms  %u hashes\n", GetTimeMillis() - nStart, (unsigned int)vKernels.size() * nSearchInterval);
+    nStart = GetTimeMillis();
+    BOOST_FOREACH(const CStakeKernel& kernel, vKernels)
+        CheckStakeKernelHashBatch(nBitsNone, kernel, nTimeTx, nSearchInterval, nTimeTxFound, hashProofOfStake);
+    fprintf(stdout, "hash batch  %15"PRI64d"ms  %u hashes\n", GetTimeMillis() - nStart, (unsigned int)vKernels.size() * nSearchInterval);
+}
+
+// Stake modifiers of a day of blocks, a mix of proof-of-work and
+// proof-of-stake blocks with timestamps that are not always increasing
+static void BenchStakeModifier(int64 nTimeStart)
+{
+    const int nBlocks = 24 * 60 * 60 / STAKE_TARGET_SPACING;
+    vector<uint256> vHashes(nBlocks);
+    vector<CBlockIndex> vBlocks(nBlocks);
+    for (int i = 0; i < nBlocks; i++)
+    {
+        CBlockIndex& block = vBlocks[i];
+        vHashes[i] = BenchHash("modifier", i);
+        block.phashBlock = &vHashes[i];
+        block.nHeight = i;
+        block.pprev = (i > 0 ? &vBlocks[i - 1] : NULL);
+        if (i > 0)
+            vBlocks[i - 1].pnext = &block;
+        block.nTime = nTimeStart + i * STAKE_TARGET_SPACING + vHashes[i].Get64(0) % (STAKE_TARGET_SPACING * 2) - STAKE_TARGET_SPACING;
+        if (vHashes[i].Get64(1) % 2)
+        {
+            block.SetProofOfStake();
+            block.hashProofOfStake = BenchHash("modifierstake", i);
+        }
+        block.SetStakeEntropyBit(vHashes[i].Get64(2) % 2);
+    }
+    vBlocks[0].SetStakeModifier(0, true);
+
+    int nGenerated = 0;
+    int64 nStart = GetTimeMillis();
+    for (int i = 1; i < nBlocks; i++)
+    {
+        uint64 nStakeModifier = 0;
+        bool fGenerated = false;
+        ComputeNextStakeModifier(&vBlocks[i], nStakeModifier, fGenerated);
+        vBlocks[i].SetStakeModifier(nStakeModifier, fGenerated);
+        if (fGenerated)
+            nGenerated++;
+    }
+    fprintf(stdout, "modifier    %15"PRI64d"ms  %d blocks, %d modifiers\n", GetTimeMillis() - nStart, nBlocks, nGenerated);
+}
+
+// Stake weight queries of the staking loop for nCoins outputs, summed per
+// output as GetStakeWeight did and from the age buckets of CStakeWeight
+static void BenchStakeWeight(unsigned int nCoins, int64 nTime, int nHeight, int nQueries)
+{
+    vector<pair<int64, int64> > vCoins;
+    CStakeWeight stakeWeight;
+    stakeWeight.SetTime(nTime, nHeight);
+    for (unsigned int i = 0; i < nCoins; i++)
+    {
+        uint256 hash = BenchHash("weight", i);
+        int64 nValue = (1 + hash.Get64(0) % 100000) * CENT;
+        int64 nTimeCoin = nTime - hash.Get64(1) % (2 * STAKE_MAX_AGE);
+        vCoins.push_back(make_pair(nValue, nTimeCoin));
+        stakeWeight.AddCoin(COutPoint(hash, 0), nValue, nTimeCoin, nHeight);
+    }
+
+    uint64 nWeight = 0;
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < nQueries; i++)
+    {
+        nWeight = 0;
+        for (unsigned int j = 0; j < vCoins.size(); j++)
+        {
+            int64 nTimeWeight = min(nTime + i - vCoins[j].second - STAKE_MIN_AGE, (int64)STAKE_MAX_AGE);
+            CBigNum bnCoinDayWeight = CBigNum(vCoins[j].first) * nTimeWeight / COIN / (24 * 60 * 60);
+            if (nTimeWeight > 0)
+                nWeight += bnCoinDayWeight.getuint64();
+        }
+    }
+    fprintf(stdout, "weight sum  %15"PRI64d"us avg  %u outputs\n", (GetTimeMicros() - nStart) / nQueries, nCoins);
+
+    uint64 nMinWeight, nMaxWeight;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nQueries; i++)
+    {
+        stakeWeight.SetTime(nTime + i, nHeight);
+        stakeWeight.GetWeight(nMinWeight, nMaxWeight, nWeight);
+    }
+    fprintf(stdout, "weight buck %15"PRI64d"us avg  %u outputs\n", (GetTimeMicros() - nStart) / nQueries, nCoins);
+}
+
+// Primenode key lookups of IsPrimeStake for a key that isn't registered, so
+// that every key is tried: reading the keys from the database as before the
+// registry existed, verifying the registered keys and recovering the key
+static bool BenchPrimeNodeLookup(int nLookups)
+{
+    primeNodeDB = new CPrimeNodeDB("cr");
+    if (!InflatePrimeNodeDB(CPrimeNodeDB::primedb))
+        return false;
+
+    CKey key;
+    key.MakeNewKey(false);
+    CPrivKey vchPrivKey = key.GetPrivKey();
+    unsigned int nTime = GetTime();
+    CScript scriptPrimeID;
+    if (!NewScriptPrimeID(scriptPrimeID, vector<unsigned char>(vchPrivKey.begin(), vchPrivKey.end()), nTime))
+        return false;
+
+    CPrimeNodeDBEntry entry;
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < nLookups; i++)
+        primeNodeDB->IsPrimeNodeKey(scriptPrimeID, nTime, entry);
+    fprintf(stdout, "prime db    %15"PRI64d"us avg  %u keys\n", (GetTimeMicros() - nStart) / nLookups, (unsigned int)primeNodeRegistry.size());
+
+    const char* pszModes[] = {"prime find", "prime recov"};
+    for (int nMode = 0; nMode < 2; nMode++)
+    {
+        primeNodeRegistry.SetRecoverKeys(nMode == 1);
+        nStart = GetTimeMicros();
+        for (int i = 0; i < nLookups; i++)
+            primeNodeRegistry.IsPrimeNodeKey(scriptPrimeID, nTime, entry);
+        fprintf(stdout, "%-11s %15"PRI64d"us avg\n", pszModes[nMode], (GetTimeMicros() - nStart) / nLookups);
+    }
+
+    delete primeNodeDB;
+    primeNodeDB = NULL;
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    fPrintToConsole = false;
+
+    unsigned int nCoins = GetArg("-coins", 10000);
+    int nRounds = GetArg("-rounds", 100);
+    int64 nSearchInterval = GetArg("-searchinterval", 60);
+
+    filesystem::path pathBench;
+    if (!mapArgs.count("-datadir"))
+    {
+        pathBench = filesystem::temp_directory_path() / filesystem::unique_path("bench_trollocoin_%%%%%%%%");
+        filesystem::create_directories(pathBench);
+        mapArgs["-datadir"] = pathBench.string();
+    }
+
+    bitdb.MakeMock();
+    if (GetArg("-txdb", "bdb") == "log" && !OpenLogTxDB())
+    {
+        fprintf(stderr, "bench_trollocoin: failed to open the transaction database log store\n");
+        return 1;
+    }
+    scrapesDB = new CScrapesDB("cw");
+    bool fFirstRun;
+    CWallet* pwallet = new CWallet("wallet.dat");
+    pwallet->LoadWallet(fFirstRun);
+    pwalletMain = pwallet;
+
+    // Coins are two days old when the first round starts
+    int64 nTimeStart = STAKE_START_TIME + 30 * 24 * 60 * 60;
+    int64 nTimeFirstRound = nTimeStart + 2 * 24 * 60 * 60;
+    int64 nTimeLastRound = nTimeFirstRound + nRounds * nSearchInterval;
+    SetMockTime(nTimeStart);
+
+    int64 nStart = GetTimeMillis();
+    if (!CreateBenchChain(pwallet, nCoins, nTimeStart, nTimeLastRound))
+    {
+        fprintf(stderr, "bench_trollocoin: failed to create the synthetic chain\n");
+        return 1;
+    }
+    fprintf(stdout, "setup       %15"PRI64d"ms  %u coins, %d blocks\n", GetTimeMillis() - nStart, nCoins, nBestHeight + 1);
+
+    // Rescan as -rescan and importprivkey run it, every coin is found again
+    nStart = GetTimeMillis();
+    int nRescanned = pwallet->ScanForWalletTransactions(pindexGenesisBlock, true);
+    fprintf(stdout, "rescan      %15"PRI64d"ms  %d transactions\n", GetTimeMillis() - nStart, nRescanned);
+
+    // Key pool refill as keypoolrefill runs it
+    int nKeyPoolRefill = GetArg("-keypoolrefill", 1000);
+    mapArgs["-keypool"] = strprintf("%d", nKeyPoolRefill);
+    nStart = GetTimeMillis();
+    pwallet->TopUpKeyPool();
+    fprintf(stdout, "keypool     %15"PRI64d"ms  %d keys\n", GetTimeMillis() - nStart, nKeyPoolRefill);
+
+    // Wallet load as at startup, from the records written above
+    nStart = GetTimeMillis();
+    CWallet* pwalletLoaded = new CWallet("wallet.dat");
+    pwalletLoaded->LoadWallet(fFirstRun);
+    fprintf(stdout, "load        %15"PRI64d"ms  %u transactions\n", GetTimeMillis() - nStart, (unsigned int)pwalletLoaded->mapWallet.size());
+
+    // Transactions as sendtoaddress creates them, without committing them
+    SetMockTime(nTimeFirstRound);
+    int nSends = GetArg("-sends", 100);
+    int nSendsFailed = 0;
+    int64 nTimeSends = 0;
+    int64 nTimeSendMax = 0;
+    for (int nSend = 0; nSend < nSends; nSend++)
+    {
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(CKeyID(uint160(BenchHash("send", nSend).Get64())));
+        int64 nValue = (1 + BenchHash("sendvalue", nSend).Get64() % 5000) * COIN;
+        CWalletTx wtx;
+        CReserveKey reservekey(pwallet);
+        int64 nFeeRequired;
+        int64 nSendStart = GetTimeMicros();
+        if (!pwallet->CreateTransaction(scriptPubKey, nValue, wtx, reservekey, nFeeRequired))
+            nSendsFailed++;
+        int64 nSendTime = GetTimeMicros() - nSendStart;
+        reservekey.ReturnKey();
+
+        nTimeSends += nSendTime;
+        nTimeSendMax = max(nTimeSendMax, nSendTime);
+    }
+    fprintf(stdout, "send        %15"PRI64d"us avg %"PRI64d"us max, %d of %d failed\n", nSends ? nTimeSends / nSends : 0, nTimeSendMax, nSendsFailed, nSends);
+
+    // Default target finds a kernel in about one of ten rounds
+    unsigned int nBits;
+    if (mapArgs.count("-stakebits"))
+        nBits = strtoul(mapArgs["-stakebits"].c_str(), NULL, 16);
+    else
+    {
+        CBigNum bnCoinDays = 0;
+        BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, pwallet->mapWallet)
+            bnCoinDays += CBigNum(item.second.vout[0].nValue) * (nTimeFirstRound - item.second.nTime - nStakeMinAge) / COIN / (24 * 60 * 60);
+        nBits = ((CBigNum(1) << 256) / (bnCoinDays * nSearchInterval * 10)).GetCompact();
+    }
+
+    CLockProbe probe(pwallet);
+    thread threadProbe(bind(&CLockProbe::Run, &probe));
+
+    int nKernels = 0;
+    int nRoundsWithout = 0;
+    int64 nTimeRounds = 0;
+    int64 nTimeRoundsWithout = 0;
+    int64 nTimeRoundMax = 0;
+    for (int nRound = 0; nRound < nRounds; nRound++)
+    {
+        SetMockTime(nTimeFirstRound + nRound * nSearchInterval);
+        CTransaction txCoinStake;
+        int64 nRoundStart = GetTimeMicros();
+        bool fKernel = pwallet->CreateCoinStake(*pwallet, nBits, nSearchInterval, txCoinStake, pindexBest->nMoneySupply);
+        int64 nRoundTime = GetTimeMicros() - nRoundStart;
+
+        nTimeRounds += nRoundTime;
+        nTimeRoundMax = max(nTimeRoundMax, nRoundTime);
+        if (fKernel)
+            nKernels++;
+        else
+        {
+            nRoundsWithout++;
+            nTimeRoundsWithout += nRoundTime;
+        }
+    }
+
+    probe.fStop = true;
+    threadProbe.join();
+
+    // Rounds without a kernel hash every coin over the whole search interval
+    double dHashRate = nTimeRoundsWithout ? (double)nRoundsWithout * nCoins * min(nSearchInterval, (int64)60) * 1000000 / nTimeRoundsWithout : 0;
+    fprintf(stdout, "stakebits   %15x\n", nBits);
+    fprintf(stdout, "rounds      %15d\n", nRounds);
+    fprintf(stdout, "kernels     %15d\n", nKernels);
+    fprintf(stdout, "hashes/s    %15.0f\n", dHashRate);
+    fprintf(stdout, "round       %15"PRI64d"us avg %"PRI64d"us max\n", nRounds ? nTimeRounds / nRounds : 0, nTimeRoundMax);
+    fprintf(stdout, "lock wait   %15"PRI64d"us avg %"PRI64d"us max\n", probe.nWaits ? probe.nWaitTotal / probe.nWaits : 0, probe.nWaitMax);
+
+    // Input lookups of initial block download, with and without the coins
+    vector<uint256> vHashes;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, pwallet->mapWallet)
+        vHashes.push_back(item.first);
+    {
+        CTxDB txdb("r+");
+        txdb.Flush();
+    }
+    const char* pszSpendModes[] = {"ibd txindex", "ibd coins"};
+    for (int nMode = 0; nMode < 2; nMode++)
+    {
+        nStart = GetTimeMillis();
+        if (!BenchSpendCoins(vHashes, nMode == 1))
+        {
+            fprintf(stderr, "bench_trollocoin: spending the coins failed\n");
+            return 1;
+        }
+        fprintf(stdout, "%-11s %15"PRI64d"ms  %u inputs\n", pszSpendModes[nMode], GetTimeMillis() - nStart, (unsigned int)vHashes.size());
+    }
+
+    // Kernel search over the same number of coins with 1 to 8 threads, and
+    // the hashing it does with and without batches
+    vector<CStakeKernel> vKernels;
+    CreateBenchKernels(vKernels, nCoins, nTimeFirstRound);
+    BenchKernelSearch(vKernels, nTimeFirstRound, nSearchInterval);
+    BenchKernelHashBatch(vKernels, nTimeFirstRound, nSearchInterval);
+
+    BenchStakeModifier(nTimeStart);
+    BenchStakeWeight(nCoins, nTimeFirstRound, nBestHeight, 100);
+
+    if (!BenchPrimeNodeLookup(200))
+    {
+        fprintf(stderr, "bench_trollocoin: failed to load the primenode keys or create an ID script\n");
+        return 1;
+    }
+
+    delete pwallet;
+    pwalletMain = NULL;
+    CloseLogTxDB();
+    bitdb.Flush(true);
+    if (!pathBench.empty())
+        filesystem::remove_all(pathBench);
+    return 0;
+}
@@ -499,7 +499,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             entry.push_back(Pair("hash", txHash.GetHex()));
 
             MapPrevTx mapInputs;
-            map<uint256, CTxIndex> mapUnused;
+            map<uint256, CCoins> mapUnused;
             bool fInvalid = false;
             if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
             {
@@ -652,9 +652,8 @@ Value gettxout(const Array& params, bool fHelp)
         CTxIndex txindex;
         if (!txdb.ReadTxIndex(hash, txindex))
             return Value::null;
-        if (n >= txindex.vSpent.size())
-            return Value::null;
-        if (!txindex.vSpent[n].IsNull())
+        CCoins coins;
+        if (!txdb.ReadCoins(hash, coins) || !coins.IsAvailable(n))
             return Value::null;
         if (!tx.ReadFromDisk(txindex.pos))
             return Value::null;
@@ -765,7 +764,8 @@ static const CRPCCommand vRPCCommands[] =
     { "listscrapeaddresses",    &listscrapeaddresses,    true },
     { "setscrapeaddress",       &setscrapeaddress,       true },
     { "deletescrapeaddress",    &deletescrapeaddress,    true },
-    { "listmicroprimedata",     &listmicroprimedata,     true }
+    { "listmicroprimedata",     &listmicroprimedata,     true },
+    { "getprimestakecacheinfo", &getprimestakecacheinfo, true }
 };
 
 CRPCTable::CRPCTable()
@@ -0,0 +1,336 @@
+// Copyright (c) 2015 The Trollocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+#include "sync.h"
+#include "util.h"
+
+#include <list>
+#include <map>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace boost;
+
+// Block files are mapped in windows of up to twice this size starting at a
+// multiple of it, so a window holds every block whose header starts in its
+// first half. Blocks are far smaller than this.
+static const unsigned int BLOCKFILE_WINDOW_SIZE = 0x1000000; // 16 MiB
+static const unsigned int BLOCKFILE_HEADER_SIZE = 8; // message start and size
+
+// Files grow in chunks of this size, so they are written into few extents
+static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
+
+// Block positions are 32-bit, and stay below the 4 GiB of FAT32. Without
+// large file support they must stay below 2 GiB.
+#ifdef WIN32
+static const uint64 MAX_BLOCKFILE_SIZE = 0xF0000000;
+#else
+static const uint64 MAX_BLOCKFILE_SIZE = sizeof(off_t) > 4 ? 0xF0000000 : 0x7F000000;
+#endif
+
+// Keeps the address space used by mappings at 2 GiB, 256 MiB on 32-bit
+static const unsigned int BLOCKFILE_MAX_MAPPINGS = sizeof(void*) > 4 ? 64 : 8;
+
+typedef pair<unsigned int, unsigned int> CBlockFileWindow; // file, window
+typedef list<pair<CBlockFileWindow, shared_ptr<CBlockFileMapping> > > CBlockFileMappingList;
+
+static CCriticalSection cs_blockfiles;
+// Least recently used mappings at the back
+static CBlockFileMappingList listMappings;
+static map<CBlockFileWindow, CBlockFileMappingList::iterator> mapMappings;
+
+static CCriticalSection cs_blockfilewrite;
+static map<unsigned int, CBlockFileInfo> mapBlockFileInfo;
+static unsigned int nBlockFileWrite = 1;
+static FILE* fileBlockWrite = NULL;
+static uint64 nBlockFileAllocated = 0;
+
+boost::filesystem::path GetBlockFilePath(unsigned int nFile)
+{
+    return GetDataDir() / strprintf("blk%04d.dat", nFile);
+}
+
+static bool SeekFile(FILE* file, uint64 nPos)
+{
+#ifdef WIN32
+    return _fseeki64(file, nPos, SEEK_SET) == 0;
+#else
+    return fseeko(file, nPos, SEEK_SET) == 0;
+#endif
+}
+
+void SetBlockFileInfo(unsigned int nFile, const CBlockFileInfo& info)
+{
+    LOCK(cs_blockfilewrite);
+    mapBlockFileInfo[nFile] = info;
+    if (nFile > nBlockFileWrite && !fileBlockWrite)
+        nBlockFileWrite = nFile;
+}
+
+bool GetBlockFileInfo(unsigned int nFile, CBlockFileInfo& info)
+{
+    LOCK(cs_blockfilewrite);
+    map<unsigned int, CBlockFileInfo>::iterator mi = mapBlockFileInfo.find(nFile);
+    if (mi == mapBlockFileInfo.end())
+        return false;
+    info = (*mi).second;
+    return true;
+}
+
+CBlockFileInfo AddBlockToFileInfo(unsigned int nFile, int nHeight, unsigned int nTime)
+{
+    LOCK(cs_blockfilewrite);
+    CBlockFileInfo& info = mapBlockFileInfo[nFile];
+    info.AddBlock(nHeight, nTime);
+    return info;
+}
+
+// requires cs_blockfilewrite
+static bool OpenWriteFile(unsigned int nFile)
+{
+    string strPath = GetBlockFilePath(nFile).string();
+    FILE* file = fopen(strPath.c_str(), "rb+");
+    if (!file)
+        file = fopen(strPath.c_str(), "wb+");
+    if (!file)
+        return error("AppendBlockFile() : opening blk%04u.dat failed", nFile);
+    boost::system::error_code ec;
+    uint64 nFileSize = filesystem::file_size(strPath, ec);
+    if (ec)
+    {
+        fclose(file);
+        return error("AppendBlockFile() : size of blk%04u.dat unknown", nFile);
+    }
+
+    // A file the block index does not know is written after its end, as
+    // appending did before. Otherwise writing resumes after the blocks in
+    // the index, over the preallocated space and any block a crash left
+    // out of the index.
+    map<unsigned int, CBlockFileInfo>::iterator mi = mapBlockFileInfo.find(nFile);
+    if (mi == mapBlockFileInfo.end())
+    {
+        mi = mapBlockFileInfo.insert(make_pair(nFile, CBlockFileInfo())).first;
+        (*mi).second.nSize = nFileSize;
+    }
+    if (!SeekFile(file, (*mi).second.nSize))
+    {
+        fclose(file);
+        return error("AppendBlockFile() : seek in blk%04u.dat failed", nFile);
+    }
+    fileBlockWrite = file;
+    nBlockFileWrite = nFile;
+    nBlockFileAllocated = max(nFileSize, (*mi).second.nSize);
+    return true;
+}
+
+// requires cs_blockfilewrite
+static void CloseWriteFile(bool fFinished)
+{
+    if (!fileBlockWrite)
+        return;
+    fflush(fileBlockWrite);
+    // The preallocated space of a full file is not needed any more
+    if (fFinished && !TruncateFile(fileBlockWrite, mapBlockFileInfo[nBlockFileWrite].nSize))
+        printf("AppendBlockFile() : truncating blk%04u.dat failed\n", nBlockFileWrite);
+    FileCommit(fileBlockWrite);
+    fclose(fileBlockWrite);
+    fileBlockWrite = NULL;
+}
+
+bool AppendBlockFile(const CDataStream& ssBlock, bool fSync, unsigned int& nFileRet, unsigned int& nBlockPosRet)
+{
+    LOCK(cs_blockfilewrite);
+    if (!fileBlockWrite && !OpenWriteFile(nBlockFileWrite))
+        return false;
+    if (mapBlockFileInfo[nBlockFileWrite].nSize + ssBlock.size() > MAX_BLOCKFILE_SIZE)
+    {
+        CloseWriteFile(true);
+        if (!OpenWriteFile(nBlockFileWrite + 1))
+            return false;
+    }
+    CBlockFileInfo& info = mapBlockFileInfo[nBlockFileWrite];
+
+    uint64 nEnd = info.nSize + ssBlock.size();
+    if (nEnd > nBlockFileAllocated)
+    {
+        uint64 nAllocate = min((nEnd + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE * BLOCKFILE_CHUNK_SIZE, MAX_BLOCKFILE_SIZE);
+        AllocateFileRange(fileBlockWrite, nBlockFileAllocated, nAllocate - nBlockFileAllocated);
+        nBlockFileAllocated = nAllocate;
+        if (!SeekFile(fileBlockWrite, info.nSize))
+        {
+            CloseWriteFile(false);
+            return error("AppendBlockFile() : seek in blk%04u.dat failed", nBlockFileWrite);
+        }
+    }
+
+    if (fwrite(&ssBlock[0], 1, ssBlock.size(), fileBlockWrite) != ssBlock.size() || fflush(fileBlockWrite) != 0)
+    {
+        // Opening the file again seeks back to the end of the blocks
+        CloseWriteFile(false);
+        return error("AppendBlockFile() : writing blk%04u.dat failed", nBlockFileWrite);
+    }
+    if (fSync)
+        FileCommit(fileBlockWrite);
+
+    nFileRet = nBlockFileWrite;
+    nBlockPosRet = info.nSize + BLOCKFILE_HEADER_SIZE;
+    info.nSize = nEnd;
+    return true;
+}
+
+// Makes the blocks written so far durable, before the index that points at them
+void FlushBlockFile()
+{
+    LOCK(cs_blockfilewrite);
+    if (fileBlockWrite)
+        FileCommit(fileBlockWrite);
+}
+
+void CloseBlockFile()
+{
+    LOCK(cs_blockfilewrite);
+    CloseWriteFile(false);
+}
+
+CBlockFileMapping::CBlockFileMapping(const char* pbeginIn, unsigned int nOffsetIn, unsigned int nSizeIn, bool fFullIn)
+{
+    pbegin = pbeginIn;
+    nOffset = nOffsetIn;
+    nSize = nSizeIn;
+    fFull = fFullIn;
+}
+
+CBlockFileMapping::~CBlockFileMapping()
+{
+#ifdef WIN32
+    UnmapViewOfFile(pbegin);
+#else
+    munmap((void*)pbegin, nSize);
+#endif
+}
+
+static shared_ptr<CBlockFileMapping> MapWindow(unsigned int nFile, unsigned int nWindow)
+{
+    shared_ptr<CBlockFileMapping> mapping;
+    string strPath = GetBlockFilePath(nFile).string();
+    uint64 nOffset = (uint64)nWindow * BLOCKFILE_WINDOW_SIZE;
+    uint64 nFileSize;
+    void* p;
+
+#ifdef WIN32
+    HANDLE hFile = CreateFileA(strPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return mapping;
+    LARGE_INTEGER nFileSizeWin;
+    if (!GetFileSizeEx(hFile, &nFileSizeWin) || (uint64)nFileSizeWin.QuadPart <= nOffset)
+    {
+        CloseHandle(hFile);
+        return mapping;
+    }
+    nFileSize = nFileSizeWin.QuadPart;
+    unsigned int nSize = min(nFileSize - nOffset, (uint64)2 * BLOCKFILE_WINDOW_SIZE);
+    // The view keeps the file and the mapping object open
+    HANDLE hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (hMap == NULL)
+        return mapping;
+    p = MapViewOfFile(hMap, FILE_MAP_READ, (DWORD)(nOffset >> 32), (DWORD)nOffset, nSize);
+    CloseHandle(hMap);
+    if (p == NULL)
+        return mapping;
+#else
+    int fd = open(strPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return mapping;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64)st.st_size <= nOffset)
+    {
+        close(fd);
+        return mapping;
+    }
+    nFileSize = st.st_size;
+    unsigned int nSize = min(nFileSize - nOffset, (uint64)2 * BLOCKFILE_WINDOW_SIZE);
+    // The mapping keeps the file open
+    p = mmap(NULL, nSize, PROT_READ, MAP_SHARED, fd, nOffset);
+    close(fd);
+    if (p == MAP_FAILED)
+        return mapping;
+#endif
+
+    mapping.reset(new CBlockFileMapping((const char*)p, nOffset, nSize, nSize == 2 * BLOCKFILE_WINDOW_SIZE));
+    return mapping;
+}
+
+// requires cs_blockfiles
+static shared_ptr<CBlockFileMapping> GetMapping(const CBlockFileWindow& window, bool fRemap)
+{
+    map<CBlockFileWindow, CBlockFileMappingList::iterator>::iterator mi = mapMappings.find(window);
+    if (mi != mapMappings.end())
+    {
+        if (!fRemap)
+        {
+            listMappings.splice(listMappings.begin(), listMappings, (*mi).second);
+            return (*(*mi).second).second;
+        }
+        listMappings.erase((*mi).second);
+        mapMappings.erase(mi);
+    }
+
+    shared_ptr<CBlockFileMapping> mapping = MapWindow(window.first, window.second);
+    if (!mapping)
+        return mapping;
+    listMappings.push_front(make_pair(window, mapping));
+    mapMappings[window] = listMappings.begin();
+    while (listMappings.size() > BLOCKFILE_MAX_MAPPINGS)
+    {
+        // Readers still using it keep the mapping until they are done
+        mapMappings.erase(listMappings.back().first);
+        listMappings.pop_back();
+    }
+    return mapping;
+}
+
+static bool FindBlock(const shared_ptr<CBlockFileMapping>& mapping, unsigned int nBlockPos, CBlockFileSpan& span)
+{
+    unsigned int nPos = nBlockPos - mapping->nOffset;
+    if (nPos > mapping->nSize)
+        return false;
+    unsigned int nSize;
+    memcpy(&nSize, mapping->pbegin + nPos - sizeof(nSize), sizeof(nSize));
+    if (nSize > mapping->nSize - nPos)
+        return false;
+    span.mapping = mapping;
+    span.pbegin = mapping->pbegin + nPos;
+    span.pend = span.pbegin + nSize;
+    return true;
+}
+
+bool MapBlockFile(unsigned int nFile, unsigned int nBlockPos, CBlockFileSpan& span)
+{
+    if (nFile == (unsigned int)-1 || nBlockPos < BLOCKFILE_HEADER_SIZE)
+        return false;
+    CBlockFileWindow window(nFile, (nBlockPos - BLOCKFILE_HEADER_SIZE) / BLOCKFILE_WINDOW_SIZE);
+
+    LOCK(cs_blockfiles);
+    shared_ptr<CBlockFileMapping> mapping = GetMapping(window, false);
+    if (mapping && FindBlock(mapping, nBlockPos, span))
+        return true;
+
+    // The block was appended after the end of the file was mapped
+    if (mapping && mapping->fFull)
+        return error("MapBlockFile() : no block at %u in blk%04u.dat", nBlockPos, nFile);
+    mapping = GetMapping(window, true);
+    if (!mapping)
+        return error("MapBlockFile() : mapping blk%04u.dat at %u failed", nFile, nBlockPos);
+    if (!FindBlock(mapping, nBlockPos, span))
+        return error("MapBlockFile() : no block at %u in blk%04u.dat", nBlockPos, nFile);
+    return true;
+}
@@ -0,0 +1,121 @@
+// Copyright (c) 2015 The Trollocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BLOCKFILE_H
+#define BLOCKFILE_H
+
+#include "serialize.h"
+#include "util.h"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** What a block file holds, kept in the block index database so that files
+ * can be found by height or time without reading them
+ */
+class CBlockFileInfo
+{
+public:
+    unsigned int nBlocks;
+    uint64 nSize; // bytes in use, the rest of the file is preallocated
+    int nHeightFirst;
+    int nHeightLast;
+    unsigned int nTimeFirst;
+    unsigned int nTimeLast;
+
+    CBlockFileInfo()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nBlocks);
+        READWRITE(nSize);
+        READWRITE(nHeightFirst);
+        READWRITE(nHeightLast);
+        READWRITE(nTimeFirst);
+        READWRITE(nTimeLast);
+    )
+
+    void SetNull()
+    {
+        nBlocks = 0;
+        nSize = 0;
+        nHeightFirst = 0;
+        nHeightLast = 0;
+        nTimeFirst = 0;
+        nTimeLast = 0;
+    }
+
+    void AddBlock(int nHeight, unsigned int nTime)
+    {
+        if (nBlocks == 0 || nHeight < nHeightFirst)
+            nHeightFirst = nHeight;
+        if (nBlocks == 0 || nTime < nTimeFirst)
+            nTimeFirst = nTime;
+        if (nBlocks == 0 || nHeight > nHeightLast)
+            nHeightLast = nHeight;
+        if (nBlocks == 0 || nTime > nTimeLast)
+            nTimeLast = nTime;
+        nBlocks++;
+    }
+
+    std::string ToString() const
+    {
+        return strprintf("CBlockFileInfo(blocks=%u, size=%"PRI64u", heights=%d...%d, time=%s...%s)",
+            nBlocks, nSize, nHeightFirst, nHeightLast,
+            DateTimeStrFormat("%Y-%m-%d", nTimeFirst).c_str(),
+            DateTimeStrFormat("%Y-%m-%d", nTimeLast).c_str());
+    }
+};
+
+/** Read-only memory mapping of a window of a block file, unmapped when the
+ * last span using it is gone
+ */
+class CBlockFileMapping
+{
+public:
+    const char* pbegin;
+    unsigned int nOffset;
+    unsigned int nSize;
+    bool fFull;
+
+    CBlockFileMapping(const char* pbeginIn, unsigned int nOffsetIn, unsigned int nSizeIn, bool fFullIn);
+    ~CBlockFileMapping();
+
+private:
+    CBlockFileMapping(const CBlockFileMapping&);
+    void operator=(const CBlockFileMapping&);
+};
+
+/** A block as it is stored in a mapped block file */
+class CBlockFileSpan
+{
+public:
+    boost::shared_ptr<CBlockFileMapping> mapping;
+    const char* pbegin;
+    const char* pend;
+
+    CBlockFileSpan()
+    {
+        pbegin = pend = NULL;
+    }
+};
+
+boost::filesystem::path GetBlockFilePath(unsigned int nFile);
+
+// Block file writer: blocks are appended to the last block file, which is
+// kept open and grows in preallocated chunks
+void SetBlockFileInfo(unsigned int nFile, const CBlockFileInfo& info);
+bool GetBlockFileInfo(unsigned int nFile, CBlockFileInfo& info);
+CBlockFileInfo AddBlockToFileInfo(unsigned int nFile, int nHeight, unsigned int nTime);
+bool AppendBlockFile(const CDataStream& ssBlock, bool fSync, unsigned int& nFileRet, unsigned int& nBlockPosRet);
+void FlushBlockFile();
+void CloseBlockFile();
+
+// Finds the block written at nBlockPos of block file nFile in the mapped
+// block files, mapping the part of the file it is in if needed
+bool MapBlockFile(unsigned int nFile, unsigned int nBlockPos, CBlockFileSpan& span);
+
+#endif // BLOCKFILE_H
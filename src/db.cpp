@@ -12,7 +12,9 @@
 #include "main.h"
 #include "kernel.h"
 #include "protocol.h"
+#include "logdb.h"
 #include <boost/version.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
@@ -25,6 +27,9 @@ using namespace boost;
 
 unsigned int nWalletDBUpdated;
 
+// trollocoin: batch transactions open in this thread, by file
+static boost::thread_specific_ptr<map<string, DbTxn*> > batchtxns;
+
 //
 // CDB
 //
@@ -77,8 +82,10 @@ bool CDBEnv::Open(const boost::filesystem::path& path)
     dbenv.set_cachesize(nDbCache / 1024, (nDbCache % 1024)*1048576, 1);
     dbenv.set_lg_bsize(1048576);
     dbenv.set_lg_max(10485760);
-    dbenv.set_lk_max_locks(10000);
-    dbenv.set_lk_max_objects(10000);
+    // trollocoin: a write-back of the txdb cache locks every page it touches
+    // in one transaction
+    dbenv.set_lk_max_locks(537000);
+    dbenv.set_lk_max_objects(537000);
     dbenv.set_errfile(fopen(pathErrorFile.string().c_str(), "a")); /// debug
     dbenv.set_flags(DB_AUTO_COMMIT, 1);
     dbenv.set_flags(DB_TXN_WRITE_NOSYNC, 1);
@@ -142,7 +149,7 @@ void CDBEnv::CheckpointLSN(std::string strFile)
 }
 
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), activeTxn(NULL), fBatch(false)
 {
     int ret;
     if (pszFile == NULL)
@@ -202,6 +209,30 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
             bitdb.mapDb[strFile] = pdb;
         }
     }
+
+    if (batchtxns.get() && batchtxns->count(strFile))
+    {
+        activeTxn = (*batchtxns)[strFile];
+        fBatch = true;
+    }
+}
+
+bool CDB::TxnBeginBatch()
+{
+    if (!TxnBegin())
+        return false;
+    if (!batchtxns.get())
+        batchtxns.reset(new map<string, DbTxn*>());
+    (*batchtxns)[strFile] = activeTxn;
+    return true;
+}
+
+bool CDB::TxnCommitBatch()
+{
+    if (!pdb || !activeTxn || fBatch)
+        return false;
+    batchtxns->erase(strFile);
+    return TxnCommit();
 }
 
 static bool IsChainFile(std::string strFile)
@@ -216,6 +247,15 @@ void CDB::Close()
 {
     if (!pdb)
         return;
+    if (fBatch)
+    {
+        // The batch is committed and checkpointed by the CDB that began it
+        activeTxn = NULL;
+        pdb = NULL;
+        LOCK(bitdb.cs_db);
+        --bitdb.mapFileUseCount[strFile];
+        return;
+    }
     if (activeTxn)
         activeTxn->abort();
     activeTxn = NULL;
@@ -404,6 +444,294 @@ void CDBEnv::Flush(bool fShutdown)
 // CTxDB
 //
 
+/** CTxDB store in blkindex.dat */
+class CBerkeleyTxDBStore : public CTxDBStore, public CDB
+{
+public:
+    CBerkeleyTxDBStore(const char* pszMode) : CDB("blkindex.dat", pszMode) { }
+
+    bool Read(const CDataStream& ssKey, CDataStream& ssValue)
+    {
+        if (!pdb)
+            return false;
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        Dbt datValue;
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pdb->get(activeTxn, &datKey, &datValue, 0);
+        if (datValue.get_data() == NULL)
+            return false;
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write((char*)datValue.get_data(), datValue.get_size());
+        free(datValue.get_data());
+        return (ret == 0);
+    }
+
+    bool Write(const CDataStream& ssKey, const CDataStream& ssValue)
+    {
+        if (!pdb)
+            return false;
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        Dbt datValue((void*)&ssValue[0], ssValue.size());
+        return (pdb->put(activeTxn, &datKey, &datValue, 0) == 0);
+    }
+
+    bool Erase(const CDataStream& ssKey)
+    {
+        if (!pdb)
+            return false;
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        int ret = pdb->del(activeTxn, &datKey, 0);
+        return (ret == 0 || ret == DB_NOTFOUND);
+    }
+
+    bool Exists(const CDataStream& ssKey)
+    {
+        if (!pdb)
+            return false;
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        return (pdb->exists(activeTxn, &datKey, 0) == 0);
+    }
+
+    bool Scan(const CDataStream& ssKeyStart, boost::function<bool (CDataStream&, CDataStream&)> fn)
+    {
+        Dbc* pcursor = GetCursor();
+        if (!pcursor)
+            return false;
+        unsigned int fFlags = ssKeyStart.empty() ? DB_NEXT : DB_SET_RANGE;
+        for (;;)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            if (fFlags == DB_SET_RANGE)
+                ssKey = ssKeyStart;
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+            fFlags = DB_NEXT;
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+            {
+                pcursor->close();
+                return false;
+            }
+            if (!fn(ssKey, ssValue))
+                break;
+        }
+        pcursor->close();
+        return true;
+    }
+
+    bool TxnBegin() { return CDB::TxnBegin(); }
+    bool TxnCommit() { return CDB::TxnCommit(); }
+    bool TxnAbort() { return CDB::TxnAbort(); }
+    bool IsTxnActive() const { return activeTxn != NULL; }
+    void Close() { CDB::Close(); }
+};
+
+// trollocoin: the log store of -txdb=log, shared by every CTxDB
+static CLogDB* plogdbTxDB = NULL;
+
+static bool ScanLogDBRecord(const string& strKey, const string& strValue, boost::function<bool (CDataStream&, CDataStream&)> fn)
+{
+    CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+    CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+    return fn(ssKey, ssValue);
+}
+
+/** CTxDB store in the log store, a transaction collects its writes into one
+ * batch */
+class CLogTxDBStore : public CTxDBStore
+{
+private:
+    CLogDB* plogdb;
+    CLogDBBatch batch;
+    bool fTxn;
+
+public:
+    CLogTxDBStore(CLogDB* plogdbIn) : plogdb(plogdbIn), fTxn(false) { }
+    ~CLogTxDBStore() { Close(); }
+
+    bool Read(const CDataStream& ssKey, CDataStream& ssValue)
+    {
+        string strKey(ssKey.begin(), ssKey.end());
+        string strValue;
+        map<string, pair<bool, string> >::iterator mi = batch.mapChanges.find(strKey);
+        if (mi != batch.mapChanges.end())
+        {
+            if ((*mi).second.first)
+                return false;
+            strValue = (*mi).second.second;
+        }
+        else if (!plogdb->Read(strKey, strValue))
+            return false;
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write(strValue.data(), strValue.size());
+        return true;
+    }
+
+    bool Write(const CDataStream& ssKey, const CDataStream& ssValue)
+    {
+        if (fTxn)
+        {
+            batch.Write(string(ssKey.begin(), ssKey.end()), string(ssValue.begin(), ssValue.end()));
+            return true;
+        }
+        CLogDBBatch batchWrite;
+        batchWrite.Write(string(ssKey.begin(), ssKey.end()), string(ssValue.begin(), ssValue.end()));
+        return plogdb->Write(batchWrite);
+    }
+
+    bool Erase(const CDataStream& ssKey)
+    {
+        if (fTxn)
+        {
+            batch.Erase(string(ssKey.begin(), ssKey.end()));
+            return true;
+        }
+        CLogDBBatch batchWrite;
+        batchWrite.Erase(string(ssKey.begin(), ssKey.end()));
+        return plogdb->Write(batchWrite);
+    }
+
+    bool Exists(const CDataStream& ssKey)
+    {
+        string strKey(ssKey.begin(), ssKey.end());
+        map<string, pair<bool, string> >::iterator mi = batch.mapChanges.find(strKey);
+        if (mi != batch.mapChanges.end())
+            return !(*mi).second.first;
+        return plogdb->Exists(strKey);
+    }
+
+    // Does not see the writes of an open transaction
+    bool Scan(const CDataStream& ssKeyStart, boost::function<bool (CDataStream&, CDataStream&)> fn)
+    {
+        return plogdb->Scan(string(ssKeyStart.begin(), ssKeyStart.end()), boost::bind(&ScanLogDBRecord, _1, _2, fn));
+    }
+
+    bool TxnBegin()
+    {
+        if (fTxn)
+            return false;
+        batch.Clear();
+        fTxn = true;
+        return true;
+    }
+
+    bool TxnCommit()
+    {
+        if (!fTxn)
+            return false;
+        fTxn = false;
+        bool fWritten = plogdb->Write(batch);
+        batch.Clear();
+        return fWritten;
+    }
+
+    bool TxnAbort()
+    {
+        if (!fTxn)
+            return false;
+        fTxn = false;
+        batch.Clear();
+        return true;
+    }
+
+    bool IsTxnActive() const { return fTxn; }
+    void Close() { TxnAbort(); }
+};
+
+static bool ConvertTxDBRecord(CDataStream& ssKey, CDataStream& ssValue, CLogDB* plogdb, CLogDBBatch& batch, unsigned int& nRecords)
+{
+    batch.Write(string(ssKey.begin(), ssKey.end()), string(ssValue.begin(), ssValue.end()));
+    if (batch.mapChanges.size() >= 10000)
+    {
+        if (!plogdb->Write(batch))
+            return false;
+        batch.Clear();
+    }
+    if (++nRecords % 100000 == 0)
+        printf("ConvertTxDB() : %u records\n", nRecords);
+    return true;
+}
+
+// Copy blkindex.dat into a new log store. It is built next to the final
+// directory and renamed when complete, so an interrupted conversion starts over.
+static bool ConvertTxDB(const filesystem::path& pathLogDB)
+{
+    filesystem::path pathConvert = pathLogDB.string() + ".convert";
+    filesystem::remove_all(pathConvert);
+    printf("ConvertTxDB() : converting blkindex.dat to %s\n", pathLogDB.string().c_str());
+    int64 nStart = GetTimeMillis();
+
+    unsigned int nRecords = 0;
+    {
+        CLogDB logdb(pathConvert, 0);
+        if (!logdb.Open())
+            return false;
+        CLogDBBatch batch;
+        CBerkeleyTxDBStore storeFrom("r");
+        if (!storeFrom.Scan(CDataStream(SER_DISK, CLIENT_VERSION), boost::bind(&ConvertTxDBRecord, _1, _2, &logdb, boost::ref(batch), boost::ref(nRecords))))
+            return error("ConvertTxDB() : reading blkindex.dat failed");
+        if (!logdb.Write(batch, true))
+            return error("ConvertTxDB() : writing %s failed", pathConvert.string().c_str());
+        logdb.Close();
+    }
+    filesystem::rename(pathConvert, pathLogDB);
+    printf("ConvertTxDB() : %u records converted in %"PRI64d"ms\n", nRecords, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool OpenLogTxDB()
+{
+    if (plogdbTxDB)
+        return true;
+
+    // The first start with -txdb=log converts blkindex.dat, which is left as it is
+    filesystem::path pathLogDB = GetDataDir() / "txlog";
+    if (!filesystem::exists(pathLogDB) && filesystem::exists(GetDataDir() / "blkindex.dat"))
+        if (!ConvertTxDB(pathLogDB))
+            return false;
+
+    CLogDB* plogdb = new CLogDB(pathLogDB, GetArg("-dbcache", 25) << 20);
+    if (!plogdb->Open())
+    {
+        delete plogdb;
+        return false;
+    }
+    plogdbTxDB = plogdb;
+    return true;
+}
+
+void CloseLogTxDB()
+{
+    if (!plogdbTxDB)
+        return;
+    plogdbTxDB->Close();
+    delete plogdbTxDB;
+    plogdbTxDB = NULL;
+}
+
+CTxDB::CTxDB(const char* pszMode) : fTxn(false)
+{
+    fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
+    if (plogdbTxDB)
+        pstore = new CLogTxDBStore(plogdbTxDB);
+    else
+        pstore = new CBerkeleyTxDBStore(pszMode);
+}
+
+CTxDB::~CTxDB()
+{
+    delete pstore;
+}
+
+void CTxDB::Close()
+{
+    TxnAbort();
+    pstore->Close();
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
@@ -423,7 +751,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
 
     // Add to tx index
     uint256 hash = tx.GetHash();
-    CTxIndex txindex(pos, tx.vout.size());
+    CTxIndex txindex(pos, 0);
     return Write(make_pair(string("tx"), hash), txindex);
 }
 
@@ -467,11 +795,392 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+// trollocoin: the write-back cache. Committed transactions only change
+// memory: the records they write and the coins they change collect here and
+// are written to the store together in one store transaction, so the store
+// always holds the state after some committed transaction. The best block of
+// that state goes with it as hashBestCoins. A write-back is due when the
+// records outgrow -dbcache, the coins outgrow -coinscache, after an hour and
+// at shutdown. A crash loses the blocks connected since the last write-back,
+// which are downloaded again.
+static CCriticalSection cs_txdbcache;
+static map<string, pair<bool, string> > mapWritesDirty;
+static uint64 nWritesDirtyBytes = 0;
+static map<uint256, CCoins> mapCoinsCache;
+static set<uint256> setCoinsDirty;
+static uint64 nCoinsCacheBytes = 0;
+static unsigned int nCoinsCacheGeneration = 0;
+static uint256 hashBestCommitted = 0;
+static int64 nTxDBFlushTime = 0;
+
+// A write-back is one record of the log store, which holds at most 1 GiB,
+// so the dirty records and coins are kept well below that
+static uint64 GetWritesCacheMax()
+{
+    return (uint64)min(GetArg("-dbcache", 25), (int64)512) << 20;
+}
+
+static uint64 GetCoinsCacheMax()
+{
+    return (uint64)min(GetArg("-coinscache", 25), (int64)384) << 20;
+}
+
+static unsigned int GetCoinsCacheBytes(const CCoins& coins)
+{
+    // Serialized size plus map node and vector overhead
+    return ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION) + 96;
+}
+
+// requires cs_txdbcache
+static void CacheCoins(const uint256& hash, const CCoins& coins, bool fDirty)
+{
+    map<uint256, CCoins>::iterator mi = mapCoinsCache.find(hash);
+    if (mi != mapCoinsCache.end())
+    {
+        nCoinsCacheBytes -= GetCoinsCacheBytes((*mi).second);
+        (*mi).second = coins;
+    }
+    else
+        mi = mapCoinsCache.insert(make_pair(hash, coins)).first;
+    nCoinsCacheBytes += GetCoinsCacheBytes(coins);
+    if (fDirty)
+        setCoinsDirty.insert(hash);
+}
+
+// requires cs_txdbcache
+static void CacheWrite(const string& strKey, bool fErase, const string& strValue)
+{
+    map<string, pair<bool, string> >::iterator mi = mapWritesDirty.find(strKey);
+    if (mi != mapWritesDirty.end())
+    {
+        nWritesDirtyBytes -= (*mi).second.second.size();
+        (*mi).second = make_pair(fErase, strValue);
+    }
+    else
+    {
+        mapWritesDirty.insert(make_pair(strKey, make_pair(fErase, strValue)));
+        nWritesDirtyBytes += strKey.size() + 64;
+    }
+    nWritesDirtyBytes += strValue.size();
+}
+
+bool CTxDB::ReadRaw(const CDataStream& ssKey, CDataStream& ssValue)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    const pair<bool, string>* pwrite = NULL;
+    map<string, pair<bool, string> >::iterator mi = mapTxnWrites.find(strKey);
+    if (mi != mapTxnWrites.end())
+        pwrite = &(*mi).second;
+    {
+        LOCK(cs_txdbcache);
+        if (!pwrite && (mi = mapWritesDirty.find(strKey)) != mapWritesDirty.end())
+            pwrite = &(*mi).second;
+        if (pwrite)
+        {
+            if (pwrite->first)
+                return false;
+            ssValue.SetType(SER_DISK);
+            ssValue.clear();
+            ssValue.write(pwrite->second.data(), pwrite->second.size());
+            return true;
+        }
+    }
+    return pstore->Read(ssKey, ssValue);
+}
+
+bool CTxDB::WriteRaw(const CDataStream& ssKey, const CDataStream& ssValue)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    if (fTxn)
+        mapTxnWrites[strKey] = make_pair(false, string(ssValue.begin(), ssValue.end()));
+    else
+    {
+        LOCK(cs_txdbcache);
+        CacheWrite(strKey, false, string(ssValue.begin(), ssValue.end()));
+    }
+    return true;
+}
+
+bool CTxDB::EraseRaw(const CDataStream& ssKey)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    if (fTxn)
+        mapTxnWrites[strKey] = make_pair(true, string());
+    else
+    {
+        LOCK(cs_txdbcache);
+        CacheWrite(strKey, true, string());
+    }
+    return true;
+}
+
+bool CTxDB::ExistsRaw(const CDataStream& ssKey)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    map<string, pair<bool, string> >::iterator mi = mapTxnWrites.find(strKey);
+    if (mi != mapTxnWrites.end())
+        return !(*mi).second.first;
+    {
+        LOCK(cs_txdbcache);
+        mi = mapWritesDirty.find(strKey);
+        if (mi != mapWritesDirty.end())
+            return !(*mi).second.first;
+    }
+    return pstore->Exists(ssKey);
+}
+
+bool CTxDB::ReadCoins(uint256 hash, CCoins& coins)
+{
+    assert(!fClient);
+    map<uint256, CCoins>::iterator mi = mapCoinsPending.find(hash);
+    if (mi != mapCoinsPending.end())
+    {
+        coins = (*mi).second;
+        return !coins.IsPruned();
+    }
+
+    unsigned int nGeneration;
+    {
+        LOCK(cs_txdbcache);
+        mi = mapCoinsCache.find(hash);
+        if (mi != mapCoinsCache.end())
+        {
+            coins = (*mi).second;
+            return !coins.IsPruned();
+        }
+        nGeneration = nCoinsCacheGeneration;
+    }
+
+    if (!Read(make_pair(string("coins"), hash), coins))
+        return false;
+    {
+        // Unless the cache was written back and emptied meanwhile
+        LOCK(cs_txdbcache);
+        if (nGeneration == nCoinsCacheGeneration && !mapCoinsCache.count(hash))
+            CacheCoins(hash, coins, false);
+    }
+    return true;
+}
+
+bool CTxDB::WriteCoins(uint256 hash, const CCoins& coins)
+{
+    assert(!fClient);
+    const CCoins& coinsWrite = coins.IsPruned() ? CCoins() : coins;
+    if (fTxn)
+        mapCoinsPending[hash] = coinsWrite;
+    else
+    {
+        LOCK(cs_txdbcache);
+        CacheCoins(hash, coinsWrite, true);
+    }
+    return true;
+}
+
+// Write the cache to the store in one store transaction, requires cs_txdbcache
+bool CTxDB::FlushCache()
+{
+    if (mapWritesDirty.empty() && setCoinsDirty.empty())
+        return true;
+    int64 nStart = GetTimeMillis();
+    unsigned int nWrites = mapWritesDirty.size();
+    unsigned int nCoins = setCoinsDirty.size();
+
+    // The index must not point at blocks that a crash can still lose
+    FlushBlockFile();
+    if (!pstore->TxnBegin())
+        return error("CTxDB::FlushCache() : TxnBegin failed");
+    bool fWritten = true;
+    for (map<string, pair<bool, string> >::iterator mi = mapWritesDirty.begin(); fWritten && mi != mapWritesDirty.end(); ++mi)
+    {
+        CDataStream ssKey((*mi).first.data(), (*mi).first.data() + (*mi).first.size(), SER_DISK, CLIENT_VERSION);
+        if ((*mi).second.first)
+            fWritten = pstore->Erase(ssKey);
+        else
+            fWritten = pstore->Write(ssKey, CDataStream((*mi).second.second.data(), (*mi).second.second.data() + (*mi).second.second.size(), SER_DISK, CLIENT_VERSION));
+    }
+    BOOST_FOREACH(const uint256& hash, setCoinsDirty)
+    {
+        if (!fWritten)
+            break;
+        const CCoins& coins = mapCoinsCache[hash];
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << make_pair(string("coins"), hash);
+        if (coins.IsPruned())
+            fWritten = pstore->Erase(ssKey);
+        else
+        {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue << coins;
+            fWritten = pstore->Write(ssKey, ssValue);
+        }
+    }
+    if (fWritten && hashBestCommitted != 0)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << string("hashBestCoins");
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << hashBestCommitted;
+        fWritten = pstore->Write(ssKey, ssValue);
+    }
+    if (!fWritten || !pstore->TxnCommit())
+    {
+        pstore->TxnAbort();
+        return error("CTxDB::FlushCache() : writing %u records and %u coins failed", nWrites, nCoins);
+    }
+
+    mapWritesDirty.clear();
+    nWritesDirtyBytes = 0;
+    setCoinsDirty.clear();
+    nTxDBFlushTime = GetTime();
+
+    // Everything is in the store, drop what a miss there answers as well
+    if (nCoinsCacheBytes > GetCoinsCacheMax())
+    {
+        mapCoinsCache.clear();
+        nCoinsCacheBytes = 0;
+        nCoinsCacheGeneration++;
+    }
+    else
+    {
+        for (map<uint256, CCoins>::iterator mi = mapCoinsCache.begin(); mi != mapCoinsCache.end();)
+        {
+            if ((*mi).second.IsPruned())
+            {
+                nCoinsCacheBytes -= GetCoinsCacheBytes((*mi).second);
+                mapCoinsCache.erase(mi++);
+            }
+            else
+                ++mi;
+        }
+    }
+    if (fDebug)
+        printf("CTxDB::FlushCache() : wrote %u records and %u coins in %"PRI64d"ms\n", nWrites, nCoins, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::TxnBegin()
+{
+    if (fTxn)
+        return false;
+    mapTxnWrites.clear();
+    mapCoinsPending.clear();
+    hashBestPending = 0;
+    fTxn = true;
+    return true;
+}
+
+bool CTxDB::TxnCommit()
+{
+    if (!fTxn)
+        return false;
+    LOCK(cs_txdbcache);
+    for (map<string, pair<bool, string> >::iterator mi = mapTxnWrites.begin(); mi != mapTxnWrites.end(); ++mi)
+        CacheWrite((*mi).first, (*mi).second.first, (*mi).second.second);
+    for (map<uint256, CCoins>::iterator mi = mapCoinsPending.begin(); mi != mapCoinsPending.end(); ++mi)
+        CacheCoins((*mi).first, (*mi).second, true);
+    if (hashBestPending != 0)
+        hashBestCommitted = hashBestPending;
+    mapTxnWrites.clear();
+    mapCoinsPending.clear();
+    hashBestPending = 0;
+    fTxn = false;
+
+    // The transaction is committed to the cache even if writing it back fails
+    // here, that is tried again on the next commit
+    if (nTxDBFlushTime == 0)
+        nTxDBFlushTime = GetTime();
+    if (nWritesDirtyBytes > GetWritesCacheMax() || nCoinsCacheBytes > GetCoinsCacheMax() || GetTime() - nTxDBFlushTime > 60 * 60)
+        FlushCache();
+    return true;
+}
+
+bool CTxDB::TxnAbort()
+{
+    if (!fTxn)
+        return false;
+    mapTxnWrites.clear();
+    mapCoinsPending.clear();
+    hashBestPending = 0;
+    fTxn = false;
+    return true;
+}
+
+// Write the cache back, at shutdown
+bool CTxDB::Flush()
+{
+    LOCK(cs_txdbcache);
+    return FlushCache();
+}
+
+// Apply the best chain blocks after hashBestCoins to the coins, this also
+// builds them from scratch on a database written before they existed
+bool CTxDB::ReplayCoins()
+{
+    uint256 hashBestCoins = 0;
+    if (!ReadHashBestCoins(hashBestCoins))
+        hashBestCoins = hashGenesisBlock;
+    if (hashBestCoins == hashBestChain)
+        return true;
+
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBestCoins);
+    if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+        return error("CTxDB::ReplayCoins() : coins best block %s is not in the main chain", hashBestCoins.ToString().substr(0,20).c_str());
+
+    CBlockIndex* pindexStart = (*mi).second->pnext;
+    printf("ReplayCoins() : applying blocks %d to %d to the coins\n", pindexStart->nHeight, nBestHeight);
+    int64 nStart = GetTimeMillis();
+    for (CBlockIndex* pindex = pindexStart; pindex; )
+    {
+        if (!TxnBegin())
+            return error("CTxDB::ReplayCoins() : TxnBegin failed");
+        for (int nBlocks = 0; pindex && nBlocks < 1000; pindex = pindex->pnext, nBlocks++)
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(pindex))
+            {
+                TxnAbort();
+                return error("CTxDB::ReplayCoins() : block.ReadFromDisk failed at %d", pindex->nHeight);
+            }
+            BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            {
+                if (!tx.IsCoinBase())
+                {
+                    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    {
+                        CCoins coins;
+                        if (!ReadCoins(txin.prevout.hash, coins) || !coins.IsAvailable(txin.prevout.n))
+                        {
+                            TxnAbort();
+                            return error("CTxDB::ReplayCoins() : %s spends missing output %s:%u", tx.GetHash().ToString().substr(0,10).c_str(), txin.prevout.hash.ToString().substr(0,10).c_str(), txin.prevout.n);
+                        }
+                        coins.Spend(txin.prevout.n);
+                        WriteCoins(txin.prevout.hash, coins);
+                    }
+                }
+                WriteCoins(tx.GetHash(), CCoins(tx, pindex->nHeight));
+            }
+            hashBestPending = pindex->GetBlockHash();
+        }
+        uint256 hashBlock = hashBestPending;
+        if (!TxnCommit())
+            return error("CTxDB::ReplayCoins() : TxnCommit failed");
+        printf("ReplayCoins() : coins at block %d\n", mapBlockIndex[hashBlock]->nHeight);
+    }
+    printf(" coins       %15"PRI64d"ms\n", GetTimeMillis() - nStart);
+    return true;
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
+// The best block of the state in the store, it is only written with a write-back
+bool CTxDB::ReadHashBestCoins(uint256& hashBestCoins)
+{
+    return Read(string("hashBestCoins"), hashBestCoins);
+}
+
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
     return Read(string("hashBestChain"), hashBestChain);
@@ -479,6 +1188,8 @@ bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 
 bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
 {
+    if (fTxn)
+        hashBestPending = hashBestChain;
     return Write(string("hashBestChain"), hashBestChain);
 }
 
@@ -492,6 +1203,16 @@ bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
     return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
 }
 
+bool CTxDB::ReadBlockFileInfo(unsigned int nFile, CBlockFileInfo& info)
+{
+    return Read(make_pair(string("blockfile"), nFile), info);
+}
+
+bool CTxDB::WriteBlockFileInfo(unsigned int nFile, const CBlockFileInfo& info)
+{
+    return Write(make_pair(string("blockfile"), nFile), info);
+}
+
 bool CTxDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
 {
     return Read(string("hashSyncCheckpoint"), hashCheckpoint);
@@ -532,15 +1253,71 @@ CBlockIndex static * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+// trollocoin: chain trust of blocks sorted by height
+static void ComputeChainTrust(const vector<pair<int, CBlockIndex*> >* pvSortedByHeight)
+{
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, *pvSortedByHeight)
+    {
+        CBlockIndex* pindex = item.second;
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+    }
+}
+
+bool CTxDB::LoadBlockFileInfo()
+{
+    CBlockFileInfo info;
+    unsigned int nFile = 1;
+    while (ReadBlockFileInfo(nFile, info))
+        SetBlockFileInfo(nFile++, info);
+    if (nFile > 1)
+    {
+        printf("LoadBlockFileInfo(): last block file blk%04u.dat %s\n", nFile - 1, info.ToString().c_str());
+        return true;
+    }
+    if (mapBlockIndex.empty())
+        return true;
+
+    // Record what the block files written before this metadata hold. Those
+    // files were appended to without preallocation, they end after their
+    // last block.
+    map<unsigned int, CBlockFileInfo> mapInfo;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        CBlockIndex* pindex = item.second;
+        mapInfo[pindex->nFile].AddBlock(pindex->nHeight, pindex->nTime);
+    }
+    if (!TxnBegin())
+        return error("LoadBlockFileInfo() : TxnBegin failed");
+    for (map<unsigned int, CBlockFileInfo>::iterator mi = mapInfo.begin(); mi != mapInfo.end(); ++mi)
+    {
+        boost::system::error_code ec;
+        (*mi).second.nSize = boost::filesystem::file_size(GetBlockFilePath((*mi).first), ec);
+        if (ec)
+        {
+            TxnAbort();
+            return error("LoadBlockFileInfo() : size of blk%04u.dat unknown", (*mi).first);
+        }
+        SetBlockFileInfo((*mi).first, (*mi).second);
+        WriteBlockFileInfo((*mi).first, (*mi).second);
+    }
+    if (!TxnCommit())
+        return error("LoadBlockFileInfo() : TxnCommit failed");
+    printf("LoadBlockFileInfo(): recorded %u block files\n", (unsigned int)mapInfo.size());
+    return true;
+}
+
 bool CTxDB::LoadBlockIndex()
 {
+    int64 nStart = GetTimeMillis();
     if (!LoadBlockIndexGuts())
         return false;
+    printf(" index load  %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
     if (fRequestShutdown)
         return true;
 
-    // Calculate bnChainTrust
+    // Calculate nChainTrust
+    nStart = GetTimeMillis();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -549,16 +1326,31 @@ bool CTxDB::LoadBlockIndex()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    // Chain trust and the stake modifier checksums each only depend on the
+    // previous block, compute the trust in a separate thread
+    boost::thread threadChainTrust(boost::bind(&ComputeChainTrust, &vSortedByHeight));
+    CBlockIndex* pindexFailedCheckpoint = NULL;
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->bnChainTrust = (pindex->pprev ? pindex->pprev->bnChainTrust : 0) + pindex->GetBlockTrust();
         // trollocoin: calculate stake modifier checksum
         pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
         // printf("pindex->nStakeModifierChecksum = %x height = %d\n", pindex->nStakeModifierChecksum, pindex->nHeight);
         if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
-            return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016"PRI64x, pindex->nHeight, pindex->nStakeModifier);
+        {
+            pindexFailedCheckpoint = pindex;
+            break;
+        }
     }
+    threadChainTrust.join();
+    if (pindexFailedCheckpoint)
+        return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016"PRI64x, pindexFailedCheckpoint->nHeight, pindexFailedCheckpoint->nStakeModifier);
+    printf(" chain trust %15"PRI64d"ms\n", GetTimeMillis() - nStart);
+
+    // trollocoin: load what the block files hold
+    if (!LoadBlockFileInfo())
+        return error("CTxDB::LoadBlockIndex() : LoadBlockFileInfo failed");
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -571,8 +1363,12 @@ bool CTxDB::LoadBlockIndex()
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
-    bnBestChainTrust = pindexBest->bnChainTrust;
-    printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str());
+    nBestChainTrust = pindexBest->nChainTrust;
+    printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str());
+
+    // trollocoin: bring the coins up to the best chain
+    if (!ReplayCoins())
+        return error("CTxDB::LoadBlockIndex() : ReplayCoins failed");
 
     // trollocoin: load hashSyncCheckpoint
     if (!ReadSyncCheckpoint(Checkpoints::hashSyncCheckpoint))
@@ -590,6 +1386,7 @@ bool CTxDB::LoadBlockIndex()
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    nStart = GetTimeMillis();
     CBlockIndex* pindexFork = NULL;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
@@ -633,64 +1430,35 @@ bool CTxDB::LoadBlockIndex()
                                 pindexFork = pindex->pprev;
                             }
                     }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
+                    // check level 4: check whether the unspent txouts match the transaction
                     if (nCheckLevel>3)
                     {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                        CCoins coins;
+                        if (ReadCoins(hashTx, coins))
                         {
-                            if (!txpos.IsNull())
+                            bool fMatch = (coins.vout.size() == tx.vout.size());
+                            for (unsigned int nOutput = 0; fMatch && nOutput < coins.vout.size(); nOutput++)
+                                if (coins.IsAvailable(nOutput) && coins.vout[nOutput] != tx.vout[nOutput])
+                                    fMatch = false;
+                            if (!fMatch)
                             {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    printf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        printf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        printf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            printf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
+                                printf("LoadBlockIndex(): *** found bad coins at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
+                                pindexFork = pindex->pprev;
                             }
-                            nOutput++;
                         }
                     }
                 }
-                // check level 5: check whether all prevouts are marked spent
+                // check level 5: check whether all prevouts are spent
                 if (nCheckLevel>4)
                 {
                      BOOST_FOREACH(const CTxIn &txin, tx.vin)
                      {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
-                                  pindexFork = pindex->pprev;
-                              }
+                          CCoins coins;
+                          if (ReadCoins(txin.prevout.hash, coins) && coins.IsAvailable(txin.prevout.n))
+                          {
+                              printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
+                              pindexFork = pindex->pprev;
+                          }
                      }
                 }
             }
@@ -706,88 +1474,79 @@ bool CTxDB::LoadBlockIndex()
         CTxDB txdb;
         block.SetBestChain(txdb, pindexFork);
     }
+    printf(" verify      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
     return true;
 }
 
-bool CTxDB::LoadBlockIndexGuts()
+static bool LoadBlockIndexRecord(CDataStream& ssKey, CDataStream& ssValue, bool& fError)
 {
-    // Get database cursor
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
-        return false;
-
-    // Load mapBlockIndex
-    unsigned int fFlags = DB_SET_RANGE;
-    for (;;)
+    // Unserialize
+    try {
+    string strType;
+    ssKey >> strType;
+    if (strType == "blockindex" && !fRequestShutdown)
     {
-        // Read next record
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        if (fFlags == DB_SET_RANGE)
-            ssKey << make_pair(string("blockindex"), uint256(0));
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
-            return false;
-
-        // Unserialize
-
-        try {
-        string strType;
-        ssKey >> strType;
-        if (strType == "blockindex" && !fRequestShutdown)
+        CDiskBlockIndex diskindex;
+        ssValue >> diskindex;
+
+        // Construct block index object
+        CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+        pindexNew->nFile          = diskindex.nFile;
+        pindexNew->nBlockPos      = diskindex.nBlockPos;
+        pindexNew->nHeight        = diskindex.nHeight;
+        pindexNew->nMint          = diskindex.nMint;
+        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+        pindexNew->nFlags         = diskindex.nFlags;
+        pindexNew->nStakeModifier = diskindex.nStakeModifier;
+        pindexNew->prevoutStake   = diskindex.prevoutStake;
+        pindexNew->nStakeTime     = diskindex.nStakeTime;
+        pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+        pindexNew->nVersion       = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime          = diskindex.nTime;
+        pindexNew->nBits          = diskindex.nBits;
+        pindexNew->nNonce         = diskindex.nNonce;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
+            pindexGenesisBlock = pindexNew;
+
+        if (!pindexNew->CheckIndex())
         {
-            CDiskBlockIndex diskindex;
-            ssValue >> diskindex;
-
-            // Construct block index object
-            CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-            pindexNew->nFile          = diskindex.nFile;
-            pindexNew->nBlockPos      = diskindex.nBlockPos;
-            pindexNew->nHeight        = diskindex.nHeight;
-            pindexNew->nMint          = diskindex.nMint;
-            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-            pindexNew->nFlags         = diskindex.nFlags;
-            pindexNew->nStakeModifier = diskindex.nStakeModifier;
-            pindexNew->prevoutStake   = diskindex.prevoutStake;
-            pindexNew->nStakeTime     = diskindex.nStakeTime;
-            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-            pindexNew->nVersion       = diskindex.nVersion;
-            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-            pindexNew->nTime          = diskindex.nTime;
-            pindexNew->nBits          = diskindex.nBits;
-            pindexNew->nNonce         = diskindex.nNonce;
-
-            // Watch for genesis block
-            if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                pindexGenesisBlock = pindexNew;
-
-            if (!pindexNew->CheckIndex())
-                return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-
-            // trollocoin: build setStakeSeen
-            if (pindexNew->IsProofOfStake())
-                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            fError = true;
+            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
         }
-        else
-        {
-            break; // if shutdown requested or finished loading block index
-        }
-        }    // try
-        catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
-        }
-    }
-    pcursor->close();
 
+        // trollocoin: build setStakeSeen
+        if (pindexNew->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    }
+    else
+    {
+        return false; // if shutdown requested or finished loading block index
+    }
+    }    // try
+    catch (std::exception &e) {
+        fError = true;
+        return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+    }
     return true;
 }
 
+bool CTxDB::LoadBlockIndexGuts()
+{
+    // Load mapBlockIndex
+    CDataStream ssKeyStart(SER_DISK, CLIENT_VERSION);
+    ssKeyStart << make_pair(string("blockindex"), uint256(0));
+    bool fError = false;
+    if (!pstore->Scan(ssKeyStart, boost::bind(&LoadBlockIndexRecord, _1, _2, boost::ref(fError))))
+        return false;
+    return !fError;
+}
+
 //
 // CAddrDB
 //
@@ -15,6 +15,8 @@
 
 #include <db_cxx.h>
 
+#include <boost/function.hpp>
+
 class CAddress;
 class CAddrMan;
 class CBlockLocator;
@@ -84,6 +86,7 @@ protected:
     std::string strFile;
     DbTxn *activeTxn;
     bool fReadOnly;
+    bool fBatch;    // activeTxn is the batch transaction this thread has open on the file
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
     ~CDB() { Close(); }
@@ -264,7 +267,7 @@ public:
 
     bool TxnCommit()
     {
-        if (!pdb || !activeTxn)
+        if (!pdb || !activeTxn || fBatch)
             return false;
         int ret = activeTxn->commit(0);
         activeTxn = NULL;
@@ -273,13 +276,20 @@ public:
 
     bool TxnAbort()
     {
-        if (!pdb || !activeTxn)
+        if (!pdb || !activeTxn || fBatch)
             return false;
         int ret = activeTxn->abort();
         activeTxn = NULL;
         return (ret == 0);
     }
 
+protected:
+    // A batch transaction is joined by every CDB this thread opens on the
+    // file until it is committed
+    bool TxnBeginBatch();
+    bool TxnCommitBatch();
+
+public:
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
@@ -300,15 +310,117 @@ public:
 
 
 
-/** Access to the transaction database (blkindex.dat) */
-class CTxDB : public CDB
+/** Storage engine under CTxDB, which serializes the keys and values. Writes
+ * between TxnBegin and TxnCommit are applied atomically and are visible to
+ * reads through the same store before that.
+ */
+class CTxDBStore
+{
+public:
+    virtual ~CTxDBStore() { }
+    virtual bool Read(const CDataStream& ssKey, CDataStream& ssValue) = 0;
+    virtual bool Write(const CDataStream& ssKey, const CDataStream& ssValue) = 0;
+    virtual bool Erase(const CDataStream& ssKey) = 0;
+    virtual bool Exists(const CDataStream& ssKey) = 0;
+    // Visits the records from ssKeyStart on in key order until fn returns false
+    virtual bool Scan(const CDataStream& ssKeyStart, boost::function<bool (CDataStream&, CDataStream&)> fn) = 0;
+    virtual bool TxnBegin() = 0;
+    virtual bool TxnCommit() = 0;
+    virtual bool TxnAbort() = 0;
+    virtual bool IsTxnActive() const = 0;
+    virtual void Close() = 0;
+};
+
+// trollocoin: -txdb=log keeps the transaction database in a log-structured
+// store instead of blkindex.dat
+bool OpenLogTxDB();
+void CloseLogTxDB();
+
+/** Access to the transaction database (blkindex.dat, or the log store) */
+class CTxDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    CTxDB(const char* pszMode="r+");
+    ~CTxDB();
+    void Close();
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+
+    CTxDBStore* pstore;
+    bool fReadOnly;
+
+    // trollocoin: writes and coins changed inside the active transaction,
+    // they join the write-back cache when it commits
+    bool fTxn;
+    std::map<std::string, std::pair<bool, std::string> > mapTxnWrites;
+    std::map<uint256, CCoins> mapCoinsPending;
+    uint256 hashBestPending;
+
+    bool ReadRaw(const CDataStream& ssKey, CDataStream& ssValue);
+    bool WriteRaw(const CDataStream& ssKey, const CDataStream& ssValue);
+    bool EraseRaw(const CDataStream& ssKey);
+    bool ExistsRaw(const CDataStream& ssKey);
+
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        if (!ReadRaw(ssKey, ssValue))
+            return false;
+
+        // Unserialize value
+        try {
+            ssValue >> value;
+        }
+        catch (std::exception &e) {
+            return false;
+        }
+        return true;
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value)
+    {
+        if (fReadOnly)
+            assert(!"Write called on database in read-only mode");
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.reserve(10000);
+        ssValue << value;
+        return WriteRaw(ssKey, ssValue);
+    }
+
+    template<typename K>
+    bool Erase(const K& key)
+    {
+        if (fReadOnly)
+            assert(!"Erase called on database in read-only mode");
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+        return EraseRaw(ssKey);
+    }
+
+    template<typename K>
+    bool Exists(const K& key)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+        return ExistsRaw(ssKey);
+    }
+
+    bool FlushCache();
 public:
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -318,8 +430,12 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadCoins(uint256 hash, CCoins& coins);
+    bool WriteCoins(uint256 hash, const CCoins& coins);
+    bool Flush();
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
+    bool ReadHashBestCoins(uint256& hashBestCoins);
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
@@ -327,9 +443,13 @@ public:
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
+    bool ReadBlockFileInfo(unsigned int nFile, CBlockFileInfo& info);
+    bool WriteBlockFileInfo(unsigned int nFile, const CBlockFileInfo& info);
     bool LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockFileInfo();
+    bool ReplayCoins();
 };
 
 /** Access to the (IP) address database (peers.dat) */
@@ -82,6 +82,14 @@ void Shutdown(void* parg)
             scrapesDB->Close();
         bitdb.Flush(false);
         StopNode();
+        {
+            LOCK(cs_main);
+            CTxDB txdb("r+");
+            if (!txdb.Flush())
+                printf("Shutdown() : writing back the coins cache failed\n");
+            CloseBlockFile();
+        }
+        CloseLogTxDB();
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -227,8 +235,10 @@ std::string HelpMessage()
         "  -gen                  "   + _("Generate coins") + "\n" +
         "  -gen=0                "   + _("Don't generate coins") + "\n" +
         "  -datadir=<dir>        "   + _("Specify data directory") + "\n" +
-        "  -dbcache=<n>          "   + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -dbcache=<n>          "   + _("Set database cache size in megabytes, also the limit of unwritten block index changes (default: 25)") + "\n" +
         "  -dblogsize=<n>        "   + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -coinscache=<n>       "   + _("Keep up to <n> megabytes of unspent outputs in memory (default: 25, at most 384)") + "\n" +
+        "  -txdb=<backend>       "   + _("Store the transaction database in blkindex.dat (bdb) or in a log-structured store converted from it on first use (log) (default: bdb)") + "\n" +
         "  -timeout=<n>          "   + _("Specify connection timeout (in milliseconds)") + "\n" +
         "  -proxy=<ip:port>      "   + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>            "   + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -279,10 +289,13 @@ std::string HelpMessage()
         "  -blocknotify=<cmd>    "   + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>   "   + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -upgradewallet        "   + _("Upgrade wallet to latest format") + "\n" +
+        "  -fastwalletload       "   + _("Load the wallet on all cores and read supporting transactions when needed (default: 1)") + "\n" +
         "  -keypool=<n>          "   + _("Set key pool size to <n> (default: 100)") + "\n" +
+        "  -stakethreads=<n>     "   + _("Number of threads searching for stake kernels (default: number of cores)") + "\n" +
         "  -rescan               "   + _("Rescan the block chain for missing wallet transactions") + "\n" +
+        "  -rescanthreads=<n>    "   + _("Number of threads matching transactions during a rescan (default: number of cores)") + "\n" +
         "  -checkblocks=<n>      "   + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
-        "  -checklevel=<n>       "   + _("How thorough the block verification is (0-6, default: 1)") + "\n";
+        "  -checklevel=<n>       "   + _("How thorough the block verification is (0-5, default: 1)") + "\n";
 
     strUsage += string() +
         _("\nSSL options: (see the Trollocoin Wiki for SSL setup instructions)") + "\n" +
@@ -588,6 +601,16 @@ bool AppInit2()
 
     // ********************************************************* Step 6: load blockchain
 
+    string strTxDB = GetArg("-txdb", "bdb");
+    if (strTxDB == "log")
+    {
+        InitMessage(_("Opening transaction database..."));
+        if (!OpenLogTxDB())
+            return InitError(_("Error opening the transaction database log store"));
+    }
+    else if (strTxDB != "bdb")
+        return InitError(strprintf(_("Unknown transaction database backend -txdb=%s"), strTxDB.c_str()));
+
     if (GetBoolArg("-loadblockindextest"))
     {
         CTxDB txdb("r");
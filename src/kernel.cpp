@@ -4,6 +4,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include "kernel.h"
 #include "db.h"
@@ -50,53 +52,57 @@ static int64 GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
-// select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
+// Candidate block for the stake modifier selection, ordered by timestamp
+class CStakeModifierCandidate
+{
+public:
+    int64 nTime;
+    uint256 hashBlock;
+    const CBlockIndex* pindex;
+    uint256 hashSelection;
+    bool fSelected;
+
+    CStakeModifierCandidate(const CBlockIndex* pindexIn)
+    {
+        nTime = pindexIn->GetBlockTime();
+        hashBlock = pindexIn->GetBlockHash();
+        pindex = pindexIn;
+        hashSelection = 0;
+        fSelected = false;
+    }
+
+    friend bool operator<(const CStakeModifierCandidate& a, const CStakeModifierCandidate& b)
+    {
+        return (a.nTime < b.nTime || (a.nTime == b.nTime && a.hashBlock < b.hashBlock));
+    }
+};
+
+// select a block from the candidate blocks in vCandidates, excluding
+// already selected blocks, and with timestamp up to nSelectionIntervalStop.
+// The selection hashes of the candidates must be set.
 static bool SelectBlockFromCandidates(
-    vector<pair<int64, uint256> >& vSortedByTimestamp,
-    map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64 nSelectionIntervalStop, uint64 nStakeModifierPrev,
+    vector<CStakeModifierCandidate>& vCandidates,
+    int64 nSelectionIntervalStop,
     const CBlockIndex** pindexSelected)
 {
-    bool fSelected = false;
-    uint256 hashBest = 0;
+    CStakeModifierCandidate* pcandidateBest = NULL;
     *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64, uint256)& item, vSortedByTimestamp)
+    BOOST_FOREACH(CStakeModifierCandidate& candidate, vCandidates)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString().c_str());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        if (pcandidateBest && candidate.nTime > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (candidate.fSelected)
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : pindex->GetBlockHash();
-        CDataStream ss(SER_GETHASH, 0);
-        ss << hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-        if (fSelected && hashSelection < hashBest)
-        {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
-        }
-        else if (!fSelected)
-        {
-            fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
-        }
+        if (!pcandidateBest || candidate.hashSelection < pcandidateBest->hashSelection)
+            pcandidateBest = &candidate;
     }
+    if (!pcandidateBest)
+        return false;
     if (fDebug && GetBoolArg("-printstakemodifier"))
-        printf("SelectBlockFromCandidates: selection hash=%s\n", hashBest.ToString().c_str());
-    return fSelected;
+        printf("SelectBlockFromCandidates: selection hash=%s\n", pcandidateBest->hashSelection.ToString().c_str());
+    pcandidateBest->fSelected = true;
+    *pindexSelected = pcandidateBest->pindex;
+    return true;
 }
 
 // Stake Modifier (hash modifier of proof-of-stake):
@@ -149,35 +155,49 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64& nStakeMo
     }
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64, uint256> > vSortedByTimestamp;
-    vSortedByTimestamp.reserve(64 * nModifierInterval / STAKE_TARGET_SPACING);
+    vector<CStakeModifierCandidate> vCandidates;
+    vCandidates.reserve(64 * nModifierInterval / STAKE_TARGET_SPACING);
     int64 nSelectionInterval = GetStakeModifierSelectionInterval();
     int64 nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        vCandidates.push_back(CStakeModifierCandidate(pindex));
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
-    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
-    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+    reverse(vCandidates.begin(), vCandidates.end());
+    sort(vCandidates.begin(), vCandidates.end());
+
+    // The selection hash of a candidate only depends on the previous stake
+    // modifier so it is the same in every round
+    BOOST_FOREACH(CStakeModifierCandidate& candidate, vCandidates)
+    {
+        // compute the selection hash by hashing its proof-hash and the
+        // previous proof-of-stake modifier
+        uint256 hashProof = candidate.pindex->IsProofOfStake()? candidate.pindex->hashProofOfStake : candidate.hashBlock;
+        CDataStream ss(SER_GETHASH, 0);
+        ss << hashProof << nStakeModifier;
+        candidate.hashSelection = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (candidate.pindex->IsProofOfStake())
+            candidate.hashSelection >>= 32;
+    }
 
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64 nStakeModifierNew = 0;
     int64 nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
-    for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
+    for (int nRound=0; nRound<min(64, (int)vCandidates.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        if (!SelectBlockFromCandidates(vCandidates, nSelectionIntervalStop, &pindex))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64)pindex->GetStakeEntropyBit()) << nRound);
-        // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
         if (fDebug && GetBoolArg("-printstakemodifier"))
             printf("ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n",
                 nRound, DateTimeStrFormat(nSelectionIntervalStop).c_str(), pindex->nHeight, pindex->GetStakeEntropyBit());
@@ -197,11 +217,13 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64& nStakeMo
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        BOOST_FOREACH(const CStakeModifierCandidate& candidate, vCandidates)
         {
+            if (!candidate.fSelected)
+                continue;
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            strSelectionMap.replace(candidate.pindex->nHeight - nHeightFirstCandidate, 1, candidate.pindex->IsProofOfStake()? "S" : "W");
         }
         printf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap.c_str());
     }
@@ -215,14 +237,53 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64& nStakeMo
     return true;
 }
 
+// Kernel stake modifier of the block at each height, together with the block
+// the search for it ended at. An entry stays valid as long as that block is
+// in the best chain.
+class CKernelStakeModifier
+{
+public:
+    const CBlockIndex* pindexFrom;
+    const CBlockIndex* pindexLast;
+    uint64 nStakeModifier;
+    int nStakeModifierHeight;
+    int64 nStakeModifierTime;
+
+    CKernelStakeModifier()
+    {
+        pindexFrom = NULL;
+        pindexLast = NULL;
+        nStakeModifier = 0;
+        nStakeModifierHeight = 0;
+        nStakeModifierTime = 0;
+    }
+};
+static std::vector<CKernelStakeModifier> vKernelStakeModifiers;
+static CCriticalSection cs_vKernelStakeModifiers;
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake)
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlockFrom);
+    if (mi == mapBlockIndex.end())
         return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
+    const CBlockIndex* pindexFrom = (*mi).second;
+    {
+        LOCK(cs_vKernelStakeModifiers);
+        if (pindexFrom->nHeight < (int)vKernelStakeModifiers.size())
+        {
+            const CKernelStakeModifier& cached = vKernelStakeModifiers[pindexFrom->nHeight];
+            if (cached.pindexFrom == pindexFrom && cached.pindexLast->IsInMainChain())
+            {
+                nStakeModifier = cached.nStakeModifier;
+                nStakeModifierHeight = cached.nStakeModifierHeight;
+                nStakeModifierTime = cached.nStakeModifierTime;
+                return true;
+            }
+        }
+    }
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64 nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
@@ -246,6 +307,18 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+
+    {
+        LOCK(cs_vKernelStakeModifiers);
+        if (pindexFrom->nHeight >= (int)vKernelStakeModifiers.size())
+            vKernelStakeModifiers.resize(pindexFrom->nHeight + 1 + 1000);
+        CKernelStakeModifier& cached = vKernelStakeModifiers[pindexFrom->nHeight];
+        cached.pindexFrom = pindexFrom;
+        cached.pindexLast = pindex;
+        cached.nStakeModifier = nStakeModifier;
+        cached.nStakeModifierHeight = nStakeModifierHeight;
+        cached.nStakeModifierTime = nStakeModifierTime;
+    }
     return true;
 }
 
@@ -281,25 +354,14 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation");
 
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-    int64 nValueIn = txPrev.vout[prevout.n].nValue;
-    // v0.3 protocol kernel hash weight starts from 0 at the 30-day min age
-    // this change increases active coins participating the hash and helps
-    // to secure the network when proof-of-stake difficulty is low
-    int64 nTimeWeight = min((int64)nTimeTx - txPrev.nTime, (int64)STAKE_MAX_AGE) - nStakeMinAge;
-    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * nTimeWeight / COIN / (24 * 60 * 60);
-    // Calculate hash
-    CDataStream ss(SER_GETHASH, 0);
     uint64 nStakeModifier = 0;
     int nStakeModifierHeight = 0;
     int64 nStakeModifierTime = 0;
     if (!GetKernelStakeModifier(blockFrom.GetHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake))
         return false;
-    ss << nStakeModifier;
 
-    ss << nTimeBlockFrom << nTxPrevOffset << txPrev.nTime << prevout.n << nTimeTx;
-    hashProofOfStake = Hash(ss.begin(), ss.end());
+    CStakeKernel kernel(nStakeModifier, nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout, txPrev.vout[prevout.n].nValue);
+    bool fKernelHash = CheckStakeKernelHash(nBits, kernel, nTimeTx, hashProofOfStake);
     if (fPrintProofOfStake)
     {
         printf("CheckStakeKernelHash() : using modifier 0x%016"PRI64x" at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
@@ -314,7 +376,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay)
+    if (!fKernelHash)
         return false;
     if (fDebug && !fPrintProofOfStake)
     {
@@ -331,6 +393,168 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeKernel& kernel, unsigned int nTimeTx, uint256& hashProofOfStake)
+{
+    if (nTimeTx < kernel.nTimeTxPrev)  // Transaction timestamp violation
+        return false;
+    if (kernel.nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
+        return false;
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    // v0.3 protocol kernel hash weight starts from 0 at the 30-day min age
+    // this change increases active coins participating the hash and helps
+    // to secure the network when proof-of-stake difficulty is low
+    int64 nTimeWeight = min((int64)nTimeTx - kernel.nTimeTxPrev, (int64)STAKE_MAX_AGE) - nStakeMinAge;
+    CBigNum bnCoinDayWeight = CBigNum(kernel.nValueIn) * nTimeWeight / COIN / (24 * 60 * 60);
+
+    // Calculate hash
+    CDataStream ss(SER_GETHASH, 0);
+    ss << kernel.nStakeModifier;
+    ss << kernel.nTimeBlockFrom << kernel.nTxPrevOffset << kernel.nTimeTxPrev << kernel.prevout.n << nTimeTx;
+    hashProofOfStake = Hash(ss.begin(), ss.end());
+
+    // Now check if proof-of-stake hash meets target protocol
+    return CBigNum(hashProofOfStake) <= bnCoinDayWeight * bnTargetPerCoinDay;
+}
+
+bool CheckStakeKernelHashBatch(unsigned int nBits, const CStakeKernel& kernel, unsigned int nTimeTx, unsigned int nTimes, unsigned int& nTimeTxRet, uint256& hashProofOfStake)
+{
+    // The coin day weight below can't overflow for any sane value
+    if (kernel.nValueIn < 0 || kernel.nValueIn > std::numeric_limits<int64>::max() / STAKE_MAX_AGE)
+    {
+        for (unsigned int n = 0; n < nTimes; n++)
+            if (CheckStakeKernelHash(nBits, kernel, nTimeTx - n, hashProofOfStake))
+            {
+                nTimeTxRet = nTimeTx - n;
+                return true;
+            }
+        return false;
+    }
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    // Only the trailing nTimeTx differs between the kernels, and all of them
+    // fit in a single SHA-256 block, so hash the rest just once
+    unsigned char pchKernel[24];
+    memcpy(&pchKernel[0], &kernel.nStakeModifier, 8);
+    memcpy(&pchKernel[8], &kernel.nTimeBlockFrom, 4);
+    memcpy(&pchKernel[12], &kernel.nTxPrevOffset, 4);
+    memcpy(&pchKernel[16], &kernel.nTimeTxPrev, 4);
+    memcpy(&pchKernel[20], &kernel.prevout.n, 4);
+    SHA256_CTX ctxKernel;
+    SHA256_Init(&ctxKernel);
+    SHA256_Update(&ctxKernel, pchKernel, sizeof(pchKernel));
+
+    // The target only changes with the integer coin day weight, which stays
+    // the same across most of the timestamps
+    int64 nCoinDayWeightTarget = -1;
+    bool fTarget = false;
+    uint256 hashTarget = 0;
+    for (unsigned int n = 0; n < nTimes; n++)
+    {
+        unsigned int nTime = nTimeTx - n;
+        if (nTime < kernel.nTimeTxPrev || kernel.nTimeBlockFrom + nStakeMinAge > nTime)
+            break; // and so are all the earlier timestamps
+
+        int64 nTimeWeight = min((int64)nTime - kernel.nTimeTxPrev, (int64)STAKE_MAX_AGE) - nStakeMinAge;
+        int64 nCoinDayWeight = kernel.nValueIn * nTimeWeight / COIN / (24 * 60 * 60);
+        if (nCoinDayWeight < 0)
+            continue;
+        if (nCoinDayWeight != nCoinDayWeightTarget)
+        {
+            CBigNum bnTarget = CBigNum(nCoinDayWeight) * bnTargetPerCoinDay;
+            fTarget = (bnTarget >= 0);
+            hashTarget = (bnTarget > CBigNum(~uint256(0)) ? ~uint256(0) : bnTarget.getuint256());
+            nCoinDayWeightTarget = nCoinDayWeight;
+        }
+        if (!fTarget)
+            continue;
+
+        SHA256_CTX ctx = ctxKernel;
+        SHA256_Update(&ctx, &nTime, sizeof(nTime));
+        uint256 hash1;
+        SHA256_Final((unsigned char*)&hash1, &ctx);
+        uint256 hash2;
+        SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+        if (hash2 <= hashTarget)
+        {
+            nTimeTxRet = nTime;
+            hashProofOfStake = hash2;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Shared state of the threads of a FindStakeKernel search
+class CStakeKernelSearch
+{
+public:
+    boost::mutex mutex;
+    unsigned int nNext;     // next kernel to be searched
+    unsigned int nFound;    // lowest kernel index with a hit so far
+    unsigned int nTimeTxFound;
+    uint256 hashProofOfStakeFound;
+};
+
+static void ThreadSearchStakeKernels(unsigned int nBits, const std::vector<CStakeKernel>* pvKernels, unsigned int nTimeTx, unsigned int nSearchInterval, CStakeKernelSearch* psearch)
+{
+    for (;;)
+    {
+        unsigned int nKernel;
+        {
+            boost::mutex::scoped_lock lock(psearch->mutex);
+            // Kernels after a hit can't be the first one with a hit
+            if (psearch->nNext >= pvKernels->size() || psearch->nNext >= psearch->nFound || fShutdown)
+                return;
+            nKernel = psearch->nNext++;
+        }
+
+        unsigned int nTimeTxFound = 0;
+        uint256 hashProofOfStake = 0;
+        if (CheckStakeKernelHashBatch(nBits, (*pvKernels)[nKernel], nTimeTx, nSearchInterval, nTimeTxFound, hashProofOfStake))
+        {
+            boost::mutex::scoped_lock lock(psearch->mutex);
+            if (nKernel < psearch->nFound)
+            {
+                psearch->nFound = nKernel;
+                psearch->nTimeTxFound = nTimeTxFound;
+                psearch->hashProofOfStakeFound = hashProofOfStake;
+            }
+        }
+    }
+}
+
+bool FindStakeKernel(unsigned int nBits, const std::vector<CStakeKernel>& vKernels, unsigned int nTimeTx, unsigned int nSearchInterval, int nThreads, unsigned int& nKernelRet, unsigned int& nTimeTxRet, uint256& hashProofOfStake)
+{
+    CStakeKernelSearch search;
+    search.nNext = 0;
+    search.nFound = std::numeric_limits<unsigned int>::max();
+    search.nTimeTxFound = 0;
+
+    // Not worth starting threads for a handful of coins
+    if (nThreads > (int)(vKernels.size() / 16))
+        nThreads = vKernels.size() / 16;
+    if (nThreads <= 1)
+        ThreadSearchStakeKernels(nBits, &vKernels, nTimeTx, nSearchInterval, &search);
+    else
+    {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ThreadSearchStakeKernels, nBits, &vKernels, nTimeTx, nSearchInterval, &search));
+        threadGroup.join_all();
+    }
+
+    if (search.nFound == std::numeric_limits<unsigned int>::max())
+        return false;
+    nKernelRet = search.nFound;
+    nTimeTxRet = search.nTimeTxFound;
+    hashProofOfStake = search.hashProofOfStakeFound;
+    return true;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake)
 {
@@ -17,10 +17,70 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// The stake modifier used to hash for a stake kernel of an output confirmed
+// in block hashBlockFrom, requires cs_main
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake);
+
+// Everything the kernel hash of a staked output depends on apart from the
+// coinstake time. Checking a kernel against a hash target needs no access to
+// the block index so the kernel search can run without holding any locks.
+class CStakeKernel
+{
+public:
+    uint64 nStakeModifier;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    COutPoint prevout;
+    int64 nValueIn;
+
+    CStakeKernel()
+    {
+        SetNull();
+    }
+
+    CStakeKernel(uint64 nStakeModifierIn, unsigned int nTimeBlockFromIn, unsigned int nTxPrevOffsetIn, unsigned int nTimeTxPrevIn, const COutPoint& prevoutIn, int64 nValueInIn)
+    {
+        nStakeModifier = nStakeModifierIn;
+        nTimeBlockFrom = nTimeBlockFromIn;
+        nTxPrevOffset = nTxPrevOffsetIn;
+        nTimeTxPrev = nTimeTxPrevIn;
+        prevout = prevoutIn;
+        nValueIn = nValueInIn;
+    }
+
+    void SetNull()
+    {
+        nStakeModifier = 0;
+        nTimeBlockFrom = 0;
+        nTxPrevOffset = 0;
+        nTimeTxPrev = 0;
+        prevout.SetNull();
+        nValueIn = 0;
+    }
+};
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, bool fPrintProofOfStake=false);
 
+// Check whether a precomputed stake kernel meets hash target at nTimeTx
+// Sets hashProofOfStake, doesn't require any locks
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeKernel& kernel, unsigned int nTimeTx, uint256& hashProofOfStake);
+
+// Check a precomputed stake kernel against hash target at the nTimes
+// timestamps nTimeTx, nTimeTx - 1, ... in turn, stopping at the first one
+// that meets it. Gives the same result as CheckStakeKernelHash for each
+// timestamp but only hashes the part of the kernel that changes.
+bool CheckStakeKernelHashBatch(unsigned int nBits, const CStakeKernel& kernel, unsigned int nTimeTx, unsigned int nTimes, unsigned int& nTimeTxRet, uint256& hashProofOfStake);
+
+// Search the kernels for one meeting hash target at any time in
+// (nTimeTx - nSearchInterval, nTimeTx], searching backward in time, using up
+// to nThreads threads. On success nKernelRet is the index of the first kernel
+// in vKernels that has a hit and nTimeTxRet the latest time it hits at, the
+// same kernel a serial search in order would find.
+bool FindStakeKernel(unsigned int nBits, const std::vector<CStakeKernel>& vKernels, unsigned int nTimeTx, unsigned int nSearchInterval, int nThreads, unsigned int& nKernelRet, unsigned int& nTimeTxRet, uint256& hashProofOfStake);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake);
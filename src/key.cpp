@@ -357,6 +357,29 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
     return false;
 }
 
+// reconstruct one of the candidate public keys from a DER signature
+bool CKey::SetSignature(uint256 hash, const std::vector<unsigned char>& vchSig, int nRecId)
+{
+    if (vchSig.empty() || nRecId < 0 || nRecId > 3)
+        return false;
+    const unsigned char* pbegin = &vchSig[0];
+    ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &pbegin, vchSig.size());
+    if (sig == NULL)
+        return false;
+
+    EC_KEY_free(pkey);
+    pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    fCompressedPubKey = false;
+    if (ECDSA_SIG_recover_key_GFp(pkey, sig, (unsigned char*)&hash, sizeof(hash), nRecId, 0) == 1)
+    {
+        fSet = true;
+        ECDSA_SIG_free(sig);
+        return true;
+    }
+    ECDSA_SIG_free(sig);
+    return false;
+}
+
 bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
 {
     // -1 = error, 0 = bad sig, 1 = good
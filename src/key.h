@@ -154,6 +154,11 @@ public:
     // (the signature is a valid signature of the given data for that key)
     bool SetCompactSignature(uint256 hash, const std::vector<unsigned char>& vchSig);
 
+    // reconstruct one of the candidate public keys from a DER signature
+    // nRecId selects the candidate (0-3), it is the header byte of a compact
+    // signature minus 27. At most one candidate will verify the signature.
+    bool SetSignature(uint256 hash, const std::vector<unsigned char>& vchSig, int nRecId);
+
     bool Verify(uint256 hash, const std::vector<unsigned char>& vchSig);
 
     // Verify a compact signature
@@ -60,6 +60,20 @@ bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut)
     return false;
 }
 
+void CBasicKeyStore::GetCScripts(std::set<CScriptID> &setScripts) const
+{
+    setScripts.clear();
+    {
+        LOCK(cs_KeyStore);
+        ScriptMap::const_iterator mi = mapScripts.begin();
+        while (mi != mapScripts.end())
+        {
+            setScripts.insert((*mi).first);
+            mi++;
+        }
+    }
+}
+
 bool CCryptoKeyStore::SetCrypted()
 {
     {
@@ -102,6 +116,17 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
     return true;
 }
 
+bool CCryptoKeyStore::GetMasterKey(CKeyingMaterial& vMasterKeyOut) const
+{
+    {
+        LOCK(cs_KeyStore);
+        if (!IsCrypted() || vMasterKey.empty())
+            return false;
+        vMasterKeyOut = vMasterKey;
+    }
+    return true;
+}
+
 bool CCryptoKeyStore::AddKey(const CKey& key)
 {
     {
@@ -96,6 +96,7 @@ public:
     virtual bool AddCScript(const CScript& redeemScript);
     virtual bool HaveCScript(const CScriptID &hash) const;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
+    void GetCScripts(std::set<CScriptID> &setScripts) const;
 };
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
@@ -122,6 +123,9 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    // Copy of the master key, to encrypt new keys without holding cs_KeyStore
+    bool GetMasterKey(CKeyingMaterial& vMasterKeyOut) const;
+
 public:
     CCryptoKeyStore() : fUseCrypto(false)
     {
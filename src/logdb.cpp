@@ -0,0 +1,625 @@
+// Copyright (c) 2015 The Trollocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "logdb.h"
+#include "hash.h"
+#include "version.h"
+
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+using namespace boost;
+
+static const unsigned int LOGDB_MAGIC = 0x62646c74;
+static const unsigned int LOGDB_HEADER_SIZE = 12;
+static const unsigned int LOGDB_MAX_FILE_SIZE = 0x8000000; // 128 MiB
+static const unsigned int LOGDB_MAX_RECORD_SIZE = 0x40000000; // a txdb write-back is one record, see GetCoinsCacheMax
+static const unsigned int LOGDB_COMPACT_RECORD_SIZE = 0x100000;
+static const uint64 LOGDB_MIN_COMPACT_BYTES = 0x1000000;
+
+enum
+{
+    LOGDB_ERASE = 0,
+    LOGDB_PUT = 1,
+    LOGDB_PUT_COMPRESSED = 2,
+};
+
+static unsigned int LogDBChecksum(const char* pbegin, const char* pend)
+{
+    return (unsigned int)Hash(pbegin, pend).Get64();
+}
+
+static void WriteLE32(unsigned char* p, unsigned int n)
+{
+    p[0] = n; p[1] = n >> 8; p[2] = n >> 16; p[3] = n >> 24;
+}
+
+static unsigned int ReadLE32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+
+//
+// Compression: a byte oriented LZ77 in the spirit of snappy. The output is the
+// uncompressed size followed by tags, a tag below 0x80 is followed by tag+1
+// literal bytes, one from 0x80 copies (tag&0x7f)+4 bytes from a two byte
+// distance back in the output.
+//
+
+bool LogDBCompress(const string& strIn, string& strOut)
+{
+    const unsigned char* pin = (const unsigned char*)strIn.data();
+    unsigned int nSize = strIn.size();
+    if (nSize < 16)
+        return false;
+
+    strOut.clear();
+    strOut.reserve(nSize);
+    unsigned char pchSize[4];
+    WriteLE32(pchSize, nSize);
+    strOut.append((char*)pchSize, 4);
+
+    int table[4096];
+    for (int i = 0; i < 4096; i++)
+        table[i] = -1;
+
+    unsigned int nLiteral = 0;
+    unsigned int i = 0;
+    while (i + 4 <= nSize)
+    {
+        unsigned int nHash = (ReadLE32(pin + i) * 2654435761u) >> 20;
+        int nCandidate = table[nHash];
+        table[nHash] = i;
+        if (nCandidate < 0 || i - nCandidate > 0xffff || memcmp(pin + nCandidate, pin + i, 4) != 0)
+        {
+            i++;
+            continue;
+        }
+
+        unsigned int nLen = 4;
+        while (i + nLen < nSize && nLen < 0x7f + 4 && pin[nCandidate + nLen] == pin[i + nLen])
+            nLen++;
+
+        for (unsigned int nPos = nLiteral; nPos < i; nPos += 0x80)
+        {
+            unsigned int nRun = min(i - nPos, 0x80u);
+            strOut.push_back((char)(nRun - 1));
+            strOut.append((const char*)pin + nPos, nRun);
+        }
+        unsigned int nDistance = i - nCandidate;
+        strOut.push_back((char)(0x80 | (nLen - 4)));
+        strOut.push_back((char)(nDistance & 0xff));
+        strOut.push_back((char)(nDistance >> 8));
+
+        i += nLen;
+        nLiteral = i;
+        if (strOut.size() >= nSize)
+            return false;
+    }
+    for (unsigned int nPos = nLiteral; nPos < nSize; nPos += 0x80)
+    {
+        unsigned int nRun = min(nSize - nPos, 0x80u);
+        strOut.push_back((char)(nRun - 1));
+        strOut.append((const char*)pin + nPos, nRun);
+    }
+    return strOut.size() < nSize;
+}
+
+bool LogDBDecompress(const string& strIn, string& strOut)
+{
+    const unsigned char* pin = (const unsigned char*)strIn.data();
+    unsigned int nIn = strIn.size();
+    if (nIn < 4)
+        return false;
+    unsigned int nSize = ReadLE32(pin);
+    if (nSize > LOGDB_MAX_RECORD_SIZE)
+        return false;
+
+    strOut.clear();
+    strOut.reserve(nSize);
+    unsigned int i = 4;
+    while (i < nIn)
+    {
+        unsigned char nTag = pin[i++];
+        if (nTag < 0x80)
+        {
+            unsigned int nRun = nTag + 1;
+            if (i + nRun > nIn)
+                return false;
+            strOut.append((const char*)pin + i, nRun);
+            i += nRun;
+        }
+        else
+        {
+            if (i + 2 > nIn)
+                return false;
+            unsigned int nLen = (nTag & 0x7f) + 4;
+            unsigned int nDistance = pin[i] | (pin[i + 1] << 8);
+            i += 2;
+            if (nDistance == 0 || nDistance > strOut.size())
+                return false;
+            // Copies may overlap their own output
+            unsigned int nFrom = strOut.size() - nDistance;
+            for (unsigned int n = 0; n < nLen; n++)
+                strOut.push_back(strOut[nFrom + n]);
+        }
+        if (strOut.size() > nSize)
+            return false;
+    }
+    return strOut.size() == nSize;
+}
+
+
+//
+// CLogDB
+//
+
+CLogDB::CLogDB(const filesystem::path& pathIn, unsigned int nCacheSizeIn) :
+    path(pathIn), fOpen(false), fileWrite(NULL), nFileWrite(0), nPosWrite(0),
+    nLiveBytes(0), nFileBytes(0), nCacheSize(nCacheSizeIn), nCacheBytes(0)
+{
+}
+
+CLogDB::~CLogDB()
+{
+    Close();
+}
+
+filesystem::path CLogDB::GetFilePath(unsigned int nFile) const
+{
+    return path / strprintf("%08u.log", nFile);
+}
+
+FILE* CLogDB::GetReadFile(unsigned int nFile)
+{
+    map<unsigned int, FILE*>::iterator mi = mapReadFiles.find(nFile);
+    if (mi != mapReadFiles.end())
+        return (*mi).second;
+    FILE* file = fopen(GetFilePath(nFile).string().c_str(), "rb");
+    if (file)
+        mapReadFiles[nFile] = file;
+    return file;
+}
+
+bool CLogDB::OpenWriteFile(unsigned int nFile)
+{
+    if (fileWrite)
+    {
+        FileCommit(fileWrite);
+        fclose(fileWrite);
+    }
+    fileWrite = fopen(GetFilePath(nFile).string().c_str(), "ab");
+    if (!fileWrite)
+        return error("CLogDB::OpenWriteFile() : cannot open %s", GetFilePath(nFile).string().c_str());
+    nFileWrite = nFile;
+    nPosWrite = GetFilesize(fileWrite);
+    return true;
+}
+
+void CLogDB::IndexEntry(unsigned int nFile, unsigned int nValuePos, const CLogDBEntry& entry)
+{
+    map<string, CLogDBPos>::iterator mi = mapIndex.find(entry.strKey);
+    if (mi != mapIndex.end())
+    {
+        nLiveBytes -= entry.strKey.size() + (*mi).second.nSize;
+        if (entry.nType == LOGDB_ERASE)
+        {
+            mapIndex.erase(mi);
+            setErased.insert(entry.strKey);
+        }
+    }
+    UncacheValue(entry.strKey);
+    if (entry.nType == LOGDB_ERASE)
+        return;
+    setErased.erase(entry.strKey);
+
+    CLogDBPos& pos = mapIndex[entry.strKey];
+    pos.nFile = nFile;
+    pos.nPos = nValuePos;
+    pos.nSize = entry.strStored.size();
+    pos.fCompressed = (entry.nType == LOGDB_PUT_COMPRESSED);
+    nLiveBytes += entry.strKey.size() + pos.nSize;
+}
+
+// Apply the records of a log file to the index. Only the last file may end
+// in a torn record, from a write that was cut short; it is cut off.
+bool CLogDB::ReplayFile(unsigned int nFile, bool fLast)
+{
+    FILE* file = GetReadFile(nFile);
+    if (!file)
+        return error("CLogDB::ReplayFile() : cannot open %s", GetFilePath(nFile).string().c_str());
+    int nFileSize = GetFilesize(file);
+    if (nFileSize < 0)
+        return false;
+    fseek(file, 0, SEEK_SET);
+
+    unsigned int nPos = 0;
+    while (nPos < (unsigned int)nFileSize)
+    {
+        bool fValid = false;
+        unsigned char header[LOGDB_HEADER_SIZE];
+        vector<char> vchPayload;
+        if (nPos + LOGDB_HEADER_SIZE <= (unsigned int)nFileSize && fread(header, 1, LOGDB_HEADER_SIZE, file) == LOGDB_HEADER_SIZE)
+        {
+            unsigned int nSize = ReadLE32(header + 4);
+            if (ReadLE32(header) == LOGDB_MAGIC && nSize <= LOGDB_MAX_RECORD_SIZE && nPos + LOGDB_HEADER_SIZE + nSize <= (unsigned int)nFileSize)
+            {
+                vchPayload.resize(nSize);
+                if (nSize == 0 || fread(&vchPayload[0], 1, nSize, file) == nSize)
+                    fValid = (nSize > 0 && LogDBChecksum(&vchPayload[0], &vchPayload[0] + nSize) == ReadLE32(header + 8));
+            }
+        }
+        if (!fValid)
+        {
+            if (!fLast)
+                return error("CLogDB::ReplayFile() : %s is corrupt at %u", GetFilePath(nFile).string().c_str(), nPos);
+            printf("CLogDB::ReplayFile() : dropping %u bytes of a torn record at the end of %s\n", nFileSize - nPos, GetFilePath(nFile).string().c_str());
+            fclose(file);
+            mapReadFiles.erase(nFile);
+            filesystem::resize_file(GetFilePath(nFile), nPos);
+            nFileSize = nPos;
+            break;
+        }
+
+        CDataStream ss(vchPayload, SER_DISK, CLIENT_VERSION);
+        try {
+            while (!ss.empty())
+            {
+                CLogDBEntry entry;
+                ss >> entry.nType >> entry.strKey;
+                unsigned int nValuePos = 0;
+                if (entry.nType != LOGDB_ERASE)
+                {
+                    ss >> entry.strStored;
+                    nValuePos = nPos + LOGDB_HEADER_SIZE + vchPayload.size() - ss.size() - entry.strStored.size();
+                }
+                IndexEntry(nFile, nValuePos, entry);
+            }
+        }
+        catch (std::exception &e) {
+            return error("CLogDB::ReplayFile() : %s has a bad record at %u", GetFilePath(nFile).string().c_str(), nPos);
+        }
+        nPos += LOGDB_HEADER_SIZE + vchPayload.size();
+    }
+    nFileBytes += nFileSize;
+    return true;
+}
+
+bool CLogDB::Open()
+{
+    LOCK(cs);
+    if (fOpen)
+        return true;
+
+    filesystem::create_directories(path);
+    vector<unsigned int> vFiles;
+    for (filesystem::directory_iterator it(path); it != filesystem::directory_iterator(); ++it)
+    {
+        string strName = it->path().filename().string();
+        if (strName.size() == 12 && strName.substr(8) == ".log" && strName.find_first_not_of("0123456789") == 8)
+            vFiles.push_back(atoi(strName.substr(0, 8).c_str()));
+    }
+    sort(vFiles.begin(), vFiles.end());
+
+    int64 nStart = GetTimeMillis();
+    for (unsigned int i = 0; i < vFiles.size(); i++)
+    {
+        if (!ReplayFile(vFiles[i], i == vFiles.size() - 1))
+        {
+            mapIndex.clear();
+            setErased.clear();
+            return false;
+        }
+    }
+    if (!OpenWriteFile(vFiles.empty() ? 1 : vFiles.back()))
+        return false;
+    fOpen = true;
+    printf("CLogDB::Open() : %s, %u files, %u keys, %"PRI64u" of %"PRI64u" bytes live, %"PRI64d"ms\n",
+        path.string().c_str(), (unsigned int)vFiles.size(), (unsigned int)mapIndex.size(), nLiveBytes, nFileBytes, GetTimeMillis() - nStart);
+
+    if (NeedsCompaction())
+        Compact();
+    return true;
+}
+
+void CLogDB::Close()
+{
+    LOCK(cs);
+    if (fileWrite)
+    {
+        FileCommit(fileWrite);
+        fclose(fileWrite);
+        fileWrite = NULL;
+    }
+    for (map<unsigned int, FILE*>::iterator mi = mapReadFiles.begin(); mi != mapReadFiles.end(); ++mi)
+        fclose((*mi).second);
+    mapReadFiles.clear();
+    mapIndex.clear();
+    setErased.clear();
+    listCache.clear();
+    mapCache.clear();
+    nCacheBytes = 0;
+    nLiveBytes = 0;
+    nFileBytes = 0;
+    fOpen = false;
+}
+
+void CLogDB::Flush()
+{
+    LOCK(cs);
+    if (fileWrite)
+        FileCommit(fileWrite);
+}
+
+bool CLogDB::IsEmpty()
+{
+    LOCK(cs);
+    return mapIndex.empty();
+}
+
+void CLogDB::CacheValue(const string& strKey, const string& strValue)
+{
+    if (strValue.size() > nCacheSize / 16)
+        return;
+    UncacheValue(strKey);
+    listCache.push_back(make_pair(strKey, strValue));
+    mapCache[strKey] = --listCache.end();
+    nCacheBytes += strKey.size() + strValue.size();
+    while (nCacheBytes > nCacheSize && !listCache.empty())
+    {
+        nCacheBytes -= listCache.front().first.size() + listCache.front().second.size();
+        mapCache.erase(listCache.front().first);
+        listCache.pop_front();
+    }
+}
+
+void CLogDB::UncacheValue(const string& strKey)
+{
+    map<string, list<pair<string, string> >::iterator>::iterator mi = mapCache.find(strKey);
+    if (mi == mapCache.end())
+        return;
+    nCacheBytes -= (*mi).second->first.size() + (*mi).second->second.size();
+    listCache.erase((*mi).second);
+    mapCache.erase(mi);
+}
+
+bool CLogDB::ReadStored(const CLogDBPos& pos, string& strStored)
+{
+    FILE* file = GetReadFile(pos.nFile);
+    if (!file || fseek(file, pos.nPos, SEEK_SET) != 0)
+        return false;
+    strStored.resize(pos.nSize);
+    return (pos.nSize == 0 || fread(&strStored[0], 1, pos.nSize, file) == pos.nSize);
+}
+
+bool CLogDB::Read(const string& strKey, string& strValue)
+{
+    LOCK(cs);
+    map<string, list<pair<string, string> >::iterator>::iterator mic = mapCache.find(strKey);
+    if (mic != mapCache.end())
+    {
+        // Most recently read goes to the back
+        listCache.splice(listCache.end(), listCache, (*mic).second);
+        strValue = (*mic).second->second;
+        return true;
+    }
+
+    map<string, CLogDBPos>::iterator mi = mapIndex.find(strKey);
+    if (mi == mapIndex.end())
+        return false;
+    const CLogDBPos& pos = (*mi).second;
+    string strStored;
+    if (!ReadStored(pos, strStored))
+        return error("CLogDB::Read() : cannot read %u bytes at %u in %s", pos.nSize, pos.nPos, GetFilePath(pos.nFile).string().c_str());
+    if (!pos.fCompressed)
+        strValue.swap(strStored);
+    else if (!LogDBDecompress(strStored, strValue))
+        return error("CLogDB::Read() : bad compressed value at %u in %s", pos.nPos, GetFilePath(pos.nFile).string().c_str());
+    CacheValue(strKey, strValue);
+    return true;
+}
+
+bool CLogDB::Exists(const string& strKey)
+{
+    LOCK(cs);
+    return mapIndex.count(strKey) > 0;
+}
+
+// Write the entries as one record, the values only become visible to readers
+// once all of it is in the file
+bool CLogDB::AppendEntries(const vector<CLogDBEntry>& vEntries)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    vector<unsigned int> vValuePos;
+    BOOST_FOREACH(const CLogDBEntry& entry, vEntries)
+    {
+        ss << entry.nType << entry.strKey;
+        if (entry.nType != LOGDB_ERASE)
+        {
+            ss << entry.strStored;
+            vValuePos.push_back(ss.size() - entry.strStored.size());
+        }
+        else
+            vValuePos.push_back(0);
+    }
+    if (ss.size() > LOGDB_MAX_RECORD_SIZE)
+        return error("CLogDB::AppendEntries() : record of %u bytes is too large", (unsigned int)ss.size());
+
+    if (nPosWrite > 0 && nPosWrite + LOGDB_HEADER_SIZE + ss.size() > LOGDB_MAX_FILE_SIZE)
+        if (!OpenWriteFile(nFileWrite + 1))
+            return false;
+
+    unsigned char header[LOGDB_HEADER_SIZE];
+    WriteLE32(header, LOGDB_MAGIC);
+    WriteLE32(header + 4, ss.size());
+    WriteLE32(header + 8, LogDBChecksum(&ss[0], &ss[0] + ss.size()));
+    if (fwrite(header, 1, LOGDB_HEADER_SIZE, fileWrite) != LOGDB_HEADER_SIZE ||
+        fwrite(&ss[0], 1, ss.size(), fileWrite) != ss.size() ||
+        fflush(fileWrite) != 0)
+    {
+        // Cut the partial record off again, it would hide later records
+        fclose(fileWrite);
+        fileWrite = NULL;
+        filesystem::resize_file(GetFilePath(nFileWrite), nPosWrite);
+        OpenWriteFile(nFileWrite);
+        return error("CLogDB::AppendEntries() : write to %s failed", GetFilePath(nFileWrite).string().c_str());
+    }
+
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        IndexEntry(nFileWrite, nPosWrite + LOGDB_HEADER_SIZE + vValuePos[i], vEntries[i]);
+    nPosWrite += LOGDB_HEADER_SIZE + ss.size();
+    nFileBytes += LOGDB_HEADER_SIZE + ss.size();
+    return true;
+}
+
+bool CLogDB::Write(const CLogDBBatch& batch, bool fSync)
+{
+    if (batch.IsEmpty())
+        return true;
+
+    vector<CLogDBEntry> vEntries;
+    vEntries.reserve(batch.mapChanges.size());
+    for (map<string, pair<bool, string> >::const_iterator mi = batch.mapChanges.begin(); mi != batch.mapChanges.end(); ++mi)
+    {
+        vEntries.push_back(CLogDBEntry());
+        CLogDBEntry& entry = vEntries.back();
+        entry.strKey = (*mi).first;
+        if ((*mi).second.first)
+            entry.nType = LOGDB_ERASE;
+        else if (LogDBCompress((*mi).second.second, entry.strStored))
+            entry.nType = LOGDB_PUT_COMPRESSED;
+        else
+        {
+            entry.nType = LOGDB_PUT;
+            entry.strStored = (*mi).second.second;
+        }
+    }
+
+    LOCK(cs);
+    if (!fOpen)
+        return false;
+    if (!AppendEntries(vEntries))
+        return false;
+    if (fSync)
+        FileCommit(fileWrite);
+
+    // The batch is written, a failed compaction leaves the old files in
+    // place and is tried again on the next write
+    if (NeedsCompaction())
+        Compact();
+    return true;
+}
+
+bool CLogDB::Scan(const string& strKeyStart, boost::function<bool (const string&, const string&)> fn)
+{
+    LOCK(cs);
+    for (map<string, CLogDBPos>::iterator mi = mapIndex.lower_bound(strKeyStart); mi != mapIndex.end(); ++mi)
+    {
+        // Scanned values do not go through the cache, they would flush it
+        const CLogDBPos& pos = (*mi).second;
+        string strStored, strValue;
+        if (!ReadStored(pos, strStored))
+            return error("CLogDB::Scan() : cannot read %u bytes at %u in %s", pos.nSize, pos.nPos, GetFilePath(pos.nFile).string().c_str());
+        if (!pos.fCompressed)
+            strValue.swap(strStored);
+        else if (!LogDBDecompress(strStored, strValue))
+            return error("CLogDB::Scan() : bad compressed value at %u in %s", pos.nPos, GetFilePath(pos.nFile).string().c_str());
+        if (!fn((*mi).first, strValue))
+            break;
+    }
+    return true;
+}
+
+bool CLogDB::NeedsCompaction() const
+{
+    uint64 nDeadBytes = nFileBytes - nLiveBytes;
+    return (nDeadBytes > nLiveBytes && nDeadBytes > LOGDB_MIN_COMPACT_BYTES);
+}
+
+// Copy the live values to new files and remove the old ones. The new files
+// are replayed last and repeat the erases of keys put in the old files, and
+// the old files are removed oldest first, so a crash at any point leaves the
+// same contents.
+bool CLogDB::Compact()
+{
+    LOCK(cs);
+    if (!fOpen)
+        return false;
+
+    int64 nStart = GetTimeMillis();
+    unsigned int nFileFirst = nFileWrite + 1;
+    if (!OpenWriteFile(nFileFirst))
+        return false;
+    uint64 nFileBytesOld = nFileBytes;
+
+    vector<CLogDBEntry> vEntries;
+    unsigned int nRecordSize = 0;
+    vector<string> vKeys;
+    vKeys.reserve(mapIndex.size() + setErased.size());
+    for (map<string, CLogDBPos>::iterator mi = mapIndex.begin(); mi != mapIndex.end(); ++mi)
+        vKeys.push_back((*mi).first);
+    unsigned int nPuts = vKeys.size();
+    vKeys.insert(vKeys.end(), setErased.begin(), setErased.end());
+    for (unsigned int i = 0; i <= vKeys.size(); i++)
+    {
+        if (i == vKeys.size() || nRecordSize > LOGDB_COMPACT_RECORD_SIZE)
+        {
+            if (!vEntries.empty() && !AppendEntries(vEntries))
+                return error("CLogDB::Compact() : compaction of %s failed", path.string().c_str());
+            vEntries.clear();
+            nRecordSize = 0;
+            if (i == vKeys.size())
+                break;
+        }
+        vEntries.push_back(CLogDBEntry());
+        CLogDBEntry& entry = vEntries.back();
+        entry.strKey = vKeys[i];
+        if (i >= nPuts)
+        {
+            entry.nType = LOGDB_ERASE;
+            nRecordSize += entry.strKey.size();
+            continue;
+        }
+        const CLogDBPos& pos = mapIndex[vKeys[i]];
+        entry.nType = pos.fCompressed ? LOGDB_PUT_COMPRESSED : LOGDB_PUT;
+        if (!ReadStored(pos, entry.strStored))
+            return error("CLogDB::Compact() : cannot read %s", GetFilePath(pos.nFile).string().c_str());
+        nRecordSize += entry.strKey.size() + entry.strStored.size();
+    }
+    FileCommit(fileWrite);
+
+    // Everything live is in the new files now
+    for (map<unsigned int, FILE*>::iterator mi = mapReadFiles.begin(); mi != mapReadFiles.end(); )
+    {
+        if ((*mi).first < nFileFirst)
+        {
+            fclose((*mi).second);
+            mapReadFiles.erase(mi++);
+        }
+        else
+            ++mi;
+    }
+    vector<unsigned int> vRemove;
+    for (filesystem::directory_iterator it(path); it != filesystem::directory_iterator(); ++it)
+    {
+        string strName = it->path().filename().string();
+        if (strName.size() == 12 && strName.substr(8) == ".log" && strName.find_first_not_of("0123456789") == 8 && (unsigned int)atoi(strName.substr(0, 8).c_str()) < nFileFirst)
+            vRemove.push_back(atoi(strName.substr(0, 8).c_str()));
+    }
+    // Oldest first, so the old files left by a crash are always the newest ones
+    sort(vRemove.begin(), vRemove.end());
+    BOOST_FOREACH(unsigned int nFile, vRemove)
+    {
+        nFileBytes -= filesystem::file_size(GetFilePath(nFile));
+        filesystem::remove(GetFilePath(nFile));
+    }
+    // No old file holds a value for the erased keys any more
+    setErased.clear();
+    printf("CLogDB::Compact() : %s from %"PRI64u" to %"PRI64u" bytes, %"PRI64d"ms\n", path.string().c_str(), nFileBytesOld, nFileBytes, GetTimeMillis() - nStart);
+    return true;
+}
@@ -0,0 +1,114 @@
+// Copyright (c) 2015 The Trollocoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef LOGDB_H
+#define LOGDB_H
+
+#include "sync.h"
+#include "util.h"
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
+
+/** Changes applied to a CLogDB in one atomic write */
+class CLogDBBatch
+{
+public:
+    // Key -> (erase, value)
+    std::map<std::string, std::pair<bool, std::string> > mapChanges;
+
+    void Write(const std::string& strKey, const std::string& strValue) { mapChanges[strKey] = std::make_pair(false, strValue); }
+    void Erase(const std::string& strKey) { mapChanges[strKey] = std::make_pair(true, std::string()); }
+    void Clear() { mapChanges.clear(); }
+    bool IsEmpty() const { return mapChanges.empty(); }
+};
+
+/** Log-structured key/value store. Every batch is appended to the current
+ * log file as one checksummed record, and an in-memory index maps each key
+ * to the position of its latest value. Values are compressed when that saves
+ * space, and recently read values are kept in a bounded cache. Opening the
+ * store replays the log files and drops a torn record at the end; files are
+ * compacted once they hold more overwritten data than live data.
+ */
+class CLogDB
+{
+public:
+    CLogDB(const boost::filesystem::path& pathIn, unsigned int nCacheSizeIn);
+    ~CLogDB();
+
+    bool Open();
+    void Close();
+
+    bool Read(const std::string& strKey, std::string& strValue);
+    bool Exists(const std::string& strKey);
+    bool Write(const CLogDBBatch& batch, bool fSync=false);
+
+    // Visits the records from strKeyStart on in key order until fn returns false
+    bool Scan(const std::string& strKeyStart, boost::function<bool (const std::string&, const std::string&)> fn);
+
+    bool Compact();
+    void Flush();
+
+    bool IsEmpty();
+
+private:
+    struct CLogDBPos
+    {
+        unsigned int nFile;
+        unsigned int nPos;
+        unsigned int nSize;
+        bool fCompressed;
+    };
+
+    // A change as it is stored: an erase, or a put of a raw or compressed value
+    struct CLogDBEntry
+    {
+        unsigned char nType;
+        std::string strKey;
+        std::string strStored;
+    };
+
+    CCriticalSection cs;
+    boost::filesystem::path path;
+    bool fOpen;
+    std::map<std::string, CLogDBPos> mapIndex;
+    // Keys erased since the last compaction, their values may still be in a file
+    std::set<std::string> setErased;
+    std::map<unsigned int, FILE*> mapReadFiles;
+    FILE* fileWrite;
+    unsigned int nFileWrite;
+    unsigned int nPosWrite;
+    uint64 nLiveBytes;
+    uint64 nFileBytes;
+
+    // Least recently read values at the front
+    std::list<std::pair<std::string, std::string> > listCache;
+    std::map<std::string, std::list<std::pair<std::string, std::string> >::iterator> mapCache;
+    unsigned int nCacheSize;
+    unsigned int nCacheBytes;
+
+    CLogDB(const CLogDB&);
+    void operator=(const CLogDB&);
+
+    boost::filesystem::path GetFilePath(unsigned int nFile) const;
+    FILE* GetReadFile(unsigned int nFile);
+    bool OpenWriteFile(unsigned int nFile);
+    bool ReplayFile(unsigned int nFile, bool fLast);
+    void IndexEntry(unsigned int nFile, unsigned int nValuePos, const CLogDBEntry& entry);
+    bool ReadStored(const CLogDBPos& pos, std::string& strStored);
+    bool AppendEntries(const std::vector<CLogDBEntry>& vEntries);
+    bool NeedsCompaction() const;
+    void CacheValue(const std::string& strKey, const std::string& strValue);
+    void UncacheValue(const std::string& strKey);
+};
+
+bool LogDBCompress(const std::string& strIn, std::string& strOut);
+bool LogDBDecompress(const std::string& strIn, std::string& strOut);
+
+#endif // LOGDB_H
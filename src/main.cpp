@@ -43,7 +43,7 @@ unsigned int nStakeMinAge = STAKE_MIN_AGE;
 int nCoinbaseMaturity = COINBASE_MATURITY_PPC;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
-CBigNum bnBestChainTrust = 0;
+uint256 nBestChainTrust = 0;
 CBigNum bnBestInvalidTrust = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
@@ -147,6 +147,20 @@ void static SetBestChain(const CBlockLocator& loc)
         pwallet->SetBestChain(loc);
 }
 
+// make sure all wallets know about the transactions of a connected block
+void static BlockConnected(const CBlock& block)
+{
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        pwallet->BlockConnected(block);
+}
+
+// notify wallets about a block disconnected from the best chain
+void static BlockDisconnected(const CBlock& block)
+{
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        pwallet->BlockDisconnected(block);
+}
+
 // notify wallets about an updated transaction
 void static UpdatedTransaction(const uint256& hashTx)
 {
@@ -618,7 +632,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
     if (fCheckInputs)
     {
         MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
+        map<uint256, CCoins> mapUnused;
         bool fInvalid = false;
         if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
         {
@@ -839,6 +853,7 @@ bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs)
     {
         LOCK(mempool.cs);
         // Add previous supporting transactions first
+        ReadSupportingTransactions();
         BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
         {
             if (!(tx.IsCoinBase() || tx.IsCoinStake()))
@@ -1134,14 +1149,14 @@ bool IsInitialBlockDownload()
 
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
-    if (pindexNew->bnChainTrust > bnBestInvalidTrust)
+    if (CBigNum(pindexNew->nChainTrust) > bnBestInvalidTrust)
     {
-        bnBestInvalidTrust = pindexNew->bnChainTrust;
+        bnBestInvalidTrust = CBigNum(pindexNew->nChainTrust);
         CTxDB().WriteBestInvalidTrust(bnBestInvalidTrust);
         MainFrameRepaint();
     }
-    printf("InvalidChainFound: invalid block=%s  height=%d  trust=%s\n", pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight, CBigNum(pindexNew->bnChainTrust).ToString().c_str());
-    printf("InvalidChainFound:  current best=%s  height=%d  trust=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(bnBestChainTrust).ToString().c_str());
+    printf("InvalidChainFound: invalid block=%s  height=%d  trust=%s\n", pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight, CBigNum(pindexNew->nChainTrust).ToString().c_str());
+    printf("InvalidChainFound:  current best=%s  height=%d  trust=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str());
     // trollocoin: should not enter safe mode for longer invalid chain
 }
 
@@ -1160,43 +1175,66 @@ void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
 
 
 
+// trollocoin: the coins of a transaction in the chain whose outputs are all
+// spent, its coins record is erased then
+static bool ReadSpentCoins(CTxDB& txdb, uint256 hash, CCoins& coins)
+{
+    CTransaction tx;
+    CTxIndex txindex;
+    if (!txdb.ReadDiskTx(hash, tx, txindex))
+        return false;
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    if (mi == mapBlockIndex.end())
+        return false;
+    coins = CCoins(tx, (*mi).second->nHeight);
+    BOOST_FOREACH(CTxOut& txout, coins.vout)
+        txout.SetNull();
+    return true;
+}
+
 bool CTransaction::DisconnectInputs(CTxDB& txdb)
 {
-    // Relinquish previous transactions' spent pointers
+    // Give the outputs back to the previous transactions' coins
     if (!IsCoinBase())
     {
         BOOST_FOREACH(const CTxIn& txin, vin)
         {
             COutPoint prevout = txin.prevout;
 
-            // Get prev txindex from disk
-            CTxIndex txindex;
-            if (!txdb.ReadTxIndex(prevout.hash, txindex))
-                return error("DisconnectInputs() : ReadTxIndex failed");
+            CCoins coins;
+            if (!txdb.ReadCoins(prevout.hash, coins) && !ReadSpentCoins(txdb, prevout.hash, coins))
+                return error("DisconnectInputs() : ReadCoins failed");
 
-            if (prevout.n >= txindex.vSpent.size())
+            if (prevout.n >= coins.vout.size())
                 return error("DisconnectInputs() : prevout.n out of range");
 
-            // Mark outpoint as not spent
-            txindex.vSpent[prevout.n].SetNull();
+            // Mark outpoint as not spent, the output itself comes from disk
+            CTransaction txPrev;
+            if (!txdb.ReadDiskTx(prevout.hash, txPrev))
+                return error("DisconnectInputs() : ReadDiskTx failed");
+            coins.vout[prevout.n] = txPrev.vout[prevout.n];
 
             // Write back
-            if (!txdb.UpdateTxIndex(prevout.hash, txindex))
-                return error("DisconnectInputs() : UpdateTxIndex failed");
+            if (!txdb.WriteCoins(prevout.hash, coins))
+                return error("DisconnectInputs() : WriteCoins failed");
         }
     }
 
-    // Remove transaction from index
+    // Remove transaction from index and its coins
     // This can fail if a duplicate of this transaction was in a chain that got
     // reorganized away. This is only possible if this transaction was completely
     // spent, so erasing it would be a no-op anway.
     txdb.EraseTxIndex(*this);
+    txdb.WriteCoins(GetHash(), CCoins());
 
     return true;
 }
 
 
-bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
+bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CCoins>& mapTestPool,
                                bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
 {
     // FetchInputs can return false either because we just haven't seen some inputs
@@ -1214,41 +1252,29 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         if (inputsRet.count(prevout.hash))
             continue; // Got it already
 
-        // Read txindex
-        CTxIndex& txindex = inputsRet[prevout.hash].first;
+        // Read coins
+        CCoins& coins = inputsRet[prevout.hash];
         bool fFound = true;
         if ((fBlock || fMiner) && mapTestPool.count(prevout.hash))
         {
-            // Get txindex from current proposed changes
-            txindex = mapTestPool.find(prevout.hash)->second;
+            // Get coins from current proposed changes
+            coins = mapTestPool.find(prevout.hash)->second;
         }
         else
         {
-            // Read txindex from txdb
-            fFound = txdb.ReadTxIndex(prevout.hash, txindex);
+            // Read coins from txdb, or the spent outputs of a transaction in the chain
+            fFound = txdb.ReadCoins(prevout.hash, coins) || ReadSpentCoins(txdb, prevout.hash, coins);
         }
         if (!fFound && (fBlock || fMiner))
-            return fMiner ? false : error("FetchInputs() : %s prev tx %s index entry not found", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+            return fMiner ? false : error("FetchInputs() : %s prev tx %s coins not found", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
 
-        // Read txPrev
-        CTransaction& txPrev = inputsRet[prevout.hash].second;
-        if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
+        if (!fFound)
         {
             // Get prev tx from single transactions in memory
-            {
-                LOCK(mempool.cs);
-                if (!mempool.exists(prevout.hash))
-                    return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
-                txPrev = mempool.lookup(prevout.hash);
-            }
-            if (!fFound)
-                txindex.vSpent.resize(txPrev.vout.size());
-        }
-        else
-        {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
-                return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+            LOCK(mempool.cs);
+            if (!mempool.exists(prevout.hash))
+                return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+            coins = CCoins(mempool.lookup(prevout.hash), nBestHeight + 1);
         }
     }
 
@@ -1257,14 +1283,13 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
     {
         const COutPoint prevout = vin[i].prevout;
         assert(inputsRet.count(prevout.hash) != 0);
-        const CTxIndex& txindex = inputsRet[prevout.hash].first;
-        const CTransaction& txPrev = inputsRet[prevout.hash].second;
-        if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
+        const CCoins& coins = inputsRet[prevout.hash];
+        if (prevout.n >= coins.vout.size())
         {
             // Revisit this if/when transaction replacement is implemented and allows
             // adding inputs:
             fInvalid = true;
-            return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %d %d prev tx %s\n%s", GetHash().ToString().substr(0,10).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString().substr(0,10).c_str(), txPrev.ToString().c_str()));
+            return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %d prev tx %s", GetHash().ToString().substr(0,10).c_str(), prevout.n, coins.vout.size(), prevout.hash.ToString().substr(0,10).c_str()));
         }
     }
 
@@ -1277,11 +1302,11 @@ const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& in
     if (mi == inputs.end())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.hash not found");
 
-    const CTransaction& txPrev = (mi->second).second;
-    if (input.prevout.n >= txPrev.vout.size())
+    const CCoins& coins = mi->second;
+    if (input.prevout.n >= coins.vout.size())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.n out of range");
 
-    return txPrev.vout[input.prevout.n];
+    return coins.vout[input.prevout.n];
 }
 
 int64 CTransaction::GetValueIn(const MapPrevTx& inputs) const
@@ -1314,7 +1339,7 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 }
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
-                                 map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
+                                 map<uint256, CCoins>& mapTestPool, const CDiskTxPos& posThisTx,
                                  const CBlockIndex* pindexBlock, int64 &nBurnCoins, bool fBlock,
                                  bool fMiner, bool fStrictPayToScriptHash)
 {
@@ -1330,25 +1355,26 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
         {
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
-            CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            CCoins& coins = inputs[prevout.hash];
 
-            if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
-                return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %d %d prev tx %s\n%s", GetHash().ToString().substr(0,10).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString().substr(0,10).c_str(), txPrev.ToString().c_str()));
+            if (prevout.n >= coins.vout.size())
+                return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %d prev tx %s", GetHash().ToString().substr(0,10).c_str(), prevout.n, coins.vout.size(), prevout.hash.ToString().substr(0,10).c_str()));
 
             // If prev is coinbase/coinstake, check that it's matured
-            if (txPrev.IsCoinBase() || txPrev.IsCoinStake())
-                for (const CBlockIndex* pindex = pindexBlock; pindex && pindexBlock->nHeight - pindex->nHeight < nCoinbaseMaturity; pindex = pindex->pprev)
-                    if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
-                        return error("ConnectInputs() : tried to spend coinbase/coinstake at depth %d", pindexBlock->nHeight - pindex->nHeight);
+            if ((coins.fCoinBase || coins.fCoinStake) && pindexBlock->nHeight - coins.nHeight < nCoinbaseMaturity)
+                return error("ConnectInputs() : tried to spend coinbase/coinstake at depth %d", pindexBlock->nHeight - coins.nHeight);
 
             // trollocoin: check transaction timestamp
-            if (txPrev.nTime > nTime)
+            if (coins.nTime > nTime)
                 return DoS(100, error("ConnectInputs() : transaction timestamp earlier than input transaction"));
 
+            // A spent output has no value left, the conflict is reported below
+            if (!coins.IsAvailable(prevout.n))
+                continue;
+
             // Check for negative or overflow input values
-            nValueIn += txPrev.vout[prevout.n].nValue;
-            if (!MoneyRange(txPrev.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coins.vout[prevout.n].nValue;
+            if (!MoneyRange(coins.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
                 return DoS(100, error("ConnectInputs() : txin values out of range"));
 
         }
@@ -1359,14 +1385,13 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
         {
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
-            CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            CCoins& coins = inputs[prevout.hash];
 
             // Check for conflicts (double-spend)
             // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
             // for an attacker to attempt to split the network.
-            if (!txindex.vSpent[prevout.n].IsNull())
-                return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString().substr(0,10).c_str(), txindex.vSpent[prevout.n].ToString().c_str());
+            if (!coins.IsAvailable(prevout.n))
+                return fMiner ? false : error("ConnectInputs() : %s prev tx %s:%u already used", GetHash().ToString().substr(0,10).c_str(), prevout.hash.ToString().substr(0,10).c_str(), prevout.n);
 
             // Skip ECDSA signature verification when connecting blocks (fBlock=true)
             // before the last blockchain checkpoint. This is safe because block merkle hashes are
@@ -1374,11 +1399,12 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                const CScript& scriptPubKey = coins.vout[prevout.n].scriptPubKey;
+                if (!VerifyScript(vin[i].scriptSig, scriptPubKey, *this, i, fStrictPayToScriptHash, 0))
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
-                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0))
+                    if (fStrictPayToScriptHash && VerifyScript(vin[i].scriptSig, scriptPubKey, *this, i, false, 0))
                         return error("ConnectInputs() : %s P2SH VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
@@ -1386,12 +1412,12 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
             }
 
             // Mark outpoints as spent
-            txindex.vSpent[prevout.n] = posThisTx;
+            coins.Spend(prevout.n);
 
             // Write back
             if (fBlock || fMiner)
             {
-                mapTestPool[prevout.hash] = txindex;
+                mapTestPool[prevout.hash] = coins;
             }
         }
 
@@ -1520,6 +1546,7 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     // trollocoin: cleanup wallet after disconnecting coinstake
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, false, false);
+    BlockDisconnected(*this);
 
     return true;
 }
@@ -1549,7 +1576,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     //// issue here: it doesn't know the version
     unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
-    map<uint256, CTxIndex> mapQueuedChanges;
+    map<uint256, CCoins> mapQueuedChanges;
+    vector<pair<uint256, CTxIndex> > vQueuedTxIndex;
     int64 nFees = 0;
     int64 nValueIn = 0;
     int64 nValueOut = 0;
@@ -1560,12 +1588,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
         uint256 hashTx = tx.GetHash();
 
         if (fEnforceBIP30) {
-            CTxIndex txindexOld;
-            if (txdb.ReadTxIndex(hashTx, txindexOld)) {
-                BOOST_FOREACH(CDiskTxPos &pos, txindexOld.vSpent)
-                    if (pos.IsNull())
-                        return false;
-            }
+            CCoins coinsOld;
+            if (txdb.ReadCoins(hashTx, coinsOld))
+                return false;
         }
 
         nSigOps += tx.GetLegacySigOpCount();
@@ -1605,7 +1630,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
                 return false;
         }
 
-        mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+        mapQueuedChanges[hashTx] = CCoins(tx, pindex->nHeight);
+        vQueuedTxIndex.push_back(make_pair(hashTx, CTxIndex(posThisTx, 0)));
     }
     if (nBurnCoins > 0 && fDebug && GetBoolArg("-printcreation"))
         printf("ConnectBlock() : burning coins %s\n", FormatMoney(nBurnCoins).c_str());
@@ -1616,12 +1642,17 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindex)))
         return error("Connect() : WriteBlockIndex for pindex failed");
 
-    // Write queued txindex changes
-    for (map<uint256, CTxIndex>::iterator mi = mapQueuedChanges.begin(); mi != mapQueuedChanges.end(); ++mi)
+    // Write queued txindex and coins changes
+    for (unsigned int i = 0; i < vQueuedTxIndex.size(); i++)
     {
-        if (!txdb.UpdateTxIndex((*mi).first, (*mi).second))
+        if (!txdb.UpdateTxIndex(vQueuedTxIndex[i].first, vQueuedTxIndex[i].second))
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
+    for (map<uint256, CCoins>::iterator mi = mapQueuedChanges.begin(); mi != mapQueuedChanges.end(); ++mi)
+    {
+        if (!txdb.WriteCoins((*mi).first, (*mi).second))
+            return error("ConnectBlock() : WriteCoins failed");
+    }
 
     // trollocoin: fees are not collected by miners as in bitcoin
     // trollocoin: fees are destroyed to compensate the entire network
@@ -1639,8 +1670,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     }
 
     // Watch for transactions paying to me
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, true);
+    BlockConnected(*this);
 
     return true;
 }
@@ -1798,7 +1828,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
         // Reorganize is costly in terms of db load, as it works in a single db transaction.
         // Try to limit how much needs to be done inside
-        while (pindexIntermediate->pprev && pindexIntermediate->pprev->bnChainTrust > pindexBest->bnChainTrust)
+        while (pindexIntermediate->pprev && pindexIntermediate->pprev->nChainTrust > pindexBest->nChainTrust)
         {
             vpindexSecondary.push_back(pindexIntermediate);
             pindexIntermediate = pindexIntermediate->pprev;
@@ -1847,10 +1877,10 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     pindexBest = pindexNew;
 	pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
-    bnBestChainTrust = pindexNew->bnChainTrust;
+    nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
-    printf("SetBestChain: new best=%s  height=%d  trust=%s  moneysupply=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(), FormatMoney(pindexBest->nMoneySupply).c_str());
+    printf("SetBestChain: new best=%s  height=%d  trust=%s  moneysupply=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(), FormatMoney(pindexBest->nMoneySupply).c_str());
 
     std::string strCmd = GetArg("-blocknotify", "");
 
@@ -1954,7 +1984,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     }
 
     // trollocoin: compute chain trust score
-    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
+    pindexNew->nChainTrust = (pindexNew->pprev ? pindexNew->pprev->nChainTrust : 0) + pindexNew->GetBlockTrust();
 
     // trollocoin: compute stake entropy bit for stake modifier
     if (!pindexNew->SetStakeEntropyBit(GetStakeEntropyBit()))
@@ -1989,11 +2019,13 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     if (!txdb.TxnBegin())
         return false;
     txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
+    // trollocoin: the block file metadata is written with the blocks it describes
+    txdb.WriteBlockFileInfo(nFile, AddBlockToFileInfo(nFile, pindexNew->nHeight, pindexNew->nTime));
     if (!txdb.TxnCommit())
         return false;
 
     // New best
-    if (pindexNew->bnChainTrust > bnBestChainTrust)
+    if (pindexNew->nChainTrust > nBestChainTrust)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
@@ -2361,6 +2393,37 @@ unsigned int CBlock::GetStakeEntropyBit() const
     return nEntropyBit;
 }
 
+// trollocoin: trust score of a block, 2**256 / (target + 1) for proof-of-stake
+// blocks and 1 for proof-of-work blocks, computed without bignums
+uint256 CBlockIndex::GetBlockTrust() const
+{
+    // Decode the compact target, blocks with a target <= 0 have no trust
+    unsigned int nSize = nBits >> 24;
+    unsigned int nWord = nBits & 0x007fffff;
+    if (nSize <= 3)
+        nWord >>= 8 * (3 - nSize);
+    if (nWord == 0 || (nBits & 0x00800000))
+        return 0;
+    if (!IsProofOfStake())
+        return 1;
+
+    uint256 nTarget = nWord;
+    if (nSize > 3)
+    {
+        // A target of 2**256 or more gets no trust either
+        if (nTarget.bits() + 8 * (nSize - 3) > 256)
+            return 0;
+        nTarget <<= 8 * (nSize - 3);
+    }
+
+    // 2**256 / (target + 1) == ~target / (target + 1) + 1
+    if (nTarget == ~uint256(0))
+        return 1;
+    uint256 nTrust = ~nTarget;
+    nTrust /= nTarget + 1;
+    return ++nTrust;
+}
+
 
 
 
@@ -2383,47 +2446,6 @@ bool CheckDiskSpace(uint64 nAdditionalBytes)
     return true;
 }
 
-FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
-{
-    if (nFile == -1)
-        return NULL;
-    FILE* file = fopen((GetDataDir() / strprintf("blk%04d.dat", nFile)).string().c_str(), pszMode);
-    if (!file)
-        return NULL;
-    if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
-    {
-        if (fseek(file, nBlockPos, SEEK_SET) != 0)
-        {
-            fclose(file);
-            return NULL;
-        }
-    }
-    return file;
-}
-
-static unsigned int nCurrentBlockFile = 1;
-
-FILE* AppendBlockFile(unsigned int& nFileRet)
-{
-    nFileRet = 0;
-    for (;;)
-    {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-        if (!file)
-            return NULL;
-        if (fseek(file, 0, SEEK_END) != 0)
-            return NULL;
-        // FAT32 filesize max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < 0x7F000000 - MAX_SIZE)
-        {
-            nFileRet = nCurrentBlockFile;
-            return file;
-        }
-        fclose(file);
-        nCurrentBlockFile++;
-    }
-}
-
 bool LoadBlockIndex(bool fAllowNew)
 {
     if (fTestNet)
@@ -3888,7 +3910,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, CWallet* pwallet, bool fProofOfS
         }
 
         // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
+        map<uint256, CCoins> mapTestPool;
         uint64 nBlockSize = 1000;
         uint64 nBlockTx = 0;
         int nBlockSigOps = 100;
@@ -3917,7 +3939,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, CWallet* pwallet, bool fProofOfS
 
             // Connecting shouldn't fail due to dependency on other memory pool transactions
             // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+            map<uint256, CCoins> mapTestPoolTmp(mapTestPool);
             MapPrevTx mapInputs;
             bool fInvalid;
             if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
@@ -3934,7 +3956,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, CWallet* pwallet, bool fProofOfS
             int64 nBurnCoins = 0;
             if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, nBurnCoins, false, true))
                 continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+            mapTestPoolTmp[tx.GetHash()] = CCoins(tx, pindexPrev->nHeight + 1);
             swap(mapTestPool, mapTestPoolTmp);
 
             // Added
@@ -11,6 +11,7 @@
 #include "sync.h"
 #include "net.h"
 #include "script.h"
+#include "blockfile.h"
 
 #include <list>
 
@@ -79,7 +80,7 @@ extern unsigned int nStakeMinAge;
 extern int nCoinbaseMaturity;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
-extern CBigNum bnBestChainTrust;
+extern uint256 nBestChainTrust;
 extern CBigNum bnBestInvalidTrust;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
@@ -105,14 +106,13 @@ static const uint64 nMinDiskSpace = 52428800;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CCoins;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false, bool fConnect = true);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
-FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
@@ -369,7 +369,7 @@ public:
         scriptPubKey.clear();
     }
 
-    bool IsNull()
+    bool IsNull() const
     {
         return (nValue == -1);
     }
@@ -430,7 +430,7 @@ enum GetMinFee_mode
     GMF_SEND,
 };
 
-typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
+typedef std::map<uint256, CCoins> MapPrevTx;
 
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
@@ -620,30 +620,22 @@ public:
 
     int64 GetMinFee(unsigned int nBlockSize=1, bool fAllowFree=false, enum GetMinFee_mode mode=GMF_BLOCK, unsigned int nBytes=0) const;
 
-    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
+    bool ReadFromDisk(CDiskTxPos pos)
     {
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+        CBlockFileSpan span;
+        if (!MapBlockFile(pos.nFile, pos.nBlockPos, span))
+            return error("CTransaction::ReadFromDisk() : MapBlockFile failed");
+        if (pos.nTxPos < pos.nBlockPos || pos.nTxPos - pos.nBlockPos >= (unsigned int)(span.pend - span.pbegin))
+            return error("CTransaction::ReadFromDisk() : transaction is not in its block");
 
         // Read transaction
-        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-            return error("CTransaction::ReadFromDisk() : fseek failed");
-
+        CSpanReader filein(span.pbegin + (pos.nTxPos - pos.nBlockPos), span.pend, SER_DISK, CLIENT_VERSION);
         try {
             filein >> *this;
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
         }
-
-        // Return file pointer
-        if (pfileRet)
-        {
-            if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-                return error("CTransaction::ReadFromDisk() : second fseek failed");
-            *pfileRet = filein.release();
-        }
         return true;
     }
 
@@ -702,21 +694,21 @@ public:
     /** Fetch from memory and/or disk. inputsRet keys are transaction hashes.
 
      @param[in] txdb	Transaction database
-     @param[in] mapTestPool	List of pending changes to the transaction index database
+     @param[in] mapTestPool	List of pending changes to the coins database
      @param[in] fBlock	True if being called to add a new best-block to the chain
      @param[in] fMiner	True if being called by CreateNewBlock
-     @param[out] inputsRet	Pointers to this transaction's inputs
+     @param[out] inputsRet	Coins of this transaction's inputs
      @param[out] fInvalid	returns true if transaction is invalid
      @return	Returns true if all inputs are in txdb or mapTestPool
      */
-    bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
+    bool FetchInputs(CTxDB& txdb, const std::map<uint256, CCoins>& mapTestPool,
                      bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
 
-        @param[in] inputs	Previous transactions (from FetchInputs)
-        @param[out] mapTestPool	Keeps track of inputs that need to be updated on disk
+        @param[in] inputs	Coins of the previous transactions (from FetchInputs)
+        @param[out] mapTestPool	Keeps track of coins that need to be updated on disk
         @param[in] posThisTx	Position of this transaction on disk
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
@@ -725,7 +717,7 @@ public:
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
-                       std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
+                       std::map<uint256, CCoins>& mapTestPool, const CDiskTxPos& posThisTx,
                        const CBlockIndex* pindexBlock, int64 &nBurnCoins, bool fBlock,
                        bool fMiner, bool fStrictPayToScriptHash=true);
     bool ClientConnectInputs();
@@ -793,9 +785,9 @@ public:
 
 
 
-/**  A txdb record that contains the disk location of a transaction and the
- * locations of transactions that spend its outputs.  vSpent is really only
- * used as a flag, but having the location is very helpful for debugging.
+/**  A txdb record that contains the disk location of a transaction.  vSpent
+ * used to hold the locations of transactions that spend its outputs; the
+ * coins database tracks spent outputs now, and new records leave it empty.
  */
 class CTxIndex
 {
@@ -849,6 +841,78 @@ public:
 
 
 
+/** The outputs of a transaction that are not spent yet, and what spending
+ * them needs to know about the transaction.  Kept in the coins database so
+ * that FetchInputs and ConnectInputs need neither the transaction index nor
+ * the block files.  Spent outputs are nulled, and the record is erased when
+ * the last one is spent.
+ */
+class CCoins
+{
+public:
+    unsigned int nTime;
+    int nHeight;
+    bool fCoinBase;
+    bool fCoinStake;
+    std::vector<CTxOut> vout;
+
+    CCoins()
+    {
+        SetNull();
+    }
+
+    CCoins(const CTransaction& tx, int nHeightIn)
+    {
+        nTime = tx.nTime;
+        nHeight = nHeightIn;
+        fCoinBase = tx.IsCoinBase();
+        fCoinStake = tx.IsCoinStake();
+        vout = tx.vout;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(nTime);
+        READWRITE(nHeight);
+        READWRITE(fCoinBase);
+        READWRITE(fCoinStake);
+        READWRITE(vout);
+    )
+
+    void SetNull()
+    {
+        nTime = 0;
+        nHeight = 0;
+        fCoinBase = false;
+        fCoinStake = false;
+        vout.clear();
+    }
+
+    bool IsAvailable(unsigned int n) const
+    {
+        return (n < vout.size() && !vout[n].IsNull());
+    }
+
+    void Spend(unsigned int n)
+    {
+        if (n < vout.size())
+            vout[n].SetNull();
+    }
+
+    // All outputs spent, the record can be erased
+    bool IsPruned() const
+    {
+        BOOST_FOREACH(const CTxOut& txout, vout)
+            if (!txout.IsNull())
+                return false;
+        return true;
+    }
+};
+
+
+
 
 
 /** Nodes collect new transactions into a block, hash them into a hash tree,
@@ -1022,29 +1086,18 @@ public:
 
     bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
     {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet), SER_DISK, CLIENT_VERSION);
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-
-        // Write index header
+        // Index header and block, written to the history file at once
         unsigned char pchMessageStart[4];
         GetMessageStart(pchMessageStart);
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(pchMessageStart) << nSize;
-
-        // Write block
-        long fileOutPos = ftell(fileout);
-        if (fileOutPos < 0)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        nBlockPosRet = fileOutPos;
-        fileout << *this;
-
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
-            FileCommit(fileout);
-
+        unsigned int nSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
+        CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+        ssBlock.reserve(sizeof(pchMessageStart) + sizeof(nSize) + nSize);
+        ssBlock << FLATDATA(pchMessageStart) << nSize << *this;
+
+        // Commit to disk before returning
+        bool fSync = !IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0;
+        if (!AppendBlockFile(ssBlock, fSync, nFileRet, nBlockPosRet))
+            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
         return true;
     }
 
@@ -1052,10 +1105,11 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+        // Find the block in the mapped history file
+        CBlockFileSpan span;
+        if (!MapBlockFile(nFile, nBlockPos, span))
+            return error("CBlock::ReadFromDisk() : MapBlockFile failed");
+        CSpanReader filein(span.pbegin, span.pend, SER_DISK, CLIENT_VERSION);
         if (!fReadTransactions)
             filein.nType |= SER_BLOCKHEADERONLY;
 
@@ -1134,7 +1188,7 @@ public:
     CBlockIndex* pnext;
     unsigned int nFile;
     unsigned int nBlockPos;
-    CBigNum bnChainTrust; // trollocoin: trust score of block chain
+    uint256 nChainTrust; // trollocoin: trust score of block chain
     int nHeight;
     int64 nMint;
     int64 nMoneySupply;
@@ -1171,7 +1225,7 @@ public:
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
-        bnChainTrust = 0;
+        nChainTrust = 0;
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -1196,7 +1250,7 @@ public:
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
-        bnChainTrust = 0;
+        nChainTrust = 0;
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -1271,14 +1325,7 @@ public:
         return dDiff;
     }
 
-    CBigNum GetBlockTrust() const
-    {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
-            return 0;
-        return (IsProofOfStake()? (CBigNum(1)<<256) / (bnTarget+1) : 1);
-    }
+    uint256 GetBlockTrust() const;
 
     bool IsInMainChain() const
     {
@@ -6,7 +6,7 @@ typedef long long  int64;
 void CPrimeNodeDB::WritePrimeNodeDB() {
     LOCK(cs);
 
-    WritePrimeNodeDBVersion(4);
+    WritePrimeNodeDBVersion(5);
 
     if (fTestNet) {
         WritePrimeNodeKey(
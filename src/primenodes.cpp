@@ -11,6 +11,8 @@ using namespace std;
 extern void CloseDb(const string& strFile);
 
 CPrimeNodeDB* primeNodeDB;
+CPrimeNodeRegistry primeNodeRegistry;
+CPrimeStakeCache primeStakeCache(5000);
 
 // Reset all primenode stakerates to 100% after the given date
 static const unsigned int RESET_PRIMERATES = 1429531200; // Mon, 20 Apr 2015 12:00:00 GMT
@@ -33,7 +35,7 @@ bool NewScriptPrimeID(CScript &scriptPrimeID, vector<unsigned char> vchPrivKey,
 bool maybeWipePrimeDB() {
     int dbversion;
     if (primeNodeDB->CheckPrimeNodeDBVersion(dbversion)) {
-        if (dbversion == 4)
+        if (dbversion == 5)
             return false;
     }
 
@@ -57,10 +59,7 @@ bool initPrimeNodes(string &str) {
      * information (same stats on all existing databases). Check for the
      * existance of the first and last keys in the list assuming all keys
      * in between are present, if either key is missing, attempt to inflate
-     * the database. These checks can be done with a single if statement for
-     * each node type but it causes a warning about missing parenthesis that if
-     * added break the function. The dbtype checks should be doable with a
-     * ternary but when using one the value of fulldb is always returned.
+     * the database. Microprimes are compiled in and no longer stored here.
      *
      * So if you are done trying to 'optimize' this routine (and failed).
      * Please increment the following counter as a warning to the next guy.
@@ -69,37 +68,28 @@ bool initPrimeNodes(string &str) {
      */
      CPrimeNodeDB::dbtype db = CPrimeNodeDB::nodb;
      if (maybeWipePrimeDB()) {
-         db = CPrimeNodeDB::fulldb;
+         db = CPrimeNodeDB::primedb;
      } else if (fTestNet) {
          if (!primeNodeDB->CheckPrimeNodeKey(string("04d445518d115243639d0dfd057a99da588e8334039ce674f177943d4c660957c810f924a5371a352b1e827121846500a588a4dc47dc6d5d9e5317dfa48c562aa7"))
              || !primeNodeDB->CheckPrimeNodeKey(string("0443e5bf72234d77a591ca2132c5995cccdba377a7022eb014d25e27ebe6ffaf85cd3a214588612186ee1771cfb905d1ec2137193bc01563dbc36d1e28f013e00d")))
              db = CPrimeNodeDB::primedb;
-
-         if (!primeNodeDB->CheckMicroPrime(string("muVEJW5YZpZc4QxUaDMJVxcy1vQcMrPhmQ"))
-             || !primeNodeDB->CheckMicroPrime(string("mpCYzc3XqcLYGBHtJxAFQQ1nz7YZwecE3v")))
-         {
-             if (db == CPrimeNodeDB::primedb) {
-                 db = CPrimeNodeDB::fulldb;
-             } else {
-                 db = CPrimeNodeDB::microdb;
-             }
-         }
      } else {
          if (!primeNodeDB->CheckPrimeNodeKey(string("04388d05d6cdbf75a37540e9b94c1c0b4e9b41a109c1466a33b3cf3cbca9e244f7761686502a0a593831fac02753ea5c2c8fc14ed59b9060da2088d2cb674e041d"))
              || !primeNodeDB->CheckPrimeNodeKey(string("049bee18cacc1d51282633a0d269f53bfc4366342c3043e229f3c5534b9184bce83440e4d3164ceb158515c6af8867091e0b1045f53c5b3756fc4413265266e759")))
              db = CPrimeNodeDB::primedb;
-         if (!primeNodeDB->CheckMicroPrime(string("P9Yo3PtaxuzeBZAimsGzz6mdTmdDtU6vhf"))
-             || !primeNodeDB->CheckMicroPrime(string("PT9pCj8Xzmxyrk8JUGBTMSaN2W2oeFBrke")))
-         {
-             if (db == CPrimeNodeDB::primedb) {
-                 db = CPrimeNodeDB::fulldb;
-             } else {
-                 db = CPrimeNodeDB::microdb;
-             }
-         }
      }
+     // Inflating reloads the registry, otherwise load it from the existing DB.
+     bool fLoaded;
      if (db != CPrimeNodeDB::nodb)
-         InflatePrimeNodeDB(db);
+         fLoaded = InflatePrimeNodeDB(db);
+     else
+         fLoaded = primeNodeRegistry.Load(*primeNodeDB);
+     if (!fLoaded) {
+         str = "initPrimeNodes() : unable to load primenode keys";
+         return false;
+     }
+
+    primeNodeRegistry.SetRecoverKeys(GetBoolArg("-primenoderecover", true));
 
     // If there is a primenode key in the conf file, confirm it's valid.
     if (mapArgs.count("-primenodekey")) {
@@ -116,7 +106,7 @@ bool initPrimeNodes(string &str) {
 
         // We don't use this entry, we just want to know that the key is valid.
         CPrimeNodeDBEntry entry;
-        if (!primeNodeDB->IsPrimeNodeKey(scriptPrimeID, nTime, entry)) {
+        if (!primeNodeRegistry.IsPrimeNodeKey(scriptPrimeID, nTime, entry)) {
             str = "initPrimeNode() : invalid primenode key";
             return false;
         }
@@ -131,6 +121,10 @@ bool IsPrimeNodeKey(CScript /*scriptPubKeyType*/, unsigned int /*nTime*/, CPrime
 
 // Check if a stake is either a prime or microprime stake.
 bool CTransaction::IsPrimeStake(CScript scriptPubKeyType, CScript scriptPubKeyAddress, unsigned int nTime, int64 nValueIn, int64 nValueOut, uint64 nCoinAge) {
+    CPrimeStakeKey stakeKey(GetHash(), nTime, scriptPubKeyType, scriptPubKeyAddress, nValueIn, nValueOut, nCoinAge);
+    if (primeStakeCache.Contains(stakeKey))
+        return true;
+
     int primeNodeRate = 0;
     int64 nStakeReward = nValueOut - nValueIn;
 
@@ -138,15 +132,10 @@ bool CTransaction::IsPrimeStake(CScript scriptPubKeyType, CScript scriptPubKeyAd
     if (scriptPubKeyType[0] == OP_MICROPRIME) {
         int64 group;
         /* Destination address is stored in the CScript for vout[1] of the input
-         * so extract it against our database.
-         *
-         * IsMicroPrime returns the DB return value which will always return
-         * true for a read even if nothing has been read, check that the address
-         * exists before trying to read the related entries. */
-        if (!primeNodeDB->CheckMicroPrime(scriptPubKeyAddress))
+         * so extract it against the microprime table. */
+        if (!IsMicroPrime(scriptPubKeyAddress, primeNodeRate, group, nTime))
             return DoS(100, error("IsPrimeStake() : invalid microprime address, HAXORS!!!"));
 
-        primeNodeDB->IsMicroPrime(scriptPubKeyAddress, primeNodeRate, group, nTime);
         /* Confirm the nValueIn is not greater than the balance allowed per
          * microPrimeGroup. This should not occur and will only happen if
          * someone attempts to hack the stake rate. */
@@ -160,6 +149,7 @@ bool CTransaction::IsPrimeStake(CScript scriptPubKeyType, CScript scriptPubKeyAd
             return DoS(100, error("IsPrimeStake() : %s stake reward exceeded", GetHash().ToString().substr(0,10).c_str()));
 
         // No need to validate primes at this point, just return true.
+        primeStakeCache.Insert(stakeKey);
         return true;
     }
 
@@ -196,7 +186,7 @@ bool CTransaction::IsPrimeStake(CScript scriptPubKeyType, CScript scriptPubKeyAd
      */
     if (scriptPubKeyType[0] == OP_PRIMENODEP2) {
         CPrimeNodeDBEntry entry;
-        if (!primeNodeDB->IsPrimeNodeKey(scriptPubKeyType, nTime, entry))
+        if (!primeNodeRegistry.IsPrimeNodeKey(scriptPubKeyType, nTime, entry))
             return DoS(10, error("IsPrimeStake() : verify signature failed"));
 
         // Confirm the transaction time is within the valid time of the key used.
@@ -227,17 +217,43 @@ bool CTransaction::IsPrimeStake(CScript scriptPubKeyType, CScript scriptPubKeyAd
             return DoS(100, error("IsPrimeStake() : %s stake reward exceeded", GetHash().ToString().substr(0,10).c_str()));
     }
 
+    primeStakeCache.Insert(stakeKey);
     return true;
 }
 
-/* Check the script signature to confirm it came from a valid prime node key
- * nTime is the time of the transaction/stake.
- * entry is the resulting database entry if the script signature is valid. */
-bool CPrimeNodeDB::IsPrimeNodeKey(CScript scriptPubKeyType, unsigned int nTime, CPrimeNodeDBEntry &entry) {
-    vector<CPrimeNodeDBEntry> primeNodeDBEntries;
+bool CPrimeStakeCache::Contains(const CPrimeStakeKey &key) {
+    LOCK(cs);
+    if (setAccepted.count(key)) {
+        nHits++;
+        return true;
+    }
+    nMisses++;
+    return false;
+}
+
+void CPrimeStakeCache::Insert(const CPrimeStakeKey &key) {
+    LOCK(cs);
+    setAccepted.insert(key);
+}
+
+void CPrimeStakeCache::Clear() {
+    LOCK(cs);
+    setAccepted.clear();
+}
+
+void CPrimeStakeCache::GetStats(uint64 &nHitsRet, uint64 &nMissesRet, unsigned int &nSizeRet, unsigned int &nMaxSizeRet) const {
+    LOCK(cs);
+    nHitsRet = nHits;
+    nMissesRet = nMisses;
+    nSizeRet = setAccepted.size();
+    nMaxSizeRet = setAccepted.max_size();
+}
+
+// Read every primenode key entry stored in the database.
+bool CPrimeNodeDB::ReadPrimeNodeKeys(vector<CPrimeNodeDBEntry> &entries) {
     Dbc* pcursor = GetCursor();
     if (!pcursor)
-        throw runtime_error("IsPrimeNodeKey() : cannot create DB cursor");
+        return error("ReadPrimeNodeKeys() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
 
     for (;;)
@@ -254,7 +270,7 @@ bool CPrimeNodeDB::IsPrimeNodeKey(CScript scriptPubKeyType, unsigned int nTime,
         else if (ret != 0)
         {
             pcursor->close();
-            throw runtime_error("IsPrimeNodeKey() : error scanning DB");
+            return error("ReadPrimeNodeKeys() : error scanning DB");
         }
 
         // Unserialize
@@ -265,10 +281,23 @@ bool CPrimeNodeDB::IsPrimeNodeKey(CScript scriptPubKeyType, unsigned int nTime,
         CPrimeNodeDBEntry dbentry;
         ssKey >> dbentry.key;
         ssValue >> dbentry;
-        primeNodeDBEntries.push_back(dbentry);
+        entries.push_back(dbentry);
     }
 
     pcursor->close();
+    return true;
+}
+
+/* Check the script signature to confirm it came from a valid prime node key
+ * nTime is the time of the transaction/stake.
+ * entry is the resulting database entry if the script signature is valid.
+ *
+ * This reads and parses every key from the database on each call, stake
+ * validation goes through primeNodeRegistry instead. */
+bool CPrimeNodeDB::IsPrimeNodeKey(CScript scriptPubKeyType, unsigned int nTime, CPrimeNodeDBEntry &entry) {
+    vector<CPrimeNodeDBEntry> primeNodeDBEntries;
+    if (!ReadPrimeNodeKeys(primeNodeDBEntries))
+        throw runtime_error("IsPrimeNodeKey() : error scanning DB");
 
     BOOST_FOREACH(CPrimeNodeDBEntry dbentry, primeNodeDBEntries) {
         vector<unsigned char> vchPubKey = ParseHex(dbentry.key);
@@ -289,8 +318,123 @@ bool CPrimeNodeDB::IsPrimeNodeKey(CScript scriptPubKeyType, unsigned int nTime,
     return false;
 }
 
-// Inflate the primenode table in the primeNodeDB
-void InflatePrimeNodeDB(CPrimeNodeDB::dbtype db) {
+// Replace the registry contents with the primenode keys held in db.
+bool CPrimeNodeRegistry::Load(CPrimeNodeDB &db) {
+    vector<CPrimeNodeDBEntry> entries;
+    if (!db.ReadPrimeNodeKeys(entries))
+        return false;
+
+    vector<CRegisteredKey> vNewKeys;
+    vNewKeys.reserve(entries.size());
+    BOOST_FOREACH(const CPrimeNodeDBEntry &dbentry, entries) {
+        CRegisteredKey regkey;
+        regkey.entry = dbentry;
+        if (!regkey.key.SetPubKey(CPubKey(ParseHex(dbentry.key))))
+            return error("CPrimeNodeRegistry::Load() : invalid primenode key %s", dbentry.key.c_str());
+        // RecoverKey looks up the uncompressed key recovered from a signature,
+        // a compressed key would only be found by FindKey
+        if (regkey.key.IsCompressed())
+            return error("CPrimeNodeRegistry::Load() : compressed primenode key %s", dbentry.key.c_str());
+        vNewKeys.push_back(regkey);
+    }
+    sort(vNewKeys.begin(), vNewKeys.end());
+
+    map<CKeyID, unsigned int> mapNewKeyIndex;
+    for (unsigned int i = 0; i < vNewKeys.size(); i++)
+        mapNewKeyIndex[vNewKeys[i].key.GetPubKey().GetID()] = i;
+
+    {
+        LOCK(cs);
+        vKeys.swap(vNewKeys);
+        mapKeyIndex.swap(mapNewKeyIndex);
+    }
+    // Accepted stakes may depend on keys that are gone now.
+    primeStakeCache.Clear();
+    printf("CPrimeNodeRegistry::Load() : %u primenode keys loaded\n", (unsigned int)entries.size());
+    return true;
+}
+
+void CPrimeNodeRegistry::Clear() {
+    LOCK(cs);
+    vKeys.clear();
+    mapKeyIndex.clear();
+}
+
+size_t CPrimeNodeRegistry::size() const {
+    LOCK(cs);
+    return vKeys.size();
+}
+
+/* Same result as CPrimeNodeDB::IsPrimeNodeKey. Keys valid at nTime are tried
+ * first, the remaining keys are only tried once those have all failed so that
+ * IsPrimeStake can still tell an out of range key from an unknown one. Keys
+ * past the first one starting after nTime are not valid yet. */
+bool CPrimeNodeRegistry::FindKey(uint256 hash, const vector<unsigned char> &vchSig, unsigned int nTime, CPrimeNodeDBEntry &entry) {
+    vector<CRegisteredKey>::iterator itStarted = upper_bound(vKeys.begin(), vKeys.end(), nTime, StartsAfter);
+    vector<CRegisteredKey*> vExpired;
+    for (vector<CRegisteredKey>::iterator it = vKeys.begin(); it != itStarted; ++it) {
+        if (it->entry.valid_until != -1 && nTime >= it->entry.valid_until) {
+            vExpired.push_back(&*it);
+            continue;
+        }
+        if (it->key.Verify(hash, vchSig)) {
+            entry = it->entry;
+            return true;
+        }
+    }
+
+    BOOST_FOREACH(CRegisteredKey *pregkey, vExpired) {
+        if (pregkey->key.Verify(hash, vchSig)) {
+            entry = pregkey->entry;
+            return true;
+        }
+    }
+    for (vector<CRegisteredKey>::iterator it = itStarted; it != vKeys.end(); ++it) {
+        if (it->key.Verify(hash, vchSig)) {
+            entry = it->entry;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Recover the candidate signing keys from the signature and look them up in
+ * mapKeyIndex. A matching key is still verified against the signature so the
+ * accept/reject decision is exactly that of FindKey. */
+bool CPrimeNodeRegistry::RecoverKey(uint256 hash, const vector<unsigned char> &vchSig, CPrimeNodeDBEntry &entry) {
+    for (int nRecId = 0; nRecId < 4; nRecId++) {
+        CKey keyRec;
+        if (!keyRec.SetSignature(hash, vchSig, nRecId))
+            continue;
+        map<CKeyID, unsigned int>::const_iterator mi = mapKeyIndex.find(keyRec.GetPubKey().GetID());
+        if (mi == mapKeyIndex.end())
+            continue;
+        CRegisteredKey &regkey = vKeys[mi->second];
+        if (regkey.key.Verify(hash, vchSig)) {
+            entry = regkey.entry;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CPrimeNodeRegistry::IsPrimeNodeKey(const CScript &scriptPubKeyType, unsigned int nTime, CPrimeNodeDBEntry &entry) {
+    if (scriptPubKeyType.size() < 2)
+        return false;
+
+    CScript scriptTime;
+    scriptTime << nTime;
+    uint256 hashScriptTime = Hash(scriptTime.begin(), scriptTime.end());
+    vector<unsigned char> vchSig(scriptPubKeyType.begin() + 2, scriptPubKeyType.end());
+
+    LOCK(cs);
+    if (fRecoverKeys)
+        return RecoverKey(hashScriptTime, vchSig, entry);
+    return FindKey(hashScriptTime, vchSig, nTime, entry);
+}
+
+// Inflate the primenode table in the primeNodeDB and reload the registry from it
+bool InflatePrimeNodeDB(CPrimeNodeDB::dbtype db) {
     printf("InflatePrimeNodeDB() : Primenode database is inconsistent, inflating database.\n");
     // Db is open in read-only mode, close and reopen it with write privs.
     primeNodeDB->Close();
@@ -298,18 +442,19 @@ void InflatePrimeNodeDB(CPrimeNodeDB::dbtype db) {
     delete primeNodeDB;
     primeNodeDB = new CPrimeNodeDB("w+");
 
-    if (db == CPrimeNodeDB::primedb || db == CPrimeNodeDB::fulldb)
+    if (db == CPrimeNodeDB::primedb)
         primeNodeDB->WritePrimeNodeDB();
 
-    if (db == CPrimeNodeDB::microdb || db == CPrimeNodeDB::fulldb)
-        fTestNet ? primeNodeDB->WriteTestMicroPrimeDB() : primeNodeDB->WriteMicroPrimeDB();
-
     /* Close Db and reopen it w/ read-only privs because we won't need to write
      * to it again. */
     primeNodeDB->Close();
     bitdb.CloseDb("primenodes.dat");
     delete primeNodeDB;
     primeNodeDB = new CPrimeNodeDB("r");
+
+    if (!primeNodeRegistry.Load(*primeNodeDB))
+        return error("InflatePrimeNodeDB() : unable to load primenode keys");
+    return true;
 }
 
 bool CPrimeNodeDB::WritePrimeNodeDBVersion(int version)
@@ -322,11 +467,6 @@ bool CPrimeNodeDB::WritePrimeNodeKey(const string key, unsigned int valid_starti
     return Write(make_pair(string("primenode"), key), make_pair(valid_starting, valid_until));
 }
 
-bool CPrimeNodeDB::WriteMicroPrimeAddr(const string address, int64 group)
-{
-    return Write(make_pair(string("microprime"), address), group);
-}
-
 bool CPrimeNodeDB::CheckPrimeNodeDBVersion(int &version)
 {
     if (!Exists(string("dbversion")))
@@ -341,16 +481,43 @@ bool CPrimeNodeDB::CheckPrimeNodeKey(const string key)
     return Exists(make_pair(string("primenode"), key));
 }
 
-bool CPrimeNodeDB::IsMicroPrime(CScript scriptPubKeyAddress, int &primeNodeRate, int64 &group, unsigned int nTime)
+// Find the table entry for the given address, NULL if it isn't a microprime.
+static const CMicroPrimeEntry* FindMicroPrime(const CTxDestination &address)
+{
+    const CKeyID *keyID = boost::get<CKeyID>(&address);
+    if (!keyID)
+        return NULL;
+
+    const CMicroPrimeEntry* pbegin = fTestNet ? testMicroPrimeTable : microPrimeTable;
+    const CMicroPrimeEntry* pend = pbegin + (fTestNet ? testMicroPrimeTableSize : microPrimeTableSize);
+    const unsigned char* pkey = (const unsigned char*)keyID;
+
+    // Binary search, the table is sorted by hash.
+    while (pbegin < pend) {
+        const CMicroPrimeEntry* pmid = pbegin + (pend - pbegin) / 2;
+        int cmp = memcmp(pmid->hash, pkey, sizeof(pmid->hash));
+        if (cmp == 0)
+            return pmid;
+        if (cmp < 0)
+            pbegin = pmid + 1;
+        else
+            pend = pmid;
+    }
+    return NULL;
+}
+
+bool IsMicroPrime(const CScript &scriptPubKeyAddress, int &primeNodeRate, int64 &group, unsigned int nTime)
 {
     CTxDestination address;
     ExtractDestination(scriptPubKeyAddress, address);
-    CBitcoinAddress addr(address);
+    const CMicroPrimeEntry* pentry = FindMicroPrime(address);
+    if (!pentry)
+        return false;
 
-    Read(make_pair(string("microprime"), addr.ToString()), group);
+    group = pentry->group;
 
     /* All microprimes have the same rate so no need to store that in the
-     * database. Stagger those rates down from the original 25% rate to 10%
+     * table. Stagger those rates down from the original 25% rate to 10%
      * over the defined time frame. */
     primeNodeRate = 25;
 
@@ -368,16 +535,19 @@ bool CPrimeNodeDB::IsMicroPrime(CScript scriptPubKeyAddress, int &primeNodeRate,
     return true;
 }
 
-bool CPrimeNodeDB::CheckMicroPrime(const string address)
+bool CheckMicroPrime(const string &address)
 {
-    return Exists(make_pair(string("microprime"), address));
+    CBitcoinAddress addr(address);
+    if (!addr.IsValid())
+        return false;
+
+    return FindMicroPrime(addr.Get()) != NULL;
 }
 
-bool CPrimeNodeDB::CheckMicroPrime(CScript scriptPubKeyAddress)
+bool CheckMicroPrime(const CScript &scriptPubKeyAddress)
 {
     CTxDestination address;
     ExtractDestination(scriptPubKeyAddress, address);
-    CBitcoinAddress addr(address);
 
-    return CheckMicroPrime(addr.ToString());
+    return FindMicroPrime(address) != NULL;
 }
@@ -5,6 +5,7 @@
 #define PRIMENODES_H
 
 #include "db.h"
+#include "mruset.h"
 #include "script.h"
 
 // Used for stake confirmation
@@ -55,9 +56,7 @@ class CPrimeNodeDB : public CDB
 public:
     enum dbtype {
         nodb,
-        primedb,
-        microdb,
-        fulldb
+        primedb
     };
 
     CPrimeNodeDB(const char* pszMode="r+") : CDB("primenodes.dat", pszMode) { }
@@ -68,24 +67,150 @@ private:
     void operator=(const CPrimeNodeDB);
 
     bool WritePrimeNodeKey(const std::string /*key*/, unsigned int /*valid_starting*/, unsigned int /*valid_until*/);
-    bool WriteMicroPrimeAddr(const std::string /*address*/, int64 /*group*/);
     bool WritePrimeNodeDBVersion(int /*version*/);
 public:
     void WritePrimeNodeDB();
-    void WriteMicroPrimeDB();
-    void WriteTestMicroPrimeDB();
 
     bool CheckPrimeNodeDBVersion(int &/*version*/);
 
+    bool ReadPrimeNodeKeys(std::vector<CPrimeNodeDBEntry> &/*entries*/);
     bool IsPrimeNodeKey(CScript /*scriptPubKeyType*/, unsigned int /*nTime*/, CPrimeNodeDBEntry &/*entry*/);
-    bool IsMicroPrime(CScript /*scriptPubKeyAddress*/, int &/*primeNodeRate*/, int64 &/*group*/, unsigned int /*nTime*/);
     bool CheckPrimeNodeKey(const std::string /*key*/);
-    bool CheckMicroPrime(const std::string /*address*/);
-    bool CheckMicroPrime(CScript /*scriptPubKeyAddress*/);
 };
 
-void InflatePrimeNodeDB(CPrimeNodeDB::dbtype /*db*/);
+/* Microprime addresses are compiled in (mpkeys.cpp for mainnet, mpkeys_test.cpp
+ * for testnet). The tables are generated by contrib/devtools/gen-microprimes.py
+ * and sorted by the hash160 of the address so that lookups are a binary search
+ * instead of a database read. */
+struct CMicroPrimeEntry
+{
+    unsigned char hash[20];
+    int64 group;
+};
+
+extern const CMicroPrimeEntry microPrimeTable[];
+extern const unsigned int microPrimeTableSize;
+extern const CMicroPrimeEntry testMicroPrimeTable[];
+extern const unsigned int testMicroPrimeTableSize;
+
+bool CheckMicroPrime(const std::string &/*address*/);
+bool CheckMicroPrime(const CScript &/*scriptPubKeyAddress*/);
+bool IsMicroPrime(const CScript &/*scriptPubKeyAddress*/, int &/*primeNodeRate*/, int64 &/*group*/, unsigned int /*nTime*/);
+
+/* In-memory copy of the primenode keys held in the primeNodeDB. The keys are
+ * parsed once when the database is loaded instead of on every stake check and
+ * are kept ordered by valid_starting so that the keys not valid yet at the
+ * time of a stake are found with a binary search and only verified against
+ * its signature after the others have failed.
+ *
+ * With fRecoverKeys set the signing key is recovered from the signature and
+ * looked up in mapKeyIndex instead, so the cost of a check no longer depends
+ * on the number of registered keys. */
+class CPrimeNodeRegistry
+{
+private:
+    class CRegisteredKey
+    {
+    public:
+        CPrimeNodeDBEntry entry;
+        CKey key;
+
+        bool operator<(const CRegisteredKey &b) const
+        {
+            if (entry.valid_starting != b.entry.valid_starting)
+                return entry.valid_starting < b.entry.valid_starting;
+            return entry.valid_until < b.entry.valid_until;
+        }
+    };
+
+    static bool StartsAfter(unsigned int nTime, const CRegisteredKey &regkey)
+    {
+        return nTime < regkey.entry.valid_starting;
+    }
+
+    mutable CCriticalSection cs;
+    std::vector<CRegisteredKey> vKeys;
+    std::map<CKeyID, unsigned int> mapKeyIndex;
+    bool fRecoverKeys;
+
+    bool FindKey(uint256 /*hash*/, const std::vector<unsigned char> &/*vchSig*/, unsigned int /*nTime*/, CPrimeNodeDBEntry &/*entry*/);
+    bool RecoverKey(uint256 /*hash*/, const std::vector<unsigned char> &/*vchSig*/, CPrimeNodeDBEntry &/*entry*/);
+
+public:
+    CPrimeNodeRegistry() : fRecoverKeys(true) { }
+
+    bool Load(CPrimeNodeDB &/*db*/);
+    void Clear();
+    size_t size() const;
+
+    void SetRecoverKeys(bool fRecoverKeysIn) { LOCK(cs); fRecoverKeys = fRecoverKeysIn; }
+    bool GetRecoverKeys() const { LOCK(cs); return fRecoverKeys; }
+
+    bool IsPrimeNodeKey(const CScript &/*scriptPubKeyType*/, unsigned int /*nTime*/, CPrimeNodeDBEntry &/*entry*/);
+};
+
+/* Everything CTransaction::IsPrimeStake bases its decision on. The coinstake
+ * hash commits to the scripts, nTime and nValueOut but nValueIn and nCoinAge
+ * come from the inputs so all of them make up the key. */
+class CPrimeStakeKey
+{
+public:
+    uint256 hashTx;
+    unsigned int nTime;
+    CScript scriptPubKeyType;
+    CScript scriptPubKeyAddress;
+    int64 nValueIn;
+    int64 nValueOut;
+    uint64 nCoinAge;
+
+    CPrimeStakeKey(const uint256 &hashTxIn, unsigned int nTimeIn, const CScript &scriptPubKeyTypeIn, const CScript &scriptPubKeyAddressIn, int64 nValueInIn, int64 nValueOutIn, uint64 nCoinAgeIn) :
+        hashTx(hashTxIn), nTime(nTimeIn), scriptPubKeyType(scriptPubKeyTypeIn), scriptPubKeyAddress(scriptPubKeyAddressIn),
+        nValueIn(nValueInIn), nValueOut(nValueOutIn), nCoinAge(nCoinAgeIn) { }
+
+    friend bool operator<(const CPrimeStakeKey &a, const CPrimeStakeKey &b)
+    {
+        if (a.hashTx != b.hashTx)
+            return a.hashTx < b.hashTx;
+        if (a.nTime != b.nTime)
+            return a.nTime < b.nTime;
+        if (a.nValueIn != b.nValueIn)
+            return a.nValueIn < b.nValueIn;
+        if (a.nValueOut != b.nValueOut)
+            return a.nValueOut < b.nValueOut;
+        if (a.nCoinAge != b.nCoinAge)
+            return a.nCoinAge < b.nCoinAge;
+        if (a.scriptPubKeyType != b.scriptPubKeyType)
+            return a.scriptPubKeyType < b.scriptPubKeyType;
+        return a.scriptPubKeyAddress < b.scriptPubKeyAddress;
+    }
+};
+
+/* Bounded cache of accepted prime and microprime stakes so that a coinstake
+ * that is validated again (CheckBlock/ConnectBlock rechecks, reorgs) doesn't
+ * repeat the key lookups and signature checks. Only accepted stakes are kept,
+ * rejections are rare and need to run again to apply their DoS score. The
+ * cache is cleared whenever the primenode keys are reloaded. */
+class CPrimeStakeCache
+{
+private:
+    mutable CCriticalSection cs;
+    mruset<CPrimeStakeKey> setAccepted;
+    uint64 nHits;
+    uint64 nMisses;
+
+public:
+    CPrimeStakeCache(unsigned int nMaxSize) : setAccepted(nMaxSize), nHits(0), nMisses(0) { }
+
+    bool Contains(const CPrimeStakeKey &/*key*/);
+    void Insert(const CPrimeStakeKey &/*key*/);
+    void Clear();
+    void GetStats(uint64 &/*nHitsRet*/, uint64 &/*nMissesRet*/, unsigned int &/*nSizeRet*/, unsigned int &/*nMaxSizeRet*/) const;
+};
+
+bool InflatePrimeNodeDB(CPrimeNodeDB::dbtype /*db*/);
 
 extern CPrimeNodeDB* primeNodeDB;
+extern CPrimeNodeRegistry primeNodeRegistry;
+extern CPrimeStakeCache primeStakeCache;
 
 #endif // PRIMENODES_H
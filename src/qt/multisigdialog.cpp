@@ -386,7 +386,7 @@ void MultisigDialog::on_signTransactionButton_clicked()
         CTransaction tempTx;
         MapPrevTx mapPrevTx;
         CTxDB txdb("r");
-        std::map<uint256, CTxIndex> unused;
+        std::map<uint256, CCoins> unused;
         bool fInvalid;
 
         tempTx.vin.push_back(mergedTx.vin[i]);
@@ -395,8 +395,8 @@ void MultisigDialog::on_signTransactionButton_clicked()
         BOOST_FOREACH(const CTxIn& txin, tempTx.vin)
         {
             const uint256& prevHash = txin.prevout.hash;
-            if(mapPrevTx.count(prevHash) && mapPrevTx[prevHash].second.vout.size() > txin.prevout.n)
-                mapPrevOut[txin.prevout] = mapPrevTx[prevHash].second.vout[txin.prevout.n].scriptPubKey;
+            if(mapPrevTx.count(prevHash) && mapPrevTx[prevHash].IsAvailable(txin.prevout.n))
+                mapPrevOut[txin.prevout] = mapPrevTx[prevHash].vout[txin.prevout.n].scriptPubKey;
         }
     }
 
@@ -7,6 +7,7 @@
 #include "main.h"
 #include "bitcoinrpc.h"
 #include "checkpoints.h"
+#include "primenodes.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -188,3 +189,23 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+// trollocoin: statistics of the accepted prime/microprime stake cache
+Value getprimestakecacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getprimestakecacheinfo\n"
+            "Returns hit/miss counters of the prime stake validation cache.");
+
+    uint64 nHits, nMisses;
+    unsigned int nSize, nMaxSize;
+    primeStakeCache.GetStats(nHits, nMisses, nSize, nMaxSize);
+
+    Object result;
+    result.push_back(Pair("hits", (boost::uint64_t)nHits));
+    result.push_back(Pair("misses", (boost::uint64_t)nMisses));
+    result.push_back(Pair("size", (int)nSize));
+    result.push_back(Pair("maxsize", (int)nMaxSize));
+    return result;
+}
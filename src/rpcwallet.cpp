@@ -1134,51 +1134,49 @@ Value listtransactions(const Array& params, bool fHelp)
     Array ret;
     CWalletDB walletdb(pwalletMain->strWalletFile);
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-time multimap.
-    typedef pair<CWalletTx*, CAccountingEntry*> TxPair;
-    typedef multimap<int64, TxPair > TxItems;
-    TxItems txByTime;
-
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        CWalletTx* wtx = &((*it).second);
-        txByTime.insert(make_pair(wtx->GetTxTime(), TxPair(wtx, (CAccountingEntry*)0)));
-    }
+    // trollocoin: walk the wallet's time index back from the newest transaction,
+    // merged with the accounting entries, and stop once nCount entries past
+    // nFrom are collected. Older transactions are never looked at.
+    typedef multimap<int64, CAccountingEntry*> AcentryItems;
     list<CAccountingEntry> acentries;
     walletdb.ListAccountCreditDebit(strAccount, acentries);
+    AcentryItems acentryByTime;
     BOOST_FOREACH(CAccountingEntry& entry, acentries)
-    {
-        txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
-    }
+        acentryByTime.insert(make_pair(entry.nTime, &entry));
 
-    // iterate backwards until we have nCount items to return:
-    for (TxItems::reverse_iterator it = txByTime.rbegin(); it != txByTime.rend(); ++it)
+    CWallet::TxTimeIndex::reverse_iterator itTx = pwalletMain->setWalletByTime.rbegin();
+    AcentryItems::reverse_iterator itAcentry = acentryByTime.rbegin();
+    int nSkip = nFrom;
+    while ((int)ret.size() < nCount)
     {
-        CWalletTx *const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
-        CAccountingEntry *const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
-
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        Array entries;
+        // At equal times accounting entries are listed first
+        if (itAcentry != acentryByTime.rend() &&
+            (itTx == pwalletMain->setWalletByTime.rend() || (*itAcentry).first >= (*itTx).first))
+        {
+            AcentryToJSON(*(*itAcentry).second, strAccount, entries);
+            ++itAcentry;
+        }
+        else if (itTx != pwalletMain->setWalletByTime.rend())
+        {
+            map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find((*itTx).second);
+            if (mi != pwalletMain->mapWallet.end())
+                ListTransactions((*mi).second, strAccount, 0, true, entries);
+            ++itTx;
+        }
+        else
+            break;
+
+        BOOST_FOREACH(const Value& entry, entries)
+        {
+            if (nSkip > 0)
+                nSkip--;
+            else if ((int)ret.size() < nCount)
+                ret.push_back(entry);
+        }
     }
     // ret is newest to oldest
 
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
-    Array::iterator first = ret.begin();
-    std::advance(first, nFrom);
-    Array::iterator last = ret.begin();
-    std::advance(last, nFrom+nCount);
-
-    if (last != ret.end()) ret.erase(last, ret.end());
-    if (first != ret.begin()) ret.erase(ret.begin(), first);
-
     std::reverse(ret.begin(), ret.end()); // Return oldest to newest
 
     return ret;
@@ -1327,7 +1325,7 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
     {
-        CWalletTx tx = (*it).second;
+        const CWalletTx& tx = (*it).second;
 
         if (depth == -1 || tx.GetDepthInMainChain() < depth)
             ListTransactions(tx, "*", 0, true, transactions);
@@ -1808,14 +1806,14 @@ Value listmicroprimedata(const Array& params, bool fHelp)
     if (!IsMine(*pwalletMain, address.Get()))
         throw runtime_error("Address must be in wallet.");
 
-    if (!primeNodeDB->CheckMicroPrime(strAddress))
+    if (!CheckMicroPrime(strAddress))
         throw runtime_error("Address is not a valid microprime address.");
 
     int primeNodeRate;
     int64 group;
     CScript scriptMPAddress;
     scriptMPAddress.SetDestination(address.Get());
-    if (!primeNodeDB->IsMicroPrime(scriptMPAddress, primeNodeRate, group, GetTime()))
+    if (!IsMicroPrime(scriptMPAddress, primeNodeRate, group, GetTime()))
         throw runtime_error("Address is not a valid microprime address.");
 
     Object obj;
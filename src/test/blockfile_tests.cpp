@@ -0,0 +1,69 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockfile_tests)
+
+BOOST_AUTO_TEST_CASE(blockfile_read)
+{
+    // The genesis block is written by LoadBlockIndex in the test setup
+    BOOST_REQUIRE(pindexGenesisBlock != NULL);
+    CBlockFileSpan span;
+    BOOST_CHECK(MapBlockFile(pindexGenesisBlock->nFile, pindexGenesisBlock->nBlockPos, span));
+
+    CBlock block;
+    BOOST_CHECK(block.ReadFromDisk(pindexGenesisBlock));
+    BOOST_CHECK(block.GetHash() == hashGenesisBlock);
+    BOOST_CHECK_EQUAL((unsigned int)(span.pend - span.pbegin), ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION));
+
+    // The coinbase is found through its position in the block
+    unsigned int nTxPos = pindexGenesisBlock->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+    CTransaction tx;
+    BOOST_CHECK(tx.ReadFromDisk(CDiskTxPos(pindexGenesisBlock->nFile, pindexGenesisBlock->nBlockPos, nTxPos)));
+    BOOST_CHECK(tx.GetHash() == block.vtx[0].GetHash());
+    BOOST_CHECK(!tx.ReadFromDisk(CDiskTxPos(pindexGenesisBlock->nFile, pindexGenesisBlock->nBlockPos, pindexGenesisBlock->nBlockPos - 1)));
+
+    // Positions that are not in a block file are refused
+    BOOST_CHECK(!MapBlockFile(pindexGenesisBlock->nFile, 4, span));
+    BOOST_CHECK(!MapBlockFile(pindexGenesisBlock->nFile, 0x7F000000, span));
+    BOOST_CHECK(!MapBlockFile(9999, 8, span));
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_info)
+{
+    // The genesis block was recorded when it was added to the index
+    CBlockFileInfo info;
+    BOOST_CHECK(GetBlockFileInfo(pindexGenesisBlock->nFile, info));
+    BOOST_CHECK(info.nBlocks >= 1);
+    BOOST_CHECK_EQUAL(info.nHeightFirst, 0);
+    BOOST_CHECK(info.nSize >= pindexGenesisBlock->nBlockPos);
+
+    info.SetNull();
+    info.AddBlock(12, 1500);
+    info.AddBlock(10, 1400);
+    info.AddBlock(11, 1600);
+    BOOST_CHECK_EQUAL(info.nBlocks, 3u);
+    BOOST_CHECK_EQUAL(info.nHeightFirst, 10);
+    BOOST_CHECK_EQUAL(info.nHeightLast, 12);
+    BOOST_CHECK_EQUAL(info.nTimeFirst, 1400u);
+    BOOST_CHECK_EQUAL(info.nTimeLast, 1600u);
+}
+
+BOOST_AUTO_TEST_CASE(spanreader)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << 7 << string("span");
+    string strData = ss.str();
+    CSpanReader reader(strData.data(), strData.data() + strData.size(), SER_DISK, CLIENT_VERSION);
+    int n;
+    string str;
+    reader >> n >> str;
+    BOOST_CHECK_EQUAL(n, 7);
+    BOOST_CHECK_EQUAL(str, "span");
+    BOOST_CHECK(reader.eof());
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,241 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "kernel.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+// Synthetic wallet of coins old enough to stake at nTimeTx
+static void CreateStakeKernels(vector<CStakeKernel>& vKernels, unsigned int nCoins, unsigned int nTimeTx)
+{
+    vKernels.clear();
+    for (unsigned int i = 0; i < nCoins; i++)
+    {
+        unsigned int nTimeTxPrev = nTimeTx - nStakeMinAge - GetRandInt(STAKE_MAX_AGE);
+        vKernels.push_back(CStakeKernel(GetRand(std::numeric_limits<uint64>::max()), nTimeTxPrev - GetRandInt(600), GetRandInt(1000000),
+            nTimeTxPrev, COutPoint(GetRandHash(), GetRandInt(4)), (1 + GetRandInt(10000)) * COIN));
+    }
+}
+
+// The search CreateCoinStake did before searching in parallel
+static bool FindStakeKernelSerial(unsigned int nBits, const vector<CStakeKernel>& vKernels, unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nKernelRet, unsigned int& nTimeTxRet, uint256& hashProofOfStake)
+{
+    for (unsigned int i = 0; i < vKernels.size(); i++)
+        for (unsigned int n = 0; n < nSearchInterval; n++)
+            if (CheckStakeKernelHash(nBits, vKernels[i], nTimeTx - n, hashProofOfStake))
+            {
+                nKernelRet = i;
+                nTimeTxRet = nTimeTx - n;
+                return true;
+            }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_search)
+{
+    unsigned int nTimeTx = GetTime();
+    unsigned int nSearchInterval = 60;
+    vector<CStakeKernel> vKernels;
+    CreateStakeKernels(vKernels, 1000, nTimeTx);
+
+    // A target a few of the kernels meet and one no kernel can meet
+    unsigned int nBitsHard = CBigNum(~uint256(0) >> 24).GetCompact();
+    unsigned int nBitsNone = CBigNum(1).GetCompact();
+    vector<unsigned int> vBits;
+    vBits.push_back(nBitsHard);
+    vBits.push_back(nBitsNone);
+
+    BOOST_FOREACH(unsigned int nBits, vBits)
+    {
+        unsigned int nKernelSerial = 0, nTimeTxSerial = 0;
+        uint256 hashSerial = 0;
+        bool fSerial = FindStakeKernelSerial(nBits, vKernels, nTimeTx, nSearchInterval, nKernelSerial, nTimeTxSerial, hashSerial);
+        BOOST_CHECK_EQUAL(fSerial, nBits == nBitsHard);
+
+        // Same kernel at the same time as the serial search
+        unsigned int nKernel = 0, nTimeTxFound = 0;
+        uint256 hashProofOfStake = 0;
+        bool fFound = FindStakeKernel(nBits, vKernels, nTimeTx, nSearchInterval, 4, nKernel, nTimeTxFound, hashProofOfStake);
+        BOOST_CHECK_EQUAL(fFound, fSerial);
+        if (fFound && fSerial)
+        {
+            BOOST_CHECK_EQUAL(nKernel, nKernelSerial);
+            BOOST_CHECK_EQUAL(nTimeTxFound, nTimeTxSerial);
+            BOOST_CHECK(hashProofOfStake == hashSerial);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_hash_batch)
+{
+    unsigned int nTimeTx = GetTime();
+    unsigned int nSearchInterval = 60;
+    vector<CStakeKernel> vKernels;
+    CreateStakeKernels(vKernels, 2000, nTimeTx);
+
+    // Coins crossing the min age and the tx time within the search interval,
+    // and too large for the fast coin day weight
+    vKernels[0].nTimeBlockFrom = nTimeTx - nStakeMinAge - nSearchInterval / 2;
+    vKernels[1].nTimeTxPrev = nTimeTx - nSearchInterval / 2;
+    vKernels[2].nValueIn = std::numeric_limits<int64>::max() / 2;
+
+    // Easy enough for about half of the coins to have a hit somewhere
+    unsigned int nBitsEasy = CBigNum(~uint256(0) >> 20).GetCompact();
+    unsigned int nHits = 0;
+    BOOST_FOREACH(const CStakeKernel& kernel, vKernels)
+    {
+        unsigned int nTimeTxSerial = 0;
+        uint256 hashSerial = 0;
+        bool fSerial = false;
+        for (unsigned int n = 0; n < nSearchInterval && !fSerial; n++)
+        {
+            fSerial = CheckStakeKernelHash(nBitsEasy, kernel, nTimeTx - n, hashSerial);
+            nTimeTxSerial = nTimeTx - n;
+        }
+
+        unsigned int nTimeTxBatch = 0;
+        uint256 hashBatch = 0;
+        bool fBatch = CheckStakeKernelHashBatch(nBitsEasy, kernel, nTimeTx, nSearchInterval, nTimeTxBatch, hashBatch);
+        BOOST_CHECK_EQUAL(fBatch, fSerial);
+        if (fBatch && fSerial)
+        {
+            BOOST_CHECK_EQUAL(nTimeTxBatch, nTimeTxSerial);
+            BOOST_CHECK(hashBatch == hashSerial);
+            nHits++;
+        }
+    }
+    BOOST_CHECK(nHits > 0 && nHits < vKernels.size());
+}
+
+// ComputeNextStakeModifier as it was before the selection hashes were
+// computed once per candidate, for a chain that isn't in mapBlockIndex
+static int64 GetSelectionIntervalSection(int nSection)
+{
+    return (nModifierInterval * 63 / (63 + ((63 - nSection) * (MODIFIER_INTERVAL_RATIO - 1))));
+}
+
+static uint64 ComputeNextStakeModifierSerial(const CBlockIndex* pindexCurrent, bool& fGeneratedStakeModifier)
+{
+    const CBlockIndex* pindexPrev = pindexCurrent->pprev;
+    const CBlockIndex* pindexLast = pindexPrev;
+    while (pindexLast->pprev && !pindexLast->GeneratedStakeModifier())
+        pindexLast = pindexLast->pprev;
+    uint64 nStakeModifier = pindexLast->nStakeModifier;
+    int64 nModifierTime = pindexLast->GetBlockTime();
+    fGeneratedStakeModifier = false;
+    if (nModifierTime / nModifierInterval >= pindexPrev->GetBlockTime() / nModifierInterval ||
+        nModifierTime / nModifierInterval >= pindexCurrent->GetBlockTime() / nModifierInterval)
+        return nStakeModifier;
+
+    map<uint256, const CBlockIndex*> mapCandidates;
+    vector<pair<int64, uint256> > vSortedByTimestamp;
+    int64 nSelectionInterval = 0;
+    for (int nSection = 0; nSection < 64; nSection++)
+        nSelectionInterval += GetSelectionIntervalSection(nSection);
+    int64 nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
+    for (const CBlockIndex* pindex = pindexPrev; pindex && pindex->GetBlockTime() >= nSelectionIntervalStart; pindex = pindex->pprev)
+    {
+        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        mapCandidates[pindex->GetBlockHash()] = pindex;
+    }
+    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+
+    uint64 nStakeModifierNew = 0;
+    int64 nSelectionIntervalStop = nSelectionIntervalStart;
+    set<uint256> setSelected;
+    for (int nRound = 0; nRound < min(64, (int)vSortedByTimestamp.size()); nRound++)
+    {
+        nSelectionIntervalStop += GetSelectionIntervalSection(nRound);
+        const CBlockIndex* pindexSelected = NULL;
+        uint256 hashBest = 0;
+        BOOST_FOREACH(const PAIRTYPE(int64, uint256)& item, vSortedByTimestamp)
+        {
+            const CBlockIndex* pindex = mapCandidates[item.second];
+            if (pindexSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+                break;
+            if (setSelected.count(item.second))
+                continue;
+            CDataStream ss(SER_GETHASH, 0);
+            ss << (pindex->IsProofOfStake()? pindex->hashProofOfStake : pindex->GetBlockHash()) << nStakeModifier;
+            uint256 hashSelection = Hash(ss.begin(), ss.end());
+            if (pindex->IsProofOfStake())
+                hashSelection >>= 32;
+            if (!pindexSelected || hashSelection < hashBest)
+            {
+                hashBest = hashSelection;
+                pindexSelected = pindex;
+            }
+        }
+        nStakeModifierNew |= (((uint64)pindexSelected->GetStakeEntropyBit()) << nRound);
+        setSelected.insert(pindexSelected->GetBlockHash());
+    }
+    fGeneratedStakeModifier = true;
+    return nStakeModifierNew;
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_selection)
+{
+    // Synthetic chain of a day of blocks with a mix of proof-of-work and
+    // proof-of-stake blocks and timestamps that are not always increasing
+    const int nBlocks = 24 * 60 * 60 / STAKE_TARGET_SPACING;
+    vector<uint256> vHashes(nBlocks);
+    vector<CBlockIndex> vBlocks(nBlocks);
+    int64 nTime = GetTime() - nBlocks * STAKE_TARGET_SPACING;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        CBlockIndex& block = vBlocks[i];
+        vHashes[i] = GetRandHash();
+        block.phashBlock = &vHashes[i];
+        block.nHeight = i;
+        block.pprev = (i > 0 ? &vBlocks[i - 1] : NULL);
+        if (i > 0)
+            vBlocks[i - 1].pnext = &block;
+        block.nTime = nTime + i * STAKE_TARGET_SPACING + GetRandInt(STAKE_TARGET_SPACING * 2) - STAKE_TARGET_SPACING;
+        if (GetRandInt(2))
+        {
+            block.SetProofOfStake();
+            block.hashProofOfStake = GetRandHash();
+        }
+        block.SetStakeEntropyBit(GetRandInt(2));
+    }
+    vBlocks[0].SetStakeModifier(0, true);
+
+    int nGenerated = 0;
+    for (int i = 1; i < nBlocks; i++)
+    {
+        bool fGeneratedSerial = false;
+        uint64 nStakeModifierSerial = ComputeNextStakeModifierSerial(&vBlocks[i], fGeneratedSerial);
+
+        bool fGenerated = false;
+        uint64 nStakeModifier = 0;
+        BOOST_CHECK(ComputeNextStakeModifier(&vBlocks[i], nStakeModifier, fGenerated));
+
+        BOOST_CHECK_EQUAL(fGenerated, fGeneratedSerial);
+        BOOST_CHECK_EQUAL(nStakeModifier, nStakeModifierSerial);
+        vBlocks[i].SetStakeModifier(nStakeModifier, fGenerated);
+        if (fGenerated)
+            nGenerated++;
+    }
+    BOOST_CHECK(nGenerated > 0);
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_min_age)
+{
+    unsigned int nTimeTx = GetTime();
+    unsigned int nBitsEasy = CBigNum(~uint256(0) >> 8).GetCompact();
+    uint256 hashProofOfStake = 0;
+
+    // Coins younger than the min age or with a timestamp after the coinstake
+    // never meet the target
+    CStakeKernel kernel(0, nTimeTx - nStakeMinAge + 1, 0, nTimeTx - nStakeMinAge, COutPoint(GetRandHash(), 0), 1000 * COIN);
+    BOOST_CHECK(!CheckStakeKernelHash(nBitsEasy, kernel, nTimeTx, hashProofOfStake));
+    kernel.nTimeBlockFrom = nTimeTx - STAKE_MAX_AGE;
+    kernel.nTimeTxPrev = nTimeTx + 1;
+    BOOST_CHECK(!CheckStakeKernelHash(nBitsEasy, kernel, nTimeTx, hashProofOfStake));
+    kernel.nTimeTxPrev = nTimeTx - STAKE_MAX_AGE;
+    BOOST_CHECK(CheckStakeKernelHash(nBitsEasy, kernel, nTimeTx, hashProofOfStake));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,142 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+
+#include "logdb.h"
+#include "util.h"
+
+using namespace std;
+using namespace boost;
+
+BOOST_AUTO_TEST_SUITE(logdb_tests)
+
+static bool CollectRecord(const string& strKey, const string& strValue, vector<string>& vKeys)
+{
+    vKeys.push_back(strKey);
+    return vKeys.size() < 2;
+}
+
+BOOST_AUTO_TEST_CASE(logdb_compress)
+{
+    string strIn, strCompressed, strOut;
+    for (int i = 0; i < 1000; i++)
+        strIn += strprintf("record %d ", i % 37);
+    BOOST_CHECK(LogDBCompress(strIn, strCompressed));
+    BOOST_CHECK(strCompressed.size() < strIn.size() / 2);
+    BOOST_CHECK(LogDBDecompress(strCompressed, strOut));
+    BOOST_CHECK(strOut == strIn);
+
+    // Random data does not compress and a damaged input is refused
+    string strRandom;
+    for (int i = 0; i < 1000; i++)
+        strRandom.push_back((char)GetRandInt(256));
+    BOOST_CHECK(!LogDBCompress(strRandom, strOut));
+    strCompressed.resize(strCompressed.size() - 1);
+    BOOST_CHECK(!LogDBDecompress(strCompressed, strOut));
+}
+
+BOOST_AUTO_TEST_CASE(logdb_replay)
+{
+    filesystem::path path = filesystem::temp_directory_path() / filesystem::unique_path("logdb_test_%%%%%%%%");
+    string strValue;
+    {
+        CLogDB logdb(path, 1 << 20);
+        BOOST_CHECK(logdb.Open());
+        BOOST_CHECK(logdb.IsEmpty());
+
+        CLogDBBatch batch;
+        batch.Write("a", "1");
+        batch.Write("b", string(1000, 'x'));
+        batch.Write("c", "3");
+        BOOST_CHECK(logdb.Write(batch));
+        batch.Clear();
+        batch.Erase("a");
+        batch.Write("c", "4");
+        BOOST_CHECK(logdb.Write(batch));
+
+        BOOST_CHECK(!logdb.Read("a", strValue));
+        BOOST_CHECK(logdb.Read("b", strValue) && strValue == string(1000, 'x'));
+        BOOST_CHECK(logdb.Read("c", strValue) && strValue == "4");
+
+        vector<string> vKeys;
+        BOOST_CHECK(logdb.Scan("b", boost::bind(&CollectRecord, _1, _2, boost::ref(vKeys))));
+        BOOST_CHECK(vKeys.size() == 2 && vKeys[0] == "b" && vKeys[1] == "c");
+    }
+
+    // A record cut short by a crash is dropped when the log is replayed
+    filesystem::path pathFile = path / "00000001.log";
+    uintmax_t nSize = filesystem::file_size(pathFile);
+    {
+        FILE* file = fopen(pathFile.string().c_str(), "ab");
+        fwrite("tldb\x40", 1, 5, file);
+        fclose(file);
+    }
+    {
+        CLogDB logdb(path, 1 << 20);
+        BOOST_CHECK(logdb.Open());
+        BOOST_CHECK_EQUAL(filesystem::file_size(pathFile), nSize);
+        BOOST_CHECK(!logdb.Exists("a"));
+        BOOST_CHECK(logdb.Read("b", strValue) && strValue == string(1000, 'x'));
+        BOOST_CHECK(logdb.Read("c", strValue) && strValue == "4");
+
+        BOOST_CHECK(logdb.Compact());
+        BOOST_CHECK(!filesystem::exists(pathFile));
+        BOOST_CHECK(logdb.Read("c", strValue) && strValue == "4");
+    }
+    {
+        CLogDB logdb(path, 1 << 20);
+        BOOST_CHECK(logdb.Open());
+        BOOST_CHECK(logdb.Read("b", strValue) && strValue == string(1000, 'x'));
+        BOOST_CHECK(logdb.Read("c", strValue) && strValue == "4");
+    }
+    filesystem::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(logdb_compact_crash)
+{
+    filesystem::path path = filesystem::temp_directory_path() / filesystem::unique_path("logdb_test_%%%%%%%%");
+    filesystem::path pathOther = filesystem::temp_directory_path() / filesystem::unique_path("logdb_test_%%%%%%%%");
+    string strValue;
+    {
+        CLogDB logdb(path, 1 << 20);
+        BOOST_CHECK(logdb.Open());
+        CLogDBBatch batch;
+        batch.Write("a", "1");
+        batch.Write("b", "2");
+        BOOST_CHECK(logdb.Write(batch));
+    }
+    {
+        CLogDB logdb(pathOther, 1 << 20);
+        BOOST_CHECK(logdb.Open());
+        CLogDBBatch batch;
+        batch.Erase("a");
+        batch.Write("c", "3");
+        BOOST_CHECK(logdb.Write(batch));
+    }
+
+    // The put of a is in the older file, its erase in the newer one
+    filesystem::copy_file(pathOther / "00000001.log", path / "00000002.log");
+    filesystem::copy_file(path / "00000001.log", path / "00000001.saved");
+    {
+        CLogDB logdb(path, 1 << 20);
+        BOOST_CHECK(logdb.Open());
+        BOOST_CHECK(!logdb.Exists("a"));
+        BOOST_CHECK(logdb.Compact());
+        BOOST_CHECK(!filesystem::exists(path / "00000001.log"));
+        BOOST_CHECK(!filesystem::exists(path / "00000002.log"));
+    }
+
+    // A crash that removed only the newest old file does not bring a back
+    filesystem::rename(path / "00000001.saved", path / "00000001.log");
+    {
+        CLogDB logdb(path, 1 << 20);
+        BOOST_CHECK(logdb.Open());
+        BOOST_CHECK(!logdb.Exists("a"));
+        BOOST_CHECK(logdb.Read("b", strValue) && strValue == "2");
+        BOOST_CHECK(logdb.Read("c", strValue) && strValue == "3");
+    }
+    filesystem::remove_all(path);
+    filesystem::remove_all(pathOther);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
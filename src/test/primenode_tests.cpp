@@ -41,19 +41,13 @@ BOOST_AUTO_TEST_CASE(primenode_validity)
     // Empty database, returns false.
     BOOST_CHECK(!primeNodeDB->IsPrimeNodeKey(scriptPubKeyTypeValid, nTime, entry));
     BOOST_CHECK(!primeNodeDB->IsPrimeNodeKey(scriptPubKeyTypeInvalid, nTime, entry));
-    BOOST_CHECK(!primeNodeDB->CheckMicroPrime(strMicroPrimeValid));
-    BOOST_CHECK(!primeNodeDB->CheckMicroPrime(strMicroPrimeInvalid));
 
-    // Inflate just the microprime database.
-    InflatePrimeNodeDB(CPrimeNodeDB::microdb);
-    // Database is only inflated with microprime keys, still return false.
-    BOOST_CHECK(!primeNodeDB->IsPrimeNodeKey(scriptPubKeyTypeValid, nTime, entry));
-
-    BOOST_CHECK(primeNodeDB->CheckMicroPrime(strMicroPrimeValid));
-    BOOST_CHECK(!primeNodeDB->CheckMicroPrime(strMicroPrimeInvalid));
+    // Microprimes are compiled in and don't depend on the database.
+    BOOST_CHECK(CheckMicroPrime(strMicroPrimeValid));
+    BOOST_CHECK(!CheckMicroPrime(strMicroPrimeInvalid));
 
     // Inflate the primenode side of the database.
-    InflatePrimeNodeDB(CPrimeNodeDB::primedb);
+    BOOST_CHECK(InflatePrimeNodeDB(CPrimeNodeDB::primedb));
     BOOST_CHECK(primeNodeDB->IsPrimeNodeKey(scriptPubKeyTypeValid, nTime, entry));
     BOOST_CHECK(!primeNodeDB->IsPrimeNodeKey(scriptPubKeyTypeInvalid, nTime, entry));
 
@@ -104,4 +98,202 @@ BOOST_AUTO_TEST_CASE(primenode_validity)
     fTestNet = false;
 }
 
+BOOST_AUTO_TEST_CASE(microprime_table)
+{
+    // Lookups are a binary search, both tables must be strictly sorted.
+    for (unsigned int i = 1; i < microPrimeTableSize; i++)
+        BOOST_CHECK(memcmp(microPrimeTable[i - 1].hash, microPrimeTable[i].hash, 20) < 0);
+    for (unsigned int i = 1; i < testMicroPrimeTableSize; i++)
+        BOOST_CHECK(memcmp(testMicroPrimeTable[i - 1].hash, testMicroPrimeTable[i].hash, 20) < 0);
+
+    // Every entry can be found and returns its own group.
+    for (int net = 0; net < 2; net++) {
+        fTestNet = (net == 1);
+        const CMicroPrimeEntry* ptable = fTestNet ? testMicroPrimeTable : microPrimeTable;
+        unsigned int nSize = fTestNet ? testMicroPrimeTableSize : microPrimeTableSize;
+        for (unsigned int i = 0; i < nSize; i++) {
+            uint160 hash;
+            memcpy(hash.begin(), ptable[i].hash, 20);
+            CScript script;
+            script.SetDestination(CKeyID(hash));
+            int primeNodeRate;
+            int64 group;
+            BOOST_CHECK(CheckMicroPrime(script));
+            BOOST_CHECK(IsMicroPrime(script, primeNodeRate, group, MICROPRIMES_STAGGER_DOWN));
+            BOOST_CHECK_EQUAL(group, ptable[i].group);
+            BOOST_CHECK_EQUAL(primeNodeRate, 25);
+
+            // The same hash as a script address is not a microprime.
+            script.SetDestination(CScriptID(hash));
+            BOOST_CHECK(!CheckMicroPrime(script));
+        }
+    }
+
+    // Addresses from the other network are rejected.
+    fTestNet = false;
+    BOOST_CHECK(CheckMicroPrime(string("P9Yo3PtaxuzeBZAimsGzz6mdTmdDtU6vhf")));
+    BOOST_CHECK(!CheckMicroPrime(string("muVEJW5YZpZc4QxUaDMJVxcy1vQcMrPhmQ")));
+    fTestNet = true;
+    BOOST_CHECK(CheckMicroPrime(string("muVEJW5YZpZc4QxUaDMJVxcy1vQcMrPhmQ")));
+    BOOST_CHECK(!CheckMicroPrime(string("P9Yo3PtaxuzeBZAimsGzz6mdTmdDtU6vhf")));
+    fTestNet = false;
+}
+
+BOOST_AUTO_TEST_CASE(primenode_registry)
+{
+    fTestNet = true;
+
+    unsigned int nTime = GetTime();
+    CScript scriptPubKeyTypeValid;
+    CScript scriptPubKeyTypeInvalid;
+
+    // Generic testnet private key, not a primenode key.
+    string strPrivKey = "308201130201010420de934fbd46ef6f57d68562a912829c0cd4d04378bd27d41be53da572aac44645a081a53081a2020101302c06072a8648ce3d0101022100fffffffffffffffffffffffffffffffffffffffffffffffffffffffefffffc2f300604010004010704410479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8022100fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364141020101a1440342000451d8cafe5ab366128835d1280d9f8b534d17320a22193179e0f99299c63a11796f24673e42752a71940355c8698b31cbc73b5bea025d6471996ed37da72961a9";
+    BOOST_CHECK(NewScriptPrimeID(scriptPubKeyTypeInvalid, ParseHex(strPrivKey), nTime));
+    // One of the 2 testnet primenode keys.
+    strPrivKey = "3082011302010104202ac1e3a01bd7daa92eb945e7b524a4e6729587c15b20a01e54e3893a3a6188b5a081a53081a2020101302c06072a8648ce3d0101022100fffffffffffffffffffffffffffffffffffffffffffffffffffffffefffffc2f300604010004010704410479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8022100fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364141020101a14403420004d445518d115243639d0dfd057a99da588e8334039ce674f177943d4c660957c810f924a5371a352b1e827121846500a588a4dc47dc6d5d9e5317dfa48c562aa7";
+    BOOST_CHECK(NewScriptPrimeID(scriptPubKeyTypeValid, ParseHex(strPrivKey), nTime));
+
+    if (!primeNodeDB)
+        primeNodeDB = new CPrimeNodeDB("cr");
+    BOOST_CHECK(InflatePrimeNodeDB(CPrimeNodeDB::primedb));
+    BOOST_CHECK_EQUAL(primeNodeRegistry.size(), 2U);
+
+    // The registry must agree with the database lookup.
+    CPrimeNodeDBEntry entryDB, entryRegistry;
+    BOOST_CHECK(primeNodeDB->IsPrimeNodeKey(scriptPubKeyTypeValid, nTime, entryDB));
+    BOOST_CHECK(primeNodeRegistry.IsPrimeNodeKey(scriptPubKeyTypeValid, nTime, entryRegistry));
+    BOOST_CHECK(entryDB.key == entryRegistry.key);
+    BOOST_CHECK_EQUAL(entryDB.valid_starting, entryRegistry.valid_starting);
+    BOOST_CHECK_EQUAL(entryDB.valid_until, entryRegistry.valid_until);
+    BOOST_CHECK(!primeNodeRegistry.IsPrimeNodeKey(scriptPubKeyTypeInvalid, nTime, entryRegistry));
+
+    // Keys outside of their valid range are still matched so IsPrimeStake can
+    // reject them with the proper reason.
+    CScript scriptPubKeyTypeEarly;
+    unsigned int nTimeEarly = END_PRIME_PHASE_ONE;
+    BOOST_CHECK(NewScriptPrimeID(scriptPubKeyTypeEarly, ParseHex(strPrivKey), nTimeEarly));
+    BOOST_CHECK(primeNodeRegistry.IsPrimeNodeKey(scriptPubKeyTypeEarly, nTimeEarly, entryRegistry));
+    BOOST_CHECK(nTimeEarly < entryRegistry.valid_starting);
+
+    fTestNet = false;
+}
+
+BOOST_AUTO_TEST_CASE(primenode_recovery)
+{
+    fTestNet = true;
+
+    if (!primeNodeDB)
+        primeNodeDB = new CPrimeNodeDB("cr");
+    BOOST_CHECK(InflatePrimeNodeDB(CPrimeNodeDB::primedb));
+
+    vector<vector<unsigned char> > vPrivKeys;
+    // Generic testnet private key, not a primenode key.
+    vPrivKeys.push_back(ParseHex("308201130201010420de934fbd46ef6f57d68562a912829c0cd4d04378bd27d41be53da572aac44645a081a53081a2020101302c06072a8648ce3d0101022100fffffffffffffffffffffffffffffffffffffffffffffffffffffffefffffc2f300604010004010704410479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8022100fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364141020101a1440342000451d8cafe5ab366128835d1280d9f8b534d17320a22193179e0f99299c63a11796f24673e42752a71940355c8698b31cbc73b5bea025d6471996ed37da72961a9"));
+    // One of the 2 testnet primenode keys.
+    vPrivKeys.push_back(ParseHex("3082011302010104202ac1e3a01bd7daa92eb945e7b524a4e6729587c15b20a01e54e3893a3a6188b5a081a53081a2020101302c06072a8648ce3d0101022100fffffffffffffffffffffffffffffffffffffffffffffffffffffffefffffc2f300604010004010704410479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8022100fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364141020101a14403420004d445518d115243639d0dfd057a99da588e8334039ce674f177943d4c660957c810f924a5371a352b1e827121846500a588a4dc47dc6d5d9e5317dfa48c562aa7"));
+    // Random keys, none of which are primenode keys.
+    for (int i = 0; i < 4; i++) {
+        CKey key;
+        key.MakeNewKey(false);
+        CPrivKey vchPrivKey = key.GetPrivKey();
+        vPrivKeys.push_back(vector<unsigned char>(vchPrivKey.begin(), vchPrivKey.end()));
+    }
+
+    unsigned int nTimeNow = GetTime();
+    unsigned int vTimes[] = { END_PRIME_PHASE_ONE, END_PRIME_PHASE_ONE + 1296000, nTimeNow };
+
+    int nAccepted = 0;
+    BOOST_FOREACH(const vector<unsigned char> &vchPrivKey, vPrivKeys) {
+        BOOST_FOREACH(unsigned int nTime, vTimes) {
+            // Several signatures per key and time so that all recovery ids show up.
+            for (int i = 0; i < 8; i++) {
+                CScript scriptPrimeID;
+                BOOST_CHECK(NewScriptPrimeID(scriptPrimeID, vchPrivKey, nTime));
+
+                CPrimeNodeDBEntry entryDB, entryFind, entryRecover;
+                bool fDB = primeNodeDB->IsPrimeNodeKey(scriptPrimeID, nTime, entryDB);
+                primeNodeRegistry.SetRecoverKeys(false);
+                bool fFind = primeNodeRegistry.IsPrimeNodeKey(scriptPrimeID, nTime, entryFind);
+                primeNodeRegistry.SetRecoverKeys(true);
+                bool fRecover = primeNodeRegistry.IsPrimeNodeKey(scriptPrimeID, nTime, entryRecover);
+
+                BOOST_CHECK_EQUAL(fDB, fFind);
+                BOOST_CHECK_EQUAL(fDB, fRecover);
+                if (fDB) {
+                    nAccepted++;
+                    BOOST_CHECK(entryDB.key == entryFind.key);
+                    BOOST_CHECK(entryDB.key == entryRecover.key);
+                    BOOST_CHECK_EQUAL(entryDB.valid_starting, entryRecover.valid_starting);
+                    BOOST_CHECK_EQUAL(entryDB.valid_until, entryRecover.valid_until);
+                }
+
+                // A signature for a different time never matches.
+                BOOST_CHECK(!primeNodeRegistry.IsPrimeNodeKey(scriptPrimeID, nTime + 1, entryRecover));
+            }
+        }
+    }
+    // Only the primenode key is accepted, at every time.
+    BOOST_CHECK_EQUAL(nAccepted, 8 * 3);
+
+    // Malformed scripts are rejected in both modes.
+    CScript scriptShort;
+    scriptShort << OP_PRIMENODEP2;
+    CScript scriptGarbage;
+    scriptGarbage << OP_PRIMENODEP2 << ParseHex("3006020101020101");
+    CPrimeNodeDBEntry entry;
+    primeNodeRegistry.SetRecoverKeys(false);
+    BOOST_CHECK(!primeNodeRegistry.IsPrimeNodeKey(scriptShort, nTimeNow, entry));
+    BOOST_CHECK(!primeNodeRegistry.IsPrimeNodeKey(scriptGarbage, nTimeNow, entry));
+    primeNodeRegistry.SetRecoverKeys(true);
+    BOOST_CHECK(!primeNodeRegistry.IsPrimeNodeKey(scriptShort, nTimeNow, entry));
+    BOOST_CHECK(!primeNodeRegistry.IsPrimeNodeKey(scriptGarbage, nTimeNow, entry));
+
+    fTestNet = false;
+}
+
+BOOST_AUTO_TEST_CASE(prime_stake_cache)
+{
+    fTestNet = true;
+
+    CScript scriptMicroPrimeOP;
+    scriptMicroPrimeOP << OP_MICROPRIME;
+    CScript scriptPubKeyAddress;
+    scriptPubKeyAddress.SetDestination(CBitcoinAddress("muVEJW5YZpZc4QxUaDMJVxcy1vQcMrPhmQ").Get());
+    unsigned int nTime = GetTime();
+
+    primeStakeCache.Clear();
+    uint64 nHits, nMisses, nHitsStart, nMissesStart;
+    unsigned int nSize, nMaxSize;
+    primeStakeCache.GetStats(nHitsStart, nMissesStart, nSize, nMaxSize);
+    BOOST_CHECK_EQUAL(nSize, 0U);
+
+    // First check is a miss, the second one is answered by the cache.
+    CTransaction tx;
+    BOOST_CHECK(tx.IsPrimeStake(scriptMicroPrimeOP, scriptPubKeyAddress, nTime, 5000 * COIN, 0, 0));
+    BOOST_CHECK(tx.IsPrimeStake(scriptMicroPrimeOP, scriptPubKeyAddress, nTime, 5000 * COIN, 0, 0));
+    primeStakeCache.GetStats(nHits, nMisses, nSize, nMaxSize);
+    BOOST_CHECK_EQUAL(nHits - nHitsStart, 1U);
+    BOOST_CHECK_EQUAL(nMisses - nMissesStart, 1U);
+    BOOST_CHECK_EQUAL(nSize, 1U);
+
+    // Any other input is a different decision and never a hit.
+    BOOST_CHECK(!tx.IsPrimeStake(scriptMicroPrimeOP, scriptPubKeyAddress, nTime, 5000 * COIN + 1, 0, 0));
+    BOOST_CHECK(!tx.IsPrimeStake(scriptMicroPrimeOP, scriptPubKeyAddress, nTime, 4000 * COIN, 6000 * COIN, 0));
+    primeStakeCache.GetStats(nHits, nMisses, nSize, nMaxSize);
+    BOOST_CHECK_EQUAL(nHits - nHitsStart, 1U);
+    BOOST_CHECK_EQUAL(nMisses - nMissesStart, 3U);
+    // Rejected stakes are not cached.
+    BOOST_CHECK_EQUAL(nSize, 1U);
+
+    // Reloading the primenode keys invalidates the cache.
+    if (!primeNodeDB)
+        primeNodeDB = new CPrimeNodeDB("cr");
+    BOOST_CHECK(InflatePrimeNodeDB(CPrimeNodeDB::primedb));
+    primeStakeCache.GetStats(nHits, nMisses, nSize, nMaxSize);
+    BOOST_CHECK_EQUAL(nSize, 0U);
+
+    fTestNet = false;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
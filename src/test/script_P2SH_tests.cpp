@@ -243,7 +243,7 @@ BOOST_AUTO_TEST_CASE(switchover)
 
 BOOST_AUTO_TEST_CASE(AreInputsStandard)
 {
-    std::map<uint256, std::pair<CTxIndex, CTransaction> > mapInputs;
+    MapPrevTx mapInputs;
     CBasicKeyStore keystore;
     CKey key[3];
     std::vector<CPubKey> keys;
@@ -280,7 +280,7 @@ BOOST_AUTO_TEST_CASE(AreInputsStandard)
     oneOfEleven << OP_11 << OP_CHECKMULTISIG;
     txFrom.vout[5].scriptPubKey.SetDestination(oneOfEleven.GetID());
 
-    mapInputs[txFrom.GetHash()] = make_pair(CTxIndex(), txFrom);
+    mapInputs[txFrom.GetHash()] = CCoins(txFrom, 0);
 
     CTransaction txTo;
     txTo.vout.resize(1);
@@ -48,14 +48,14 @@ SetupDummyInputs(CBasicKeyStore& keystoreRet, MapPrevTx& inputsRet)
     dummyTransactions[0].vout[0].scriptPubKey << key[0].GetPubKey() << OP_CHECKSIG;
     dummyTransactions[0].vout[1].nValue = 50*CENT;
     dummyTransactions[0].vout[1].scriptPubKey << key[1].GetPubKey() << OP_CHECKSIG;
-    inputsRet[dummyTransactions[0].GetHash()] = make_pair(CTxIndex(), dummyTransactions[0]);
+    inputsRet[dummyTransactions[0].GetHash()] = CCoins(dummyTransactions[0], 0);
 
     dummyTransactions[1].vout.resize(2);
     dummyTransactions[1].vout[0].nValue = 21*CENT;
     dummyTransactions[1].vout[0].scriptPubKey.SetDestination(key[2].GetPubKey().GetID());
     dummyTransactions[1].vout[1].nValue = 22*CENT;
     dummyTransactions[1].vout[1].scriptPubKey.SetDestination(key[3].GetPubKey().GetID());
-    inputsRet[dummyTransactions[1].GetHash()] = make_pair(CTxIndex(), dummyTransactions[1]);
+    inputsRet[dummyTransactions[1].GetHash()] = CCoins(dummyTransactions[1], 0);
 
     return dummyTransactions;
 }
@@ -117,4 +117,48 @@ BOOST_AUTO_TEST_CASE(test_GetThrow)
     BOOST_CHECK_THROW(t1.GetValueIn(missingInputs), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(test_CCoins)
+{
+    CBasicKeyStore keystore;
+    MapPrevTx dummyInputs;
+    std::vector<CTransaction> dummyTransactions = SetupDummyInputs(keystore, dummyInputs);
+
+    CCoins coins(dummyTransactions[0], 100);
+    BOOST_CHECK(coins.IsAvailable(0) && coins.IsAvailable(1) && !coins.IsAvailable(2));
+    BOOST_CHECK(!coins.IsPruned());
+
+    // Spent outputs survive a round trip through the database format
+    coins.Spend(0);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << coins;
+    CCoins coins2;
+    ss >> coins2;
+    BOOST_CHECK_EQUAL(coins2.nHeight, 100);
+    BOOST_CHECK_EQUAL(coins2.nTime, dummyTransactions[0].nTime);
+    BOOST_CHECK(!coins2.IsAvailable(0) && coins2.IsAvailable(1));
+    BOOST_CHECK(coins2.vout[1] == dummyTransactions[0].vout[1]);
+
+    coins2.Spend(1);
+    BOOST_CHECK(coins2.IsPruned());
+
+    // The empty first output of a coinstake stays available, it can be spent
+    // like any other output
+    CTransaction txStake;
+    txStake.vin.resize(1);
+    txStake.vin[0].prevout.hash = dummyTransactions[0].GetHash();
+    txStake.vin[0].prevout.n = 1;
+    txStake.vout.resize(2);
+    txStake.vout[0].SetEmpty();
+    txStake.vout[1].nValue = 60*CENT;
+    txStake.vout[1].scriptPubKey << OP_1;
+    BOOST_CHECK(txStake.IsCoinStake());
+    CCoins coinsStake(txStake, 101);
+    BOOST_CHECK(coinsStake.fCoinStake && coinsStake.IsAvailable(0) && coinsStake.IsAvailable(1));
+    BOOST_CHECK(coinsStake.vout[0].IsEmpty());
+    coinsStake.Spend(1);
+    BOOST_CHECK(!coinsStake.IsPruned());
+    coinsStake.Spend(0);
+    BOOST_CHECK(coinsStake.IsPruned());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,86 @@
+#include <boost/test/unit_test.hpp>
+
+#include "db.h"
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+static uint256 TestHash(const string& str)
+{
+    return Hash(str.begin(), str.end());
+}
+
+BOOST_AUTO_TEST_CASE(txdb_writeback)
+{
+    CTxDB txdb("r+");
+    BOOST_CHECK(txdb.Flush());
+    uint256 hashBestChainOld;
+    BOOST_REQUIRE(txdb.ReadHashBestChain(hashBestChainOld));
+
+    // Two committed transactions and an aborted one
+    uint256 hashTx1 = TestHash("txdb tx 1");
+    uint256 hashTx2 = TestHash("txdb tx 2");
+    uint256 hashTxAborted = TestHash("txdb tx aborted");
+    uint256 hashBest = TestHash("txdb best");
+    CTransaction tx;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 1;
+    tx.vout[1].nValue = 2;
+
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(!txdb.TxnBegin());
+    BOOST_CHECK(txdb.UpdateTxIndex(hashTx1, CTxIndex(CDiskTxPos(1, 100, 110), 2)));
+    BOOST_CHECK(txdb.WriteCoins(hashTx1, CCoins(tx, 5)));
+    BOOST_CHECK(txdb.WriteHashBestChain(hashBest));
+    BOOST_CHECK(txdb.TxnCommit());
+
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.UpdateTxIndex(hashTx2, CTxIndex(CDiskTxPos(1, 200, 210), 1)));
+    BOOST_CHECK(txdb.TxnCommit());
+
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.UpdateTxIndex(hashTxAborted, CTxIndex(CDiskTxPos(1, 300, 310), 1)));
+    BOOST_CHECK(txdb.WriteHashBestChain(TestHash("txdb aborted best")));
+    BOOST_CHECK(txdb.TxnAbort());
+
+    // Another CTxDB reads the committed state from the cache, while the
+    // store still holds the state of the last write-back
+    uint256 hashBestCoins;
+    {
+        CTxDB txdbRead("r");
+        CTxIndex txindex;
+        BOOST_CHECK(txdbRead.ReadTxIndex(hashTx1, txindex) && txindex.pos.nTxPos == 110 && txindex.vSpent.size() == 2);
+        BOOST_CHECK(txdbRead.ReadTxIndex(hashTx2, txindex) && txindex.pos.nTxPos == 210);
+        BOOST_CHECK(!txdbRead.ReadTxIndex(hashTxAborted, txindex));
+        CCoins coins;
+        BOOST_CHECK(txdbRead.ReadCoins(hashTx1, coins) && coins.nHeight == 5 && coins.IsAvailable(1));
+        uint256 hash;
+        BOOST_CHECK(txdbRead.ReadHashBestChain(hash) && hash == hashBest);
+        BOOST_CHECK(!txdbRead.ReadHashBestCoins(hashBestCoins) || hashBestCoins != hashBest);
+    }
+
+    // The write-back stores the committed transactions and their best block
+    BOOST_CHECK(txdb.Flush());
+    {
+        CTxDB txdbRead("r");
+        CTxIndex txindex;
+        BOOST_CHECK(txdbRead.ReadTxIndex(hashTx1, txindex) && txindex.pos.nTxPos == 110);
+        BOOST_CHECK(txdbRead.ReadTxIndex(hashTx2, txindex) && txindex.pos.nTxPos == 210);
+        BOOST_CHECK(!txdbRead.ReadTxIndex(hashTxAborted, txindex));
+        CCoins coins;
+        BOOST_CHECK(txdbRead.ReadCoins(hashTx1, coins) && coins.nHeight == 5);
+        uint256 hash;
+        BOOST_CHECK(txdbRead.ReadHashBestChain(hash) && hash == hashBest);
+        BOOST_CHECK(txdbRead.ReadHashBestCoins(hashBestCoins) && hashBestCoins == hashBest);
+    }
+
+    // Leave the chain as the other tests expect it
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.WriteHashBestChain(hashBestChainOld));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(txdb.Flush());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
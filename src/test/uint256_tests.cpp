@@ -1,6 +1,11 @@
 #include <boost/test/unit_test.hpp>
 
 #include "uint256.h"
+#include "bignum.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
 
 BOOST_AUTO_TEST_SUITE(uint256_tests)
 
@@ -15,4 +20,55 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(uint256_division)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        uint256 num = GetRandHash() >> GetRandInt(256);
+        uint256 div = GetRandHash() >> GetRandInt(256);
+        if (div == 0)
+            continue;
+        uint256 quotient = num;
+        quotient /= div;
+        CBigNum bnQuotient = CBigNum(num) / CBigNum(div);
+        BOOST_CHECK(quotient == bnQuotient.getuint256());
+    }
+    uint256 num = 12345;
+    num /= uint256(0);
+    BOOST_CHECK(num == 0);
+    BOOST_CHECK(uint256(0).bits() == 0);
+    BOOST_CHECK(uint256(1).bits() == 1);
+    BOOST_CHECK((~uint256(0)).bits() == 256);
+}
+
+BOOST_AUTO_TEST_CASE(block_trust)
+{
+    // The same trust as computed with bignums
+    vector<unsigned int> vBits;
+    vBits.push_back(0);
+    vBits.push_back(0x01003456);
+    vBits.push_back(0x02008000);
+    vBits.push_back(0x04923456);
+    vBits.push_back(0x1d00ffff);
+    vBits.push_back(0x1e0fffff);
+    vBits.push_back(0x20ffffff);
+    vBits.push_back(0x217fffff);
+    vBits.push_back(0x22000001);
+    vBits.push_back(0xff123456);
+    for (int i = 0; i < 1000; i++)
+        vBits.push_back(CBigNum(GetRandHash() >> GetRandInt(256)).GetCompact());
+
+    BOOST_FOREACH(unsigned int nBits, vBits)
+    {
+        CBigNum bnTarget;
+        bnTarget.SetCompact(nBits);
+        CBlockIndex index;
+        index.nBits = nBits;
+        BOOST_CHECK(index.GetBlockTrust() == (bnTarget <= 0 ? 0 : 1));
+        index.SetProofOfStake();
+        CBigNum bnTrust = (bnTarget <= 0 ? 0 : (CBigNum(1)<<256) / (bnTarget+1));
+        BOOST_CHECK_MESSAGE(index.GetBlockTrust() == bnTrust.getuint256(), strprintf("nBits=%08x", nBits));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
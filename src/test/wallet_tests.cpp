@@ -0,0 +1,627 @@
+#include <boost/test/unit_test.hpp>
+
+#include "init.h"
+#include "main.h"
+#include "wallet.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(wallet_tests)
+
+class CTestStakeCoin
+{
+public:
+    COutPoint prevout;
+    int64 nValue;
+    int64 nTime;
+    int nHeightMature;
+};
+
+// Weight as GetStakeWeight summed it per output
+static void GetStakeWeightSerial(const vector<CTestStakeCoin>& vCoins, int64 nTime, int nHeight, uint64& nMinWeight, uint64& nMaxWeight, uint64& nWeight, unsigned int& nGrowing)
+{
+    nMinWeight = nMaxWeight = nWeight = 0;
+    nGrowing = 0;
+    BOOST_FOREACH(const CTestStakeCoin& coin, vCoins)
+    {
+        if (nHeight < coin.nHeightMature)
+            continue;
+        int64 nTimeWeight = min(nTime - coin.nTime - STAKE_MIN_AGE, (int64)STAKE_MAX_AGE);
+        CBigNum bnCoinDayWeight = CBigNum(coin.nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+        if (nTimeWeight > 0)
+            nWeight += bnCoinDayWeight.getuint64();
+        if (nTimeWeight > 0 && nTimeWeight < STAKE_MAX_AGE)
+        {
+            nMinWeight += bnCoinDayWeight.getuint64();
+            nGrowing++;
+        }
+        if (nTimeWeight == STAKE_MAX_AGE)
+            nMaxWeight += bnCoinDayWeight.getuint64();
+    }
+}
+
+static void CheckStakeWeight(const CStakeWeight& stakeWeight, const vector<CTestStakeCoin>& vCoins, int64 nTime, int nHeight)
+{
+    uint64 nMinWeight, nMaxWeight, nWeight;
+    uint64 nMinWeightSerial, nMaxWeightSerial, nWeightSerial;
+    unsigned int nGrowing;
+    stakeWeight.GetWeight(nMinWeight, nMaxWeight, nWeight);
+    GetStakeWeightSerial(vCoins, nTime, nHeight, nMinWeightSerial, nMaxWeightSerial, nWeightSerial, nGrowing);
+
+    // Growing outputs are rounded down once for the whole bucket
+    BOOST_CHECK_EQUAL(nMaxWeight, nMaxWeightSerial);
+    BOOST_CHECK(nMinWeight >= nMinWeightSerial && nMinWeight <= nMinWeightSerial + nGrowing);
+    BOOST_CHECK_EQUAL(nWeight, nMinWeight + nMaxWeight);
+}
+
+BOOST_AUTO_TEST_CASE(stake_weight_buckets)
+{
+    int64 nTimeStart = GetTime();
+    int nHeightStart = 1000;
+    vector<CTestStakeCoin> vCoins;
+    CStakeWeight stakeWeight;
+    stakeWeight.SetTime(nTimeStart, nHeightStart);
+    for (int i = 0; i < 2000; i++)
+    {
+        CTestStakeCoin coin;
+        coin.prevout = COutPoint(GetRandHash(), GetRandInt(4));
+        coin.nValue = (1 + GetRandInt(100000)) * CENT;
+        coin.nTime = nTimeStart - GetRandInt(2 * STAKE_MAX_AGE);
+        coin.nHeightMature = nHeightStart - 100 + GetRandInt(200);
+        vCoins.push_back(coin);
+        stakeWeight.AddCoin(coin.prevout, coin.nValue, coin.nTime, coin.nHeightMature);
+    }
+    BOOST_CHECK_EQUAL(stakeWeight.size(), vCoins.size());
+    CheckStakeWeight(stakeWeight, vCoins, nTimeStart, nHeightStart);
+
+    // Outputs move between buckets as time and height go forward
+    int64 nTime = nTimeStart;
+    int nHeight = nHeightStart;
+    for (int i = 0; i < 50; i++)
+    {
+        nTime += GetRandInt(STAKE_MAX_AGE / 10);
+        nHeight += GetRandInt(10);
+        stakeWeight.SetTime(nTime, nHeight);
+        CheckStakeWeight(stakeWeight, vCoins, nTime, nHeight);
+    }
+
+    // Spent outputs leave their bucket
+    for (int i = 0; i < 500; i++)
+    {
+        stakeWeight.EraseCoins(vCoins.back().prevout.hash);
+        vCoins.pop_back();
+    }
+    BOOST_CHECK_EQUAL(stakeWeight.size(), vCoins.size());
+    CheckStakeWeight(stakeWeight, vCoins, nTime, nHeight);
+
+    // A reorganize or a clock going back puts outputs into younger buckets
+    nTime = nTimeStart;
+    nHeight = nHeightStart - 10;
+    stakeWeight.SetTime(nTime, nHeight);
+    CheckStakeWeight(stakeWeight, vCoins, nTime, nHeight);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_ledger)
+{
+    CWalletLedger ledger;
+    CKeyID keyA(uint160(1)), keyB(uint160(2));
+    vector<uint256> vHash;
+    for (int i = 0; i < 4; i++)
+        vHash.push_back(GetRandHash());
+
+    CWalletLedger::CEntry entry;
+    entry.nBalance = 10 * COIN;
+    entry.vAddressBalances.push_back(make_pair(CTxDestination(keyA), 10 * COIN));
+    ledger.Set(vHash[0], entry);
+
+    entry = CWalletLedger::CEntry();
+    entry.nUnconfirmed = 3 * COIN;
+    entry.fVolatile = true;
+    ledger.Set(vHash[1], entry);
+
+    entry = CWalletLedger::CEntry();
+    entry.nStake = 5 * COIN;
+    entry.nHeightMature = 120;
+    entry.vAddressBalances.push_back(make_pair(CTxDestination(keyA), 5 * COIN));
+    entry.vAddressBalances.push_back(make_pair(CTxDestination(keyB), 0));
+    ledger.Set(vHash[2], entry);
+
+    BOOST_CHECK_EQUAL(ledger.nBalance, 10 * COIN);
+    BOOST_CHECK_EQUAL(ledger.nUnconfirmed, 3 * COIN);
+    BOOST_CHECK_EQUAL(ledger.nStake, 5 * COIN);
+    BOOST_CHECK_EQUAL(ledger.mapAddressBalances[keyA].first, 15 * COIN);
+    BOOST_CHECK_EQUAL(ledger.mapAddressBalances[keyB].first, 0);
+    BOOST_CHECK_EQUAL(ledger.setVolatile.size(), 1U);
+
+    // Maturity changes in both directions
+    set<uint256> setChanged;
+    ledger.nHeight = 100;
+    ledger.GetMaturityChanges(119, setChanged);
+    BOOST_CHECK(setChanged.empty());
+    ledger.GetMaturityChanges(120, setChanged);
+    BOOST_CHECK(setChanged.size() == 1 && setChanged.count(vHash[2]));
+    setChanged.clear();
+    ledger.nHeight = 130;
+    ledger.GetMaturityChanges(110, setChanged);
+    BOOST_CHECK(setChanged.size() == 1 && setChanged.count(vHash[2]));
+
+    // Setting a transaction again replaces its share, erasing removes it
+    entry = CWalletLedger::CEntry();
+    entry.nBalance = 5 * COIN;
+    entry.vAddressBalances.push_back(make_pair(CTxDestination(keyA), 5 * COIN));
+    ledger.Set(vHash[2], entry);
+    BOOST_CHECK_EQUAL(ledger.nBalance, 15 * COIN);
+    BOOST_CHECK_EQUAL(ledger.nStake, 0);
+    BOOST_CHECK(ledger.setMaturity.empty());
+    BOOST_CHECK(!ledger.mapAddressBalances.count(keyB));
+
+    ledger.Erase(vHash[1]);
+    ledger.Erase(vHash[3]);
+    BOOST_CHECK_EQUAL(ledger.nUnconfirmed, 0);
+    BOOST_CHECK(ledger.setVolatile.empty());
+    ledger.Erase(vHash[0]);
+    ledger.Erase(vHash[2]);
+    BOOST_CHECK_EQUAL(ledger.nBalance, 0);
+    BOOST_CHECK(ledger.mapAddressBalances.empty());
+    BOOST_CHECK(ledger.mapEntries.empty());
+}
+
+// Smallest sum of a subset of vValue that reaches nTargetValue, tried with
+// every subset
+static int64 SelectCoinsExhaustive(const vector<int64>& vValue, int64 nTargetValue)
+{
+    int64 nBest = std::numeric_limits<int64>::max();
+    for (unsigned int nMask = 1; nMask < (1U << vValue.size()); nMask++)
+    {
+        int64 nTotal = 0;
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (nMask & (1U << i))
+                nTotal += vValue[i];
+        if (nTotal >= nTargetValue && nTotal < nBest)
+            nBest = nTotal;
+    }
+    return nBest;
+}
+
+BOOST_AUTO_TEST_CASE(select_coins_branch_and_bound)
+{
+    for (int nTest = 0; nTest < 1000; nTest++)
+    {
+        vector<int64> vValue;
+        int64 nSum = 0;
+        unsigned int nCoins = 1 + GetRandInt(12);
+        for (unsigned int i = 0; i < nCoins; i++)
+        {
+            // Few distinct values in half of the tests
+            vValue.push_back((1 + GetRandInt(nTest % 2 ? 20 : 1000)) * CENT);
+            nSum += vValue.back();
+        }
+        sort(vValue.rbegin(), vValue.rend());
+        int64 nTargetValue = 1 + GetRand(nSum);
+
+        vector<char> vfBest;
+        int64 nBest;
+        BOOST_CHECK(SelectCoinsBranchAndBound(vValue, nTargetValue, vfBest, nBest));
+        BOOST_CHECK_EQUAL(nBest, SelectCoinsExhaustive(vValue, nTargetValue));
+
+        int64 nTotal = 0;
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+                nTotal += vValue[i];
+        BOOST_CHECK_EQUAL(nTotal, nBest);
+
+        BOOST_CHECK(!SelectCoinsBranchAndBound(vValue, nSum + 1, vfBest, nBest));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(wallet_filter)
+{
+    CBasicKeyStore keystore;
+    CWalletFilter filter;
+    filter.Reset(100);
+    vector<CKey> vKeys;
+    for (int i = 0; i < 20; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        vKeys.push_back(key);
+        if (i < 10)
+        {
+            keystore.AddKey(key);
+            filter.insert(key.GetPubKey().GetID());
+        }
+    }
+    CScript scriptMultisig;
+    vector<CPubKey> vPubKeys;
+    vPubKeys.push_back(vKeys[0].GetPubKey());
+    vPubKeys.push_back(vKeys[1].GetPubKey());
+    scriptMultisig.SetMultisig(1, vPubKeys);
+    keystore.AddCScript(scriptMultisig);
+    filter.insert(scriptMultisig.GetID());
+
+    // Whatever IsMine accepts gets through the filter
+    vector<CScript> vScripts;
+    for (int i = 0; i < 20; i++)
+    {
+        CScript script;
+        script.SetDestination(vKeys[i].GetPubKey().GetID());
+        vScripts.push_back(script);
+        script.clear();
+        script << vKeys[i].GetPubKey() << OP_CHECKSIG;
+        vScripts.push_back(script);
+    }
+    CScript scriptHash;
+    scriptHash.SetDestination(scriptMultisig.GetID());
+    vScripts.push_back(scriptHash);
+    vScripts.push_back(scriptMultisig);
+    int nMine = 0;
+    BOOST_FOREACH(const CScript& script, vScripts)
+    {
+        if (IsMine(keystore, script))
+        {
+            nMine++;
+            BOOST_CHECK(filter.MayBeMine(script));
+        }
+    }
+    BOOST_CHECK_EQUAL(nMine, 22);
+
+    // Few other scripts get through
+    int nFalsePositives = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+        CScript script;
+        uint256 hashRand = GetRandHash();
+        script.SetDestination(CKeyID(Hash160(vector<unsigned char>(hashRand.begin(), hashRand.end()))));
+        if (filter.MayBeMine(script))
+            nFalsePositives++;
+    }
+    BOOST_CHECK(nFalsePositives < 100);
+
+    // A filter that hasn't been built rejects nothing
+    CWalletFilter filterNull;
+    BOOST_CHECK(filterNull.MayBeMine(vScripts[0]));
+    BOOST_CHECK(filterNull.contains(GetRandHash()));
+}
+
+BOOST_AUTO_TEST_CASE(keypool_top_up)
+{
+    // Enough keys for several generating threads and two database batches
+    string strKeyPool = mapArgs["-keypool"];
+    mapArgs["-keypool"] = "1500";
+    BOOST_CHECK(pwalletMain->TopUpKeyPool());
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), 1501);
+
+    set<CKeyID> setAddress;
+    pwalletMain->GetAllReserveKeys(setAddress);
+    BOOST_CHECK_EQUAL(setAddress.size(), 1501U);
+    BOOST_FOREACH(const CKeyID& keyID, setAddress)
+    {
+        CKey key;
+        BOOST_CHECK(pwalletMain->GetKey(keyID, key));
+        BOOST_CHECK(key.GetPubKey().GetID() == keyID);
+    }
+    mapArgs["-keypool"] = strKeyPool;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_tx_deferred_prev)
+{
+    CWalletTx wtx;
+    wtx.vin.resize(1);
+    wtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    wtx.vout.resize(1);
+    wtx.vout[0].nValue = COIN;
+    wtx.mapValue["comment"] = "deferred";
+    wtx.nTimeReceived = 1400000000;
+    for (int i = 0; i < 3; i++)
+    {
+        CMerkleTx tx;
+        tx.vin.resize(i + 1);
+        for (int j = 0; j <= i; j++)
+        {
+            tx.vin[j].prevout = COutPoint(GetRandHash(), j);
+            tx.vin[j].scriptSig << vector<unsigned char>(72, j) << vector<unsigned char>(33, j);
+        }
+        tx.vout.resize(2);
+        tx.vout[0].nValue = i * COIN;
+        tx.vout[0].scriptPubKey << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[1].nValue = 0;
+        tx.hashBlock = GetRandHash();
+        tx.vMerkleBranch.resize(i, GetRandHash());
+        tx.nIndex = i;
+        wtx.vtxPrev.push_back(tx);
+    }
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << wtx;
+
+    // Read with the supporting transactions deferred
+    CDataStream ssDeferred(ss.begin(), ss.end(), SER_DISK | SER_DEFERPREV, CLIENT_VERSION);
+    CWalletTx wtxDeferred;
+    ssDeferred >> wtxDeferred;
+    BOOST_CHECK(ssDeferred.empty());
+    BOOST_CHECK(wtxDeferred.vtxPrev.empty());
+    BOOST_CHECK(!wtxDeferred.vchPrevDeferred.empty());
+    BOOST_CHECK(wtxDeferred.GetHash() == wtx.GetHash());
+    BOOST_CHECK(wtxDeferred.mapValue["comment"] == "deferred");
+    BOOST_CHECK_EQUAL(wtxDeferred.nTimeReceived, wtx.nTimeReceived);
+
+    // Written back unchanged while deferred
+    CDataStream ssWritten(SER_DISK, CLIENT_VERSION);
+    ssWritten << wtxDeferred;
+    BOOST_CHECK(ssWritten.str() == ss.str());
+    BOOST_CHECK_EQUAL(wtxDeferred.GetSerializeSize(SER_DISK, CLIENT_VERSION), ss.size());
+
+    wtxDeferred.ReadSupportingTransactions();
+    BOOST_CHECK(wtxDeferred.vchPrevDeferred.empty());
+    BOOST_CHECK_EQUAL(wtxDeferred.vtxPrev.size(), wtx.vtxPrev.size());
+    for (unsigned int i = 0; i < wtx.vtxPrev.size(); i++)
+    {
+        BOOST_CHECK(wtxDeferred.vtxPrev[i].GetHash() == wtx.vtxPrev[i].GetHash());
+        BOOST_CHECK(wtxDeferred.vtxPrev[i].hashBlock == wtx.vtxPrev[i].hashBlock);
+        BOOST_CHECK(wtxDeferred.vtxPrev[i].vMerkleBranch == wtx.vtxPrev[i].vMerkleBranch);
+        BOOST_CHECK_EQUAL(wtxDeferred.vtxPrev[i].nIndex, wtx.vtxPrev[i].nIndex);
+    }
+    ssWritten.clear();
+    ssWritten << wtxDeferred;
+    BOOST_CHECK(ssWritten.str() == ss.str());
+
+    // A truncated record is rejected
+    CDataStream ssTruncated(ss.begin(), ss.begin() + 200, SER_DISK | SER_DEFERPREV, CLIENT_VERSION);
+    CWalletTx wtxTruncated;
+    BOOST_CHECK_THROW(ssTruncated >> wtxTruncated, std::ios_base::failure);
+}
+
+// Blocks written to the block file and linked through an index of their
+// own, apart from the main chain
+class CTestChain
+{
+public:
+    vector<CBlockIndex*> vpindex;
+    list<uint256> listHash;
+
+    ~CTestChain()
+    {
+        BOOST_FOREACH(CBlockIndex* pindex, vpindex)
+            delete pindex;
+    }
+
+    void AddBlock(const vector<CTransaction>& vtx)
+    {
+        CBlock block;
+        block.hashPrevBlock = vpindex.empty() ? 0 : vpindex.back()->GetBlockHash();
+        block.nTime = 1400000000 + vpindex.size() * 60;
+
+        // Proof-of-stake, so that the header isn't checked against nBits
+        CTransaction txCoinBase;
+        txCoinBase.vin.resize(1);
+        txCoinBase.vin[0].prevout.SetNull();
+        txCoinBase.vin[0].scriptSig << (int)vpindex.size() << OP_0;
+        txCoinBase.vout.resize(1);
+        txCoinBase.vout[0].SetEmpty();
+        block.vtx.push_back(txCoinBase);
+        CTransaction txCoinStake;
+        txCoinStake.vin.resize(1);
+        txCoinStake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        txCoinStake.vout.resize(2);
+        txCoinStake.vout[0].SetEmpty();
+        txCoinStake.vout[1].nValue = COIN;
+        block.vtx.push_back(txCoinStake);
+        block.vtx.insert(block.vtx.end(), vtx.begin(), vtx.end());
+        block.hashMerkleRoot = block.BuildMerkleTree();
+
+        unsigned int nFile, nBlockPos;
+        BOOST_REQUIRE(block.WriteToDisk(nFile, nBlockPos));
+        CBlockIndex* pindex = new CBlockIndex(nFile, nBlockPos, block);
+        listHash.push_back(block.GetHash());
+        pindex->phashBlock = &listHash.back();
+        if (!vpindex.empty())
+        {
+            pindex->pprev = vpindex.back();
+            pindex->nHeight = vpindex.back()->nHeight + 1;
+            vpindex.back()->pnext = pindex;
+        }
+        vpindex.push_back(pindex);
+    }
+};
+
+static CTransaction CreateTestTx(const COutPoint& prevout, const CKey& key, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(prevout));
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(rescan_threads)
+{
+    vector<CKey> vKeys;
+    for (int i = 0; i < 8; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        vKeys.push_back(key);
+    }
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+
+    // Payments to the wallet, spends of them that pay elsewhere and
+    // transactions that don't involve the wallet, including spends of
+    // transactions found in the same block
+    CTestChain chain;
+    set<uint256> setExpected;
+    vector<CTransaction> vtxMine;
+    for (int i = 0; i < 40; i++)
+    {
+        vector<CTransaction> vtx;
+        CTransaction tx = CreateTestTx(COutPoint(GetRandHash(), 0), vKeys[i % vKeys.size()], (i + 1) * COIN);
+        vtx.push_back(tx);
+        setExpected.insert(tx.GetHash());
+        vtxMine.push_back(tx);
+        if (i % 3 == 2)
+        {
+            tx = CreateTestTx(COutPoint(vtxMine[i - 2].GetHash(), 0), keyOther, COIN);
+            vtx.push_back(tx);
+            setExpected.insert(tx.GetHash());
+        }
+        if (i % 5 == 4)
+        {
+            tx = CreateTestTx(COutPoint(vtxMine[i].GetHash(), 0), keyOther, COIN);
+            vtx.push_back(tx);
+            setExpected.insert(tx.GetHash());
+        }
+        vtx.push_back(CreateTestTx(COutPoint(GetRandHash(), 0), keyOther, COIN));
+        chain.AddBlock(vtx);
+    }
+
+    bool fArg = mapArgs.count("-rescanthreads");
+    string strArg = mapArgs["-rescanthreads"];
+    const char* pszThreads[] = { "1", "4" };
+    map<uint256, CWalletTx> mapWalletFound[2];
+    for (int i = 0; i < 2; i++)
+    {
+        mapArgs["-rescanthreads"] = pszThreads[i];
+        CWallet wallet(strprintf("wallet_rescan%d.dat", i));
+        BOOST_FOREACH(const CKey& key, vKeys)
+            BOOST_CHECK(wallet.AddKey(key));
+        BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chain.vpindex[0], true), (int)setExpected.size());
+        mapWalletFound[i] = wallet.mapWallet;
+    }
+    if (fArg)
+        mapArgs["-rescanthreads"] = strArg;
+    else
+        mapArgs.erase("-rescanthreads");
+
+    // Both rescans find the same transactions in the same blocks, with the
+    // same outputs spent
+    set<uint256> setFound;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWalletFound[0])
+        setFound.insert(item.first);
+    BOOST_CHECK(setFound == setExpected);
+    BOOST_CHECK_EQUAL(mapWalletFound[1].size(), mapWalletFound[0].size());
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWalletFound[0])
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWalletFound[1].find(item.first);
+        BOOST_REQUIRE(mi != mapWalletFound[1].end());
+        BOOST_CHECK(mi->second.hashBlock == item.second.hashBlock);
+        BOOST_CHECK_EQUAL(mi->second.nIndex, item.second.nIndex);
+        BOOST_CHECK(mi->second.vfSpent == item.second.vfSpent);
+    }
+    BOOST_CHECK(mapWalletFound[0][vtxMine[0].GetHash()].IsSpent(0));
+    BOOST_CHECK(!mapWalletFound[0][vtxMine[1].GetHash()].IsSpent(0));
+}
+
+// Groupings of the addresses of vKeys, given as the indices of each group
+// separated by spaces
+static set< set<CTxDestination> > TestGroupings(const vector<CKey>& vKeys, const string& strGroups)
+{
+    set< set<CTxDestination> > setRet;
+    set<CTxDestination> setGroup;
+    BOOST_FOREACH(char c, strGroups + " ")
+    {
+        if (c != ' ')
+            setGroup.insert(vKeys[c - '0'].GetPubKey().GetID());
+        else
+        {
+            setRet.insert(setGroup);
+            setGroup.clear();
+        }
+    }
+    return setRet;
+}
+
+BOOST_AUTO_TEST_CASE(address_groupings)
+{
+    CWallet wallet("wallet_groupings.dat");
+    vector<CKey> vKeys;
+    for (int i = 0; i < 3; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        BOOST_CHECK(wallet.AddKey(key));
+        vKeys.push_back(key);
+    }
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+
+    // Payments to addresses 0 and 1 stay apart
+    CWalletTx wtx0(&wallet, CreateTestTx(COutPoint(GetRandHash(), 0), vKeys[0], 10 * COIN));
+    CWalletTx wtx1(&wallet, CreateTestTx(COutPoint(GetRandHash(), 0), vKeys[1], 10 * COIN));
+    BOOST_CHECK(wallet.AddToWallet(wtx0));
+    BOOST_CHECK(wallet.AddToWallet(wtx1));
+    BOOST_CHECK(wallet.GetAddressGroupings() == TestGroupings(vKeys, "0 1"));
+
+    // Spending from address 0 with change to address 2 joins them
+    CWalletTx wtxSpend0(&wallet, CreateTestTx(COutPoint(wtx0.GetHash(), 0), keyOther, 4 * COIN));
+    wtxSpend0.vout.push_back(CTxOut(6 * COIN, CScript()));
+    wtxSpend0.vout[1].scriptPubKey.SetDestination(vKeys[2].GetPubKey().GetID());
+    BOOST_CHECK(wallet.AddToWallet(wtxSpend0));
+    BOOST_CHECK(wallet.GetAddressGroupings() == TestGroupings(vKeys, "02 1"));
+
+    // Spending from address 1 with change to the same address merges the
+    // two groups
+    CWalletTx wtxSpend1(&wallet, CreateTestTx(COutPoint(wtx1.GetHash(), 0), keyOther, 4 * COIN));
+    wtxSpend1.vout.push_back(CTxOut(6 * COIN, CScript()));
+    wtxSpend1.vout[1].scriptPubKey.SetDestination(vKeys[2].GetPubKey().GetID());
+    BOOST_CHECK(wallet.AddToWallet(wtxSpend1));
+    BOOST_CHECK(wallet.GetAddressGroupings() == TestGroupings(vKeys, "012"));
+    BOOST_CHECK(wallet.GetAddressGroupings() == TestGroupings(vKeys, "012"));
+
+    // An address in the address book is no change
+    wallet.SetAddressBookName(vKeys[2].GetPubKey().GetID(), "named");
+    BOOST_CHECK(wallet.GetAddressGroupings() == TestGroupings(vKeys, "0 1 2"));
+    wallet.DelAddressBookName(vKeys[2].GetPubKey().GetID());
+    BOOST_CHECK(wallet.GetAddressGroupings() == TestGroupings(vKeys, "012"));
+
+    // Erasing a spend splits the groups again
+    BOOST_CHECK(wallet.EraseFromWallet(wtxSpend1.GetHash()));
+    BOOST_CHECK(wallet.GetAddressGroupings() == TestGroupings(vKeys, "02 1"));
+}
+
+static void CheckWalletByTime(const CWallet& wallet)
+{
+    vector<pair<int64, uint256> > vSorted;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, wallet.mapWallet)
+        vSorted.push_back(make_pair(item.second.GetTxTime(), item.first));
+    sort(vSorted.begin(), vSorted.end());
+    vector<pair<int64, uint256> > vByTime(wallet.setWalletByTime.begin(), wallet.setWalletByTime.end());
+    BOOST_CHECK(vByTime == vSorted);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_by_time)
+{
+    CWallet wallet("wallet_bytime.dat");
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(wallet.AddKey(key));
+
+    // Received out of order, some at the same time
+    vector<uint256> vHash;
+    for (int i = 0; i < 20; i++)
+    {
+        SetMockTime(1400000000 + (i * 7) % 11);
+        CWalletTx wtx(&wallet, CreateTestTx(COutPoint(GetRandHash(), 0), key, COIN));
+        BOOST_CHECK(wallet.AddToWallet(wtx));
+        vHash.push_back(wtx.GetHash());
+        CheckWalletByTime(wallet);
+    }
+    BOOST_CHECK_EQUAL(wallet.setWalletByTime.size(), 20U);
+
+    // Adding a transaction again keeps the time it was first received
+    SetMockTime(1300000000);
+    BOOST_CHECK(wallet.AddToWallet(CWalletTx(&wallet, wallet.mapWallet[vHash[3]])));
+    CheckWalletByTime(wallet);
+    SetMockTime(0);
+
+    for (int i = 0; i < 20; i += 3)
+    {
+        BOOST_CHECK(wallet.EraseFromWallet(vHash[i]));
+        CheckWalletByTime(wallet);
+    }
+    BOOST_CHECK(wallet.EraseFromWallet(vHash[0]));
+    CheckWalletByTime(wallet);
+    BOOST_CHECK_EQUAL(wallet.setWalletByTime.size(), 13U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -169,6 +169,32 @@ public:
     }
 
 
+    base_uint& operator/=(const base_uint& b)
+    {
+        // Shift and subtract long division, division by zero gives zero
+        base_uint div = b;
+        base_uint num = *this;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        unsigned int nNumBits = num.bits();
+        unsigned int nDivBits = div.bits();
+        if (nDivBits == 0 || nDivBits > nNumBits)
+            return *this;
+        int nShift = nNumBits - nDivBits;
+        div <<= nShift;
+        while (nShift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[nShift / 32] |= (1U << (nShift & 31));
+            }
+            div >>= 1;
+            nShift--;
+        }
+        return *this;
+    }
+
     base_uint& operator++()
     {
         // prefix operator
@@ -349,6 +375,17 @@ public:
         return sizeof(pn);
     }
 
+    // Number of significant bits
+    unsigned int bits() const
+    {
+        for (int i = WIDTH-1; i >= 0; i--)
+            if (pn[i])
+                for (int nBit = 31; nBit >= 0; nBit--)
+                    if (pn[i] & (1U << nBit))
+                        return 32 * i + nBit + 1;
+        return 0;
+    }
+
     uint64 Get64(int n=0) const
     {
         return pn[2*n] | (uint64)pn[2*n+1] << 32;
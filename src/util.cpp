@@ -57,6 +57,8 @@ namespace boost {
 
 #ifndef WIN32
 #include <execinfo.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 using namespace std;
@@ -933,6 +935,61 @@ int GetFilesize(FILE* file)
     return nFilesize;
 }
 
+bool TruncateFile(FILE* file, uint64 nLength)
+{
+#ifdef WIN32
+    return _chsize_s(_fileno(file), nLength) == 0;
+#else
+    return ftruncate(fileno(file), nLength) == 0;
+#endif
+}
+
+// Makes the file cover nOffset to nOffset + nLength on disk so that writing
+// it later does not fragment the file. The file position is undefined after.
+void AllocateFileRange(FILE* file, uint64 nOffset, uint64 nLength)
+{
+    fflush(file);
+#if defined(WIN32)
+    // Windows allocates the space when the end of the file is moved
+    HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(file));
+    LARGE_INTEGER nFileSize;
+    nFileSize.QuadPart = nOffset + nLength;
+    SetFilePointerEx(hFile, nFileSize, 0, FILE_BEGIN);
+    SetEndOfFile(hFile);
+#elif defined(MAC_OSX)
+    // Mac OS X has no posix_fallocate
+    fstore_t fst;
+    fst.fst_flags = F_ALLOCATECONTIG;
+    fst.fst_posmode = F_PEOFPOSMODE;
+    fst.fst_offset = 0;
+    fst.fst_length = nOffset + nLength;
+    fst.fst_bytesalloc = 0;
+    if (fcntl(fileno(file), F_PREALLOCATE, &fst) == -1)
+    {
+        fst.fst_flags = F_ALLOCATEALL;
+        fcntl(fileno(file), F_PREALLOCATE, &fst);
+    }
+    ftruncate(fileno(file), nOffset + nLength);
+#elif defined(__linux__)
+    if (posix_fallocate(fileno(file), nOffset, nLength) == 0)
+        return;
+#endif
+#if !defined(WIN32) && !defined(MAC_OSX)
+    // Fall back to writing zeros
+    static const char buf[65536] = {};
+    if (fseeko(file, nOffset, SEEK_SET) != 0)
+        return;
+    while (nLength > 0)
+    {
+        unsigned int nNow = min((uint64)sizeof(buf), nLength);
+        if (fwrite(buf, 1, nNow, file) != nNow)
+            break;
+        nLength -= nNow;
+    }
+    fflush(file);
+#endif
+}
+
 void ShrinkDebugFile()
 {
     // Scroll debug.log if it's getting too big
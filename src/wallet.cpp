@@ -49,6 +49,7 @@ bool CWallet::AddKey(const CKey& key)
 {
     if (!CCryptoKeyStore::AddKey(key))
         return false;
+    AddToFilter(key.GetPubKey().GetID());
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
@@ -60,6 +61,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddToFilter(vchPubKey.GetID());
     if (!fFileBacked)
         return true;
     {
@@ -76,6 +78,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    AddToFilter(Hash160(redeemScript));
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -313,6 +316,8 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     printf("WalletUpdateSpent found spent coin %sxpy %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    mapStakeCandidates.erase(txin.prevout);
+                    UpdatedCoins(txin.prevout.hash);
                     UpdatedTransaction(txin.prevout.hash);
                 }
             }
@@ -326,6 +331,14 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+
+        // Keys may have been added, look at every transaction again
+        fLedgerRebuild = true;
+        fAddressGroupingsValid = false;
+    }
+    {
+        LOCK(cs_stakeweight);
+        fStakeWeightRebuild = true;
     }
 }
 
@@ -340,7 +353,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         wtx.BindWallet(this);
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
+        {
             wtx.nTimeReceived = GetAdjustedTime();
+            setWalletByTime.insert(make_pair(wtx.GetTxTime(), hash));
+            AddToFilter(hash);
+        }
 
         bool fUpdated = false;
         if (!fInsertedNew)
@@ -368,6 +385,13 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().substr(0,10).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
+        // Block or spent flags may have changed
+        if (fUpdated)
+            EraseStakeCandidates(hash);
+        UpdatedCoins(hash);
+        if (fInsertedNew)
+            fAddressGroupingsValid = false;
+
         // Write to disk
         if (fInsertedNew || fUpdated)
             if (!wtx.WriteToDisk())
@@ -420,6 +444,8 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
         LOCK(cs_wallet);
         bool fExisted = mapWallet.count(hash);
         if (fExisted && !fUpdate) return false;
+        if (!fExisted && !MayInvolveMe(tx))
+            return false;
         if (fExisted || IsMine(tx) || IsFromMe(tx))
         {
             CWalletTx wtx(this,tx);
@@ -440,8 +466,16 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            setWalletByTime.erase(make_pair((*mi).second.GetTxTime(), hash));
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
+        EraseStakeCandidates(hash);
+        UpdatedCoins(hash);
+        fAddressGroupingsValid = false;
     }
     return true;
 }
@@ -633,6 +667,7 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, int64& nGenerated, i
 void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 {
     vtxPrev.clear();
+    vchPrevDeferred.clear();
 
     const int COPY_DEPTH = 3;
     if (SetMerkleBranch() < COPY_DEPTH)
@@ -658,6 +693,7 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
                 if (mi != pwallet->mapWallet.end())
                 {
                     tx = (*mi).second;
+                    (*mi).second.ReadSupportingTransactions();
                     BOOST_FOREACH(const CMerkleTx& txWalletPrev, (*mi).second.vtxPrev)
                         mapWalletPrev[txWalletPrev.GetHash()] = &txWalletPrev;
                 }
@@ -690,6 +726,17 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
     reverse(vtxPrev.begin(), vtxPrev.end());
 }
 
+// trollocoin: unserialize the supporting transactions deferred by a fast wallet load
+void CWalletTx::ReadSupportingTransactions() const
+{
+    if (vchPrevDeferred.empty())
+        return;
+    CWalletTx* pthis = const_cast<CWalletTx*>(this);
+    CDataStream ssPrev(vchPrevDeferred, SER_DISK, CLIENT_VERSION);
+    pthis->vchPrevDeferred.clear();
+    ssPrev >> pthis->vtxPrev;
+}
+
 bool CWalletTx::WriteToDisk()
 {
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
@@ -698,25 +745,205 @@ bool CWalletTx::WriteToDisk()
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+// trollocoin: ScanForWalletTransactions runs as a pipeline. One thread reads
+// blocks ahead from disk, the matching threads hash their transactions and
+// test the outputs against the wallet filter, and the calling thread commits
+// the blocks to the wallet in chain order. Only transactions that can involve
+// the wallet are passed to AddToWalletIfInvolvingMe.
+
+// A block on its way through the rescan
+class CRescanBlock
+{
+public:
+    CBlock block;
+    std::vector<uint256> vHash;     // transaction hashes
+    std::vector<char> vfMatch;      // an output may pay the wallet
+    bool fMatched;
+};
+
+// Shared state of the threads of a rescan
+class CRescan
+{
+public:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::vector<CRescanBlock> vBlocks;  // ring of blocks read ahead of the commits
+    unsigned int nRead;     // blocks read so far
+    unsigned int nMatch;    // blocks taken by the matching threads so far
+    unsigned int nCommit;   // blocks committed so far
+    bool fReadDone;
+    bool fStop;
+    CWalletFilter filter;   // the wallet's filter when the rescan started
+};
+
+static void ThreadRescanRead(CBlockIndex* pindexStart, CRescan* prescan)
+{
+    for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+    {
+        unsigned int nSlot;
+        {
+            boost::mutex::scoped_lock lock(prescan->mutex);
+            while (prescan->nRead - prescan->nCommit >= prescan->vBlocks.size() && !prescan->fStop)
+                prescan->cond.wait(lock);
+            if (prescan->fStop)
+                break;
+            nSlot = prescan->nRead % prescan->vBlocks.size();
+        }
+
+        CRescanBlock& rblock = prescan->vBlocks[nSlot];
+        rblock.block.ReadFromDisk(pindex, true);
+        rblock.fMatched = false;
+        {
+            boost::mutex::scoped_lock lock(prescan->mutex);
+            prescan->nRead++;
+        }
+        prescan->cond.notify_all();
+    }
+
+    {
+        boost::mutex::scoped_lock lock(prescan->mutex);
+        prescan->fReadDone = true;
+    }
+    prescan->cond.notify_all();
+}
+
+static void ThreadRescanMatch(CRescan* prescan)
+{
+    for (;;)
+    {
+        unsigned int nSlot;
+        {
+            boost::mutex::scoped_lock lock(prescan->mutex);
+            while (prescan->nMatch == prescan->nRead && !prescan->fReadDone && !prescan->fStop)
+                prescan->cond.wait(lock);
+            if (prescan->fStop || prescan->nMatch == prescan->nRead)
+                return;
+            nSlot = prescan->nMatch++ % prescan->vBlocks.size();
+        }
+
+        CRescanBlock& rblock = prescan->vBlocks[nSlot];
+        const vector<CTransaction>& vtx = rblock.block.vtx;
+        rblock.vHash.resize(vtx.size());
+        rblock.vfMatch.assign(vtx.size(), false);
+        for (unsigned int i = 0; i < vtx.size(); i++)
+        {
+            rblock.vHash[i] = vtx[i].GetHash();
+            BOOST_FOREACH(const CTxOut& txout, vtx[i].vout)
+            {
+                if (prescan->filter.MayBeMine(txout.scriptPubKey))
+                {
+                    rblock.vfMatch[i] = true;
+                    break;
+                }
+            }
+        }
+        {
+            boost::mutex::scoped_lock lock(prescan->mutex);
+            rblock.fMatched = true;
+        }
+        prescan->cond.notify_all();
+    }
+}
+
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    if (!pindexStart)
+        return ret;
 
-    CBlockIndex* pindex = pindexStart;
-    {
-        LOCK(cs_wallet);
-        while (pindex)
+    LOCK(cs_wallet);
+
+    CRescan rescan;
+    rescan.vBlocks.resize(256);
+    rescan.nRead = rescan.nMatch = rescan.nCommit = 0;
+    rescan.fReadDone = rescan.fStop = false;
+    if (fFilterRebuild)
+        RebuildFilter();
+    rescan.filter = filter;
+
+    int nThreads = GetArg("-rescanthreads", boost::thread::hardware_concurrency());
+    if (nThreads < 1)
+        nThreads = 1;
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(boost::bind(&ThreadRescanRead, pindexStart, &rescan));
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadRescanMatch, &rescan));
+
+    // One database transaction per thousand blocks
+    auto_ptr<CWalletDBBatch> pwalletdbBatch(fFileBacked ? new CWalletDBBatch(strWalletFile) : NULL);
+
+    int nHeight = pindexStart->nHeight;
+    int nBlocks = max(nBestHeight - pindexStart->nHeight + 1, 1);
+    unsigned int nTx = 0;
+    int64 nStart = GetTimeMillis();
+    int64 nLastReport = nStart;
+    try
+    {
+        for (;;)
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            unsigned int nSlot;
+            {
+                boost::mutex::scoped_lock lock(rescan.mutex);
+                while (!(rescan.nCommit < rescan.nRead && rescan.vBlocks[rescan.nCommit % rescan.vBlocks.size()].fMatched) &&
+                       !(rescan.fReadDone && rescan.nCommit == rescan.nRead))
+                    rescan.cond.wait(lock);
+                if (rescan.nCommit == rescan.nRead)
+                    break;
+                nSlot = rescan.nCommit % rescan.vBlocks.size();
+            }
+
+            // A transaction that pays none of the wallet's keys, spends
+            // nothing of the wallet and isn't in the wallet yet would be
+            // left alone by AddToWalletIfInvolvingMe
+            CRescanBlock& rblock = rescan.vBlocks[nSlot];
+            for (unsigned int i = 0; i < rblock.block.vtx.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                const CTransaction& tx = rblock.block.vtx[i];
+                bool fInvolvesMe = rblock.vfMatch[i] || mapWallet.count(rblock.vHash[i]);
+                for (unsigned int j = 0; j < tx.vin.size() && !fInvolvesMe; j++)
+                    fInvolvesMe = mapWallet.count(tx.vin[j].prevout.hash) > 0;
+                if (fInvolvesMe && AddToWalletIfInvolvingMe(tx, &rblock.block, fUpdate))
                     ret++;
             }
-            pindex = pindex->pnext;
+            nTx += rblock.block.vtx.size();
+            nHeight++;
+
+            {
+                boost::mutex::scoped_lock lock(rescan.mutex);
+                rescan.nCommit++;
+            }
+            rescan.cond.notify_all();
+
+            if (pwalletdbBatch.get() && rescan.nCommit % 1000 == 0 && !pwalletdbBatch->Commit())
+                printf("ERROR: ScanForWalletTransactions() : writing the wallet transactions up to block %d failed\n", nHeight - 1);
+
+            int64 nNow = GetTimeMillis();
+            if (nNow - nLastReport >= 10000)
+            {
+                double dSeconds = (nNow - nStart) / 1000.0;
+                printf("ScanForWalletTransactions() : at block %d, %d%%, %.0f blocks/s, %.0f tx/s\n",
+                    nHeight - 1, (int)(100LL * rescan.nCommit / nBlocks), rescan.nCommit / dSeconds, nTx / dSeconds);
+                nLastReport = nNow;
+            }
         }
     }
+    catch (...)
+    {
+        {
+            boost::mutex::scoped_lock lock(rescan.mutex);
+            rescan.fStop = true;
+        }
+        rescan.cond.notify_all();
+        threadGroup.join_all();
+        throw;
+    }
+    threadGroup.join_all();
+    if (pwalletdbBatch.get() && !pwalletdbBatch->Commit(true))
+        printf("ERROR: ScanForWalletTransactions() : writing the wallet transactions failed\n");
+
+    int64 nTime = GetTimeMillis() - nStart;
+    printf("ScanForWalletTransactions() : scanned %u blocks with %u transactions in %"PRI64d"ms using %d threads, %d added or updated\n",
+        rescan.nCommit, nTx, nTime, nThreads, ret);
     return ret;
 }
 
@@ -737,7 +964,7 @@ void CWallet::ReacceptWalletTransactions()
     {
         LOCK(cs_wallet);
         fRepeat = false;
-        vector<CDiskTxPos> vMissingTx;
+        bool fMissingTx = false;
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
         {
             CWalletTx& wtx = item.second;
@@ -748,21 +975,23 @@ void CWallet::ReacceptWalletTransactions()
             bool fUpdated = false;
             if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
             {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                if (txindex.vSpent.size() != wtx.vout.size())
+                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat,
+                // a transaction without coins has all of its outputs spent
+                CCoins coins;
+                if (txdb.ReadCoins(wtx.GetHash(), coins) && coins.vout.size() != wtx.vout.size())
                 {
-                    printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %d != wtx.vout.size() %d\n", txindex.vSpent.size(), wtx.vout.size());
+                    printf("ERROR: ReacceptWalletTransactions() : coins.vout.size() %d != wtx.vout.size() %d\n", coins.vout.size(), wtx.vout.size());
                     continue;
                 }
-                for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+                for (unsigned int i = 0; i < wtx.vout.size(); i++)
                 {
                     if (wtx.IsSpent(i))
                         continue;
-                    if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                    if (!coins.IsAvailable(i) && IsMine(wtx.vout[i]))
                     {
                         wtx.MarkSpent(i);
                         fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        fMissingTx = true;
                     }
                 }
                 if (fUpdated)
@@ -770,6 +999,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %sxpy %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdatedCoins(wtx.GetHash());
                 }
             }
             else
@@ -779,7 +1009,7 @@ void CWallet::ReacceptWalletTransactions()
                     wtx.AcceptWalletTransaction(txdb, false);
             }
         }
-        if (!vMissingTx.empty())
+        if (fMissingTx)
         {
             // TODO: optimize this to scan just part of the block chain?
             if (ScanForWalletTransactions(pindexGenesisBlock))
@@ -790,6 +1020,7 @@ void CWallet::ReacceptWalletTransactions()
 
 void CWalletTx::RelayWalletTransaction(CTxDB& txdb)
 {
+    ReadSupportingTransactions();
     BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
     {
         if (!(tx.IsCoinBase() || tx.IsCoinStake()))
@@ -873,34 +1104,16 @@ void CWallet::ResendWalletTransactions()
 
 int64 CWallet::GetBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                continue;
-            nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK(cs_wallet);
+    UpdateLedger();
+    return ledger.nBalance;
 }
 
 int64 CWallet::GetUnconfirmedBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    UpdateLedger();
+    return ledger.nUnconfirmed;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -934,30 +1147,252 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 // trollocoin: total coins staked (non-spendable until maturity)
 int64 CWallet::GetStake() const
 {
-    int64 nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateLedger();
+    return ledger.nStake;
 }
 
 int64 CWallet::GetNewMint() const
 {
-    int64 nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    UpdateLedger();
+    return ledger.nNewMint;
+}
+
+// trollocoin: share of a transaction in the wallet's balances, the same
+// conditions the balance functions used to check when summing mapWallet
+void CWallet::GetLedgerEntry(const CWalletTx& wtx, CWalletLedger::CEntry& entry) const
+{
+    entry = CWalletLedger::CEntry();
+
+    bool fConfirmed = wtx.IsFinal() && wtx.IsConfirmed();
+    entry.fVolatile = !fConfirmed;
+    if (fConfirmed)
+        entry.nBalance = wtx.GetAvailableCredit();
+    else
+        entry.nUnconfirmed = wtx.GetAvailableCredit();
+
+    int nDepth = wtx.GetDepthInMainChain();
+    bool fGenerated = wtx.IsCoinBase() || wtx.IsCoinStake();
+    bool fImmature = fGenerated && wtx.GetBlocksToMaturity() > 0;
+    if (fGenerated && nDepth > 0)
     {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
+        // GetBlocksToMaturity() reaches 0 at this height
+        entry.nHeightMature = nBestHeight - nDepth + 1 + nCoinbaseMaturity + 19;
+        if (fImmature && wtx.IsCoinStake())
+            entry.nStake = CWallet::GetCredit(wtx);
+        if (fImmature && wtx.IsCoinBase())
+            entry.nNewMint = CWallet::GetCredit(wtx);
+    }
+
+    if (fConfirmed && !fImmature)
+    {
+        uint256 hash = wtx.GetHash();
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        {
+            if (wtx.IsSpent(i) || !IsMine(wtx.vout[i]) || wtx.vout[i].nValue <= 0)
+                continue;
+            CLedgerCoin coin(wtx.vout[i].nValue, COutPoint(hash, i));
+            coin.pcoin = &wtx;
+            coin.nTime = wtx.nTime;
+            coin.nHeight = (nDepth > 0 ? nBestHeight - nDepth + 1 : -1);
+            coin.fFromMe = wtx.IsFromMe();
+            entry.vCoins.push_back(coin);
+        }
+    }
+
+    if (!fConfirmed || (wtx.IsCoinBase() && fImmature) || nDepth < (wtx.IsFromMe() ? 0 : 1))
+        return;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        CTxDestination addr;
+        if (!IsMine(wtx.vout[i]))
+            continue;
+        if (!ExtractDestination(wtx.vout[i].scriptPubKey, addr))
+            continue;
+        entry.vAddressBalances.push_back(make_pair(addr, wtx.IsSpent(i) ? 0 : wtx.vout[i].nValue));
+    }
+}
+
+// trollocoin: bring the balance ledger up to date, requires cs_wallet.
+// Transactions are looked at again on the next update if cs_main is busy,
+// their block may be in the middle of being connected or disconnected.
+void CWallet::UpdateLedger() const
+{
+    TRY_LOCK(cs_main, lockMain);
+
+    set<uint256> setUpdate;
+    if (fLedgerRebuild)
+    {
+        ledger.SetNull();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setUpdate.insert((*it).first);
+        fLedgerRebuild = false;
+    }
+    setUpdate.insert(setLedgerUpdated.begin(), setLedgerUpdated.end());
+    setUpdate.insert(ledger.setVolatile.begin(), ledger.setVolatile.end());
+    ledger.GetMaturityChanges(nBestHeight, setUpdate);
+    ledger.nHeight = nBestHeight;
+
+    BOOST_FOREACH(const uint256& hash, setUpdate)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+        {
+            ledger.Erase(hash);
+            continue;
+        }
+        CWalletLedger::CEntry entry;
+        GetLedgerEntry((*mi).second, entry);
+        ledger.Set(hash, entry);
+    }
+
+    if (lockMain)
+        setLedgerUpdated.clear();
+    else
+        setLedgerUpdated.swap(setUpdate);
+}
+
+void CWalletLedger::SetNull()
+{
+    mapEntries.clear();
+    setVolatile.clear();
+    setMaturity.clear();
+    setCoins.clear();
+    nBalance = 0;
+    nUnconfirmed = 0;
+    nStake = 0;
+    nNewMint = 0;
+    mapAddressBalances.clear();
+    nHeight = -1;
+}
+
+void CWalletLedger::Set(const uint256& hashTx, const CEntry& entry)
+{
+    Erase(hashTx);
+
+    nBalance += entry.nBalance;
+    nUnconfirmed += entry.nUnconfirmed;
+    nStake += entry.nStake;
+    nNewMint += entry.nNewMint;
+    for (unsigned int i = 0; i < entry.vAddressBalances.size(); i++)
+    {
+        pair<int64, int>& balance = mapAddressBalances[entry.vAddressBalances[i].first];
+        balance.first += entry.vAddressBalances[i].second;
+        balance.second++;
     }
-    return nTotal;
+    setCoins.insert(entry.vCoins.begin(), entry.vCoins.end());
+    if (entry.fVolatile)
+        setVolatile.insert(hashTx);
+    if (entry.nHeightMature != -1)
+        setMaturity.insert(make_pair(entry.nHeightMature, hashTx));
+    mapEntries.insert(make_pair(hashTx, entry));
 }
 
+void CWalletLedger::Erase(const uint256& hashTx)
+{
+    map<uint256, CEntry>::iterator mi = mapEntries.find(hashTx);
+    if (mi == mapEntries.end())
+        return;
+    const CEntry& entry = (*mi).second;
+
+    nBalance -= entry.nBalance;
+    nUnconfirmed -= entry.nUnconfirmed;
+    nStake -= entry.nStake;
+    nNewMint -= entry.nNewMint;
+    for (unsigned int i = 0; i < entry.vAddressBalances.size(); i++)
+    {
+        map<CTxDestination, pair<int64, int> >::iterator miAddress = mapAddressBalances.find(entry.vAddressBalances[i].first);
+        (*miAddress).second.first -= entry.vAddressBalances[i].second;
+        if (--(*miAddress).second.second == 0)
+            mapAddressBalances.erase(miAddress);
+    }
+    for (unsigned int i = 0; i < entry.vCoins.size(); i++)
+        setCoins.erase(entry.vCoins[i]);
+    if (entry.fVolatile)
+        setVolatile.erase(hashTx);
+    if (entry.nHeightMature != -1)
+        setMaturity.erase(make_pair(entry.nHeightMature, hashTx));
+    mapEntries.erase(mi);
+}
+
+// Transactions whose coinbase or coinstake matured, or became immature again,
+// between nHeight and nHeightIn
+void CWalletLedger::GetMaturityChanges(int nHeightIn, set<uint256>& setRet) const
+{
+    int nLow = min(nHeight, nHeightIn);
+    int nHigh = max(nHeight, nHeightIn);
+    set<pair<int, uint256> >::const_iterator it = setMaturity.lower_bound(make_pair(nLow + 1, uint256(0)));
+    for (; it != setMaturity.end() && (*it).first <= nHigh; ++it)
+        setRet.insert((*it).second);
+}
+
+
+// Smallest subset of vValue, sorted by decreasing value, that sums up to at
+// least nTargetValue. The search stops at an exact match or once it used up
+// its budget, the best subset found so far is returned then. vValue must sum
+// up to at least nTargetValue.
+bool SelectCoinsBranchAndBound(const vector<int64>& vValue, int64 nTargetValue, vector<char>& vfBestRet, int64& nBestRet)
+{
+    static const int nMaxTries = 100000;
+    static const int64 nMaxTime = 100; // ms
+
+    // Value of the coins from i onwards, to stop going down branches that
+    // can't reach the target
+    vector<int64> vRemaining(vValue.size() + 1, 0);
+    for (int i = vValue.size() - 1; i >= 0; i--)
+        vRemaining[i] = vRemaining[i + 1] + vValue[i];
+    if (vRemaining[0] < nTargetValue)
+        return false;
+
+    vfBestRet.assign(vValue.size(), true);
+    nBestRet = vRemaining[0];
+
+    vector<char> vfIncluded(vValue.size(), false);
+    int64 nTotal = 0;
+    unsigned int i = 0;
+    int64 nStart = GetTimeMillis();
+    for (int nTries = 0; nTries < nMaxTries && nBestRet != nTargetValue; nTries++)
+    {
+        if (nTries % 1000 == 999 && GetTimeMillis() - nStart > nMaxTime)
+            break;
+
+        bool fBacktrack = false;
+        if (nTotal >= nTargetValue)
+        {
+            if (nTotal < nBestRet)
+            {
+                nBestRet = nTotal;
+                vfBestRet = vfIncluded;
+            }
+            fBacktrack = true;
+        }
+        else if (i == vValue.size() || nTotal + vRemaining[i] < nTargetValue)
+            fBacktrack = true;
+
+        if (fBacktrack)
+        {
+            // Leave out the last coin taken and go on with the coins after it
+            while (i > 0 && !vfIncluded[i - 1])
+                i--;
+            if (i == 0)
+                break;
+            vfIncluded[i - 1] = false;
+            nTotal -= vValue[i - 1];
+            continue;
+        }
+
+        // Taking a coin only helps if it keeps the total below the best one,
+        // and a coin worth the same as a coin just left out gives the same sums
+        if (nTotal + vValue[i] < nBestRet && !(i > 0 && vValue[i] == vValue[i - 1] && !vfIncluded[i - 1]))
+        {
+            vfIncluded[i] = true;
+            nTotal += vValue[i];
+        }
+        i++;
+    }
+    return true;
+}
 
 bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
@@ -972,55 +1407,36 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, in
     int64 nTotalLower = 0;
 
     {
-       LOCK(cs_wallet);
-       vector<const CWalletTx*> vCoins;
-       vCoins.reserve(mapWallet.size());
-       for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-           vCoins.push_back(&(*it).second);
-       random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-       BOOST_FOREACH(const CWalletTx* pcoin, vCoins)
-       {
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                continue;
+        LOCK(cs_wallet);
+        UpdateLedger();
 
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+        // The coin index is ordered by value: coins worth the target, coins
+        // below target + CENT and the smallest coin above it are ranges of it
+        set<CLedgerCoin>::const_iterator itLarger = ledger.setCoins.lower_bound(CLedgerCoin(nTargetValue + CENT));
+        for (set<CLedgerCoin>::const_iterator it = ledger.setCoins.lower_bound(CLedgerCoin(nTargetValue)); it != itLarger && (*it).nValue == nTargetValue; ++it)
+        {
+            if (IsSelectable(*it, nSpendTime, nConfMine, nConfTheirs))
+            {
+                setCoinsRet.insert(make_pair((*it).pcoin, (*it).prevout.n));
+                nValueRet += (*it).nValue;
+                return true;
+            }
+        }
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
+        for (set<CLedgerCoin>::const_iterator it = ledger.setCoins.begin(); it != itLarger; ++it)
+        {
+            if ((*it).nValue == nTargetValue || !IsSelectable(*it, nSpendTime, nConfMine, nConfTheirs))
                 continue;
+            vValue.push_back(make_pair((*it).nValue, make_pair((*it).pcoin, (*it).prevout.n)));
+            nTotalLower += (*it).nValue;
+        }
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+        for (set<CLedgerCoin>::const_iterator it = itLarger; it != ledger.setCoins.end(); ++it)
+        {
+            if (IsSelectable(*it, nSpendTime, nConfMine, nConfTheirs))
             {
-                if (pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]))
-                    continue;
-
-                if (pcoin->nTime > nSpendTime)
-                    continue;  // trollocoin: timestamp must not exceed spend time
-
-                int64 n = pcoin->vout[i].nValue;
-
-                if (n <= 0)
-                    continue;
-
-                pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin,i));
-
-                if (n == nTargetValue)
-                {
-                    setCoinsRet.insert(coin.second);
-                    nValueRet += coin.first;
-                    return true;
-                }
-                else if (n < nTargetValue + CENT)
-                {
-                    vValue.push_back(coin);
-                    nTotalLower += n;
-                }
-                else if (n < coinLowestLarger.first)
-                {
-                    coinLowestLarger = coin;
-                }
+                coinLowestLarger = make_pair((*it).nValue, make_pair((*it).pcoin, (*it).prevout.n));
+                break;
             }
         }
     }
@@ -1047,40 +1463,15 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, in
     if (nTotalLower >= nTargetValue + CENT)
         nTargetValue += CENT;
 
-    // Solve subset sum by stochastic approximation
+    // Solve subset sum by branch and bound
     sort(vValue.rbegin(), vValue.rend());
-    vector<char> vfIncluded;
-    vector<char> vfBest(vValue.size(), true);
-    int64 nBest = nTotalLower;
-
-    for (int nRep = 0; nRep < 1000 && nBest != nTargetValue; nRep++)
-    {
-        vfIncluded.assign(vValue.size(), false);
-        int64 nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
-        {
-            for (unsigned int i = 0; i < vValue.size(); i++)
-            {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
-        }
-    }
+    vector<int64> vValueLower;
+    vValueLower.reserve(vValue.size());
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        vValueLower.push_back(vValue[i].first);
+    vector<char> vfBest;
+    int64 nBest;
+    SelectCoinsBranchAndBound(vValueLower, nTargetValue, vfBest, nBest);
 
     // If the next larger is still closer, return it
     if (coinLowestLarger.second.first && coinLowestLarger.first - nTargetValue <= nBest - nTargetValue)
@@ -1112,12 +1503,11 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, in
 
 bool CWallet::SelectCoins(int64 nTargetValue, unsigned int nSpendTime, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl* coinControl) const
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
-
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
+        vector<COutput> vCoins;
+        AvailableCoins(vCoins, true, coinControl);
         BOOST_FOREACH(const COutput& out, vCoins)
         {
             nValueRet += out.tx->vout[out.i].nValue;
@@ -1314,156 +1704,188 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     int64 nCombineThreshold = MINIMUM_FOR_ORION;
 
 
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-
-    LOCK2(cs_main, cs_wallet);
-    txNew.vin.clear();
-    txNew.vout.clear();
-
     // Make variable interest rate
     unsigned int primeNodeRate = 0;
     int64 microPrimeGroup;
 
-    if (mapArgs.count("-primenodekey"))
+    int64 nBalance;
+    int64 nReserveBalance = 0;
+    static int nMaxStakeSearchInterval = 60;
+
+    // Snapshot of the kernel candidates, the kernel search itself runs on
+    // this without holding any locks
+    vector<COutPoint> vKernelCoins;
+    vector<CStakeKernel> vKernels;
+    vector<COutPoint> vStakeCoins;
     {
-        CScript scriptPrimeNode;
-        string strPrivKey = GetArg("-primenodekey", "");
-        vector<unsigned char> vchPrivKey = ParseHex(strPrivKey);
-        if (!NewScriptPrimeID(scriptPrimeNode, vchPrivKey, txNew.nTime))
+        LOCK2(cs_main, cs_wallet);
+        txNew.vin.clear();
+        txNew.vout.clear();
+
+        if (mapArgs.count("-primenodekey"))
+        {
+            CScript scriptPrimeNode;
+            string strPrivKey = GetArg("-primenodekey", "");
+            vector<unsigned char> vchPrivKey = ParseHex(strPrivKey);
+            if (!NewScriptPrimeID(scriptPrimeNode, vchPrivKey, txNew.nTime))
+                return false;
+
+            primeNodeRate = 25;
+            nCombineThreshold = MINIMUM_FOR_PRIMENODE;
+            microPrimeGroup = 0;
+
+            txNew.vout.push_back(CTxOut(0, scriptPrimeNode));
+        }
+
+        /* Wait to mark non-primenode stakes until after we know what coins are
+         * staking. */
+
+        // Choose coins to use
+        nBalance = GetBalance();
+        if (mapArgs.count("-reservebalance") && !ParseMoney(mapArgs["-reservebalance"], nReserveBalance))
+            return error("CreateCoinStake : invalid reserve balance amount");
+        printf("Your balance is %"PRI64d" and reservebalance is %"PRI64d"\n", nBalance, nReserveBalance);
+        if (nBalance <= nReserveBalance)
+            return false;
+        set<pair<const CWalletTx*,unsigned int> > setCoins;
+        int64 nValueIn = 0;
+        if (!SelectCoins(nBalance - nReserveBalance, txNew.nTime, setCoins, nValueIn))
+            return false;
+        if (setCoins.empty())
             return false;
 
-        primeNodeRate = 25;
-        nCombineThreshold = MINIMUM_FOR_PRIMENODE;
-        microPrimeGroup = 0;
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+        {
+            vStakeCoins.push_back(COutPoint(pcoin.first->GetHash(), pcoin.second));
+
+            // Only coins we can build a coinstake output for can be kernels
+            vector<valtype> vSolutions;
+            txnouttype whichType;
+            if (!Solver(pcoin.first->vout[pcoin.second].scriptPubKey, whichType, vSolutions))
+                continue;
+            if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+                continue;
+            if (whichType == TX_PUBKEYHASH && !keystore.HaveKey(uint160(vSolutions[0])))
+                continue;
 
-        txNew.vout.push_back(CTxOut(0, scriptPrimeNode));
-     }
+            const CStakeCandidate* pcandidate = GetStakeCandidate(pcoin.first, pcoin.second);
+            if (!pcandidate)
+                continue;
+            if (pcandidate->kernel.nTimeBlockFrom + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
+                continue; // only count coins meeting min age requirement
+            if (!pcandidate->fStakeModifier)
+                continue;
 
-    /* Wait to mark non-primenode stakes until after we know what coins are
-     * staking. */
+            vKernelCoins.push_back(vStakeCoins.back());
+            vKernels.push_back(pcandidate->kernel);
+        }
+    }
 
-    // Choose coins to use
-    int64 nBalance = GetBalance();
-    int64 nReserveBalance = 0;
-    if (mapArgs.count("-reservebalance") && !ParseMoney(mapArgs["-reservebalance"], nReserveBalance))
-        return error("CreateCoinStake : invalid reserve balance amount");
-    printf("Your balance is %"PRI64d" and reservebalance is %"PRI64d"\n", nBalance, nReserveBalance);
-    if (nBalance <= nReserveBalance)
+    // Search backward in time from the given txNew timestamp
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    unsigned int nKernel = 0;
+    unsigned int nTimeTx = txNew.nTime;
+    uint256 hashProofOfStake = 0;
+    int nStakeThreads = GetArg("-stakethreads", boost::thread::hardware_concurrency());
+    if (!FindStakeKernel(nBits, vKernels, txNew.nTime, min(nSearchInterval, (int64)nMaxStakeSearchInterval), nStakeThreads, nKernel, nTimeTx, hashProofOfStake))
         return false;
-    set<pair<const CWalletTx*,unsigned int> > setCoins;
-    vector<const CWalletTx*> vwtxPrev;
-    int64 nValueIn = 0;
-    if (!SelectCoins(nBalance - nReserveBalance, txNew.nTime, setCoins, nValueIn))
+    if (fShutdown)
         return false;
-    if (setCoins.empty())
+
+    LOCK2(cs_main, cs_wallet);
+
+    // The wallet may have changed while searching, only use coins that are
+    // still unspent
+    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    BOOST_FOREACH(const COutPoint& prevout, vStakeCoins)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(prevout.hash);
+        if (mi != mapWallet.end() && !(*mi).second.IsSpent(prevout.n))
+            setCoins.insert(make_pair(&(*mi).second, prevout.n));
+    }
+    map<uint256, CWalletTx>::const_iterator miKernel = mapWallet.find(vKernelCoins[nKernel].hash);
+    if (miKernel == mapWallet.end() || (*miKernel).second.IsSpent(vKernelCoins[nKernel].n))
         return false;
+    PAIRTYPE(const CWalletTx*, unsigned int) pcoinKernel = make_pair(&(*miKernel).second, vKernelCoins[nKernel].n);
+
+    vector<const CWalletTx*> vwtxPrev;
     int64 nCredit = 0;
     CScript scriptPubKeyKernel;
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        CTxDB txdb("r");
-        CTxIndex txindex;
-        if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-            continue;
-
-        // Read block header
-        CBlock block;
-        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-            continue;
-        static int nMaxStakeSearchInterval = 60;
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
-            continue; // only count coins meeting min age requirement
-
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown; n++)
-        {
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake))
-            {
-                // Found a kernel
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : failed to parse kernel\n", whichType);
-                    break;
-                }
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    CKey key;
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                else
-                    scriptPubKeyOut = scriptPubKeyKernel;
-
-                txNew.nTime -= n;
-                /* We found a kernel so we can check if it's address matches
-                 * a micro prime address. Do this now before splitting the
-                 * stake so that microprimes don't split their stake (same
-                 * as primenodes) and before adding the PubKeyOut to the
-                 * transaction. */
-                 if (primeNodeRate == 0) {
-                     CScript scriptStake;
-                     if (primeNodeDB->CheckMicroPrime(scriptPubKeyOut)
-                        /* Don't allow microprimes to stake until after the
-                         * given time (on mainnet) to avoid any implosion. */
-                        && (fTestNet || txNew.nTime >= ENABLE_MICROPRIMES)) {
-                         // Mark the stake and set the stake rate.
-                         scriptStake << OP_MICROPRIME;
-                         // Set the microprime group and rate from the database.
-                         int rate;
-                         primeNodeDB->IsMicroPrime(scriptPubKeyOut, rate, microPrimeGroup, txNew.nTime);
-                         primeNodeRate = rate;
-                     } else {
-                         /* If not a microprime go ahead and mark a standard
-                          * coin stake. */
-                         scriptStake.clear();
-                         microPrimeGroup = 0;
-                     }
-                     txNew.vout.push_back(CTxOut(0, scriptStake));
-                 }
-
-                printf("MicroPrimeStake : primenode rate = %d\n", primeNodeRate);
-
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-
-                if ((block.GetBlockTime() + nStakeSplitAge > txNew.nTime) && ((nCredit < MINIMUM_FOR_PRIMENODE) || primeNodeRate == 0) && microPrimeGroup == 0)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        // Found a kernel
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoinKernel.first->vout[pcoinKernel.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : failed to parse kernel\n", whichType);
+            return false;
+        }
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+            return false;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            CKey key;
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+            {
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+                    printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false;  // unable to find corresponding public key
             }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
         }
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
+        else
+            scriptPubKeyOut = scriptPubKeyKernel;
+
+        txNew.nTime = nTimeTx;
+        /* We found a kernel so we can check if it's address matches
+         * a micro prime address. Do this now before splitting the
+         * stake so that microprimes don't split their stake (same
+         * as primenodes) and before adding the PubKeyOut to the
+         * transaction. */
+         if (primeNodeRate == 0) {
+             CScript scriptStake;
+             if (CheckMicroPrime(scriptPubKeyOut)
+                /* Don't allow microprimes to stake until after the
+                 * given time (on mainnet) to avoid any implosion. */
+                && (fTestNet || txNew.nTime >= ENABLE_MICROPRIMES)) {
+                 // Mark the stake and set the stake rate.
+                 scriptStake << OP_MICROPRIME;
+                 // Set the microprime group and rate from the table.
+                 int rate;
+                 IsMicroPrime(scriptPubKeyOut, rate, microPrimeGroup, txNew.nTime);
+                 primeNodeRate = rate;
+             } else {
+                 /* If not a microprime go ahead and mark a standard
+                  * coin stake. */
+                 scriptStake.clear();
+                 microPrimeGroup = 0;
+             }
+             txNew.vout.push_back(CTxOut(0, scriptStake));
+         }
+
+        printf("MicroPrimeStake : primenode rate = %d\n", primeNodeRate);
+
+        txNew.vin.push_back(CTxIn(pcoinKernel.first->GetHash(), pcoinKernel.second));
+        nCredit += pcoinKernel.first->vout[pcoinKernel.second].nValue;
+        vwtxPrev.push_back(pcoinKernel.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        if ((vKernels[nKernel].nTimeBlockFrom + nStakeSplitAge > txNew.nTime) && ((nCredit < MINIMUM_FOR_PRIMENODE) || primeNodeRate == 0) && microPrimeGroup == 0)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : added kernel type=%d\n", whichType);
     }
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
@@ -1608,10 +2030,9 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
         LOCK2(cs_main, cs_wallet);
         printf("CommitTransaction:\n%s", wtxNew.ToString().c_str());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r") : NULL;
+            // trollocoin: the key, the new transaction and the spent coins are
+            // written in one database transaction
+            auto_ptr<CWalletDBBatch> pwalletdbBatch(fFileBacked ? new CWalletDBBatch(strWalletFile) : NULL);
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
@@ -1628,11 +2049,11 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdatedCoins(coin.GetHash());
                 UpdatedTransaction(coin.GetHash());
             }
-
-            if (fFileBacked)
-                delete pwalletdb;
+            if (pwalletdbBatch.get() && !pwalletdbBatch->Commit(true))
+                printf("ERROR: CommitTransaction() : writing the transaction to the wallet failed\n");
         }
 
         // Track how many getdata requests our transaction gets
@@ -1741,7 +2162,11 @@ int CWallet::LoadWallet(bool& fFirstRunRet)
 
 bool CWallet::SetAddressBookName(const CTxDestination& address, const string& strName)
 {
-    mapAddressBook[address] = strName;
+    {
+        LOCK(cs_wallet);
+        mapAddressBook[address] = strName;
+        fAddressGroupingsValid = false;
+    }
     AddressBookRepaint();
     if (!fFileBacked)
         return false;
@@ -1750,7 +2175,11 @@ bool CWallet::SetAddressBookName(const CTxDestination& address, const string& st
 
 bool CWallet::DelAddressBookName(const CTxDestination& address)
 {
-    mapAddressBook.erase(address);
+    {
+        LOCK(cs_wallet);
+        mapAddressBook.erase(address);
+        fAddressGroupingsValid = false;
+    }
     AddressBookRepaint();
     if (!fFileBacked)
         return false;
@@ -1813,11 +2242,117 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
 // Mark old keypool keys as used,
 // and generate all new keys
 //
+// Shared state of the threads of a GeneratePoolKeys call
+class CPoolKeyGeneration
+{
+public:
+    boost::mutex mutex;
+    unsigned int nNext;     // next key to be generated
+    bool fCompressed;
+    bool fCrypted;
+    bool fError;
+};
+
+static void ThreadGeneratePoolKeys(std::vector<CPoolKey>* pvKeys, CKeyingMaterial vMasterKey, CPoolKeyGeneration* pgeneration)
+{
+    for (;;)
+    {
+        unsigned int nKey;
+        {
+            boost::mutex::scoped_lock lock(pgeneration->mutex);
+            if (pgeneration->nNext >= pvKeys->size() || pgeneration->fError)
+                return;
+            nKey = pgeneration->nNext++;
+        }
+
+        CPoolKey& poolkey = (*pvKeys)[nKey];
+        bool fGenerated = true;
+        try
+        {
+            poolkey.key.MakeNewKey(pgeneration->fCompressed);
+            poolkey.vchPubKey = poolkey.key.GetPubKey();
+            if (pgeneration->fCrypted)
+            {
+                bool fCompressed;
+                fGenerated = EncryptSecret(vMasterKey, poolkey.key.GetSecret(fCompressed), poolkey.vchPubKey.GetHash(), poolkey.vchCryptedSecret);
+            }
+            else
+                poolkey.vchPrivKey = poolkey.key.GetPrivKey();
+        }
+        catch (std::exception& e)
+        {
+            fGenerated = false;
+        }
+        if (!fGenerated)
+        {
+            boost::mutex::scoped_lock lock(pgeneration->mutex);
+            pgeneration->fError = true;
+            return;
+        }
+    }
+}
+
+// trollocoin: generate keys for the key pool, and encrypt them in an encrypted
+// wallet, on all cores. Only the master key is read under the wallet locks.
+bool CWallet::GeneratePoolKeys(vector<CPoolKey>& vKeys)
+{
+    if (vKeys.empty())
+        return true;
+
+    CPoolKeyGeneration generation;
+    generation.nNext = 0;
+    generation.fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    generation.fCrypted = IsCrypted();
+    generation.fError = false;
+    CKeyingMaterial vMasterKey;
+    if (generation.fCrypted && !GetMasterKey(vMasterKey))
+        return false;
+
+    RandAddSeedPerfmon();
+
+    // Not worth starting threads for a handful of keys
+    int nThreads = min((int)boost::thread::hardware_concurrency(), (int)(vKeys.size() / 16));
+    if (nThreads <= 1)
+        ThreadGeneratePoolKeys(&vKeys, vMasterKey, &generation);
+    else
+    {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ThreadGeneratePoolKeys, &vKeys, vMasterKey, &generation));
+        threadGroup.join_all();
+    }
+    if (generation.fError)
+        throw std::runtime_error("CWallet::GeneratePoolKeys() : generating keys failed");
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (generation.fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+    return true;
+}
+
+// trollocoin: add a key from GeneratePoolKeys to the wallet, requires cs_wallet
+CPubKey CWallet::AddPoolKey(const CPoolKey& poolkey)
+{
+    if (!poolkey.vchCryptedSecret.empty())
+    {
+        if (!AddCryptedKey(poolkey.vchPubKey, poolkey.vchCryptedSecret))
+            throw std::runtime_error("CWallet::AddPoolKey() : AddCryptedKey failed");
+        return poolkey.vchPubKey;
+    }
+
+    if (!CCryptoKeyStore::AddKey(poolkey.key))
+        throw std::runtime_error("CWallet::AddPoolKey() : AddKey failed");
+    AddToFilter(poolkey.vchPubKey.GetID());
+    if (fFileBacked && !CWalletDB(strWalletFile).WriteKey(poolkey.vchPubKey, poolkey.vchPrivKey))
+        throw std::runtime_error("CWallet::AddPoolKey() : writing key failed");
+    return poolkey.vchPubKey;
+}
+
 bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
+        CWalletDBBatch walletdb(strWalletFile);
         BOOST_FOREACH(int64 nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
         setKeyPool.clear();
@@ -1826,12 +2361,19 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
+        vector<CPoolKey> vKeys(nKeys);
+        if (!GeneratePoolKeys(vKeys))
+            return false;
         for (int i = 0; i < nKeys; i++)
         {
             int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
+            walletdb.WritePool(nIndex, CKeyPool(AddPoolKey(vKeys[i])));
             setKeyPool.insert(nIndex);
+            if (nIndex % 1000 == 0 && !walletdb.Commit())
+                return error("CWallet::NewKeyPool() : writing keys failed");
         }
+        if (!walletdb.Commit(true))
+            return error("CWallet::NewKeyPool() : writing keys failed");
         printf("CWallet::NewKeyPool wrote %"PRI64d" new keys\n", nKeys);
     }
     return true;
@@ -1839,26 +2381,55 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool()
 {
+    unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
+
+    // trollocoin: the missing keys are generated before taking cs_wallet to
+    // add them, unless the caller holds it
+    vector<CPoolKey> vKeys;
     {
         LOCK(cs_wallet);
 
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
+        if (setKeyPool.size() < nTargetSize + 1)
+            vKeys.resize(nTargetSize + 1 - setKeyPool.size());
+    }
+    if (!GeneratePoolKeys(vKeys))
+        return false;
+
+    unsigned int nKey = 0;
+    for (;;)
+    {
+        LOCK(cs_wallet);
+
+        if (IsLocked())
+            return false;
+
+        // One database transaction and lock per thousand keys
+        CWalletDBBatch walletdb(strWalletFile);
 
         // Top up key pool
-        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
+        for (int i = 0; i < 1000 && setKeyPool.size() < (nTargetSize + 1); i++)
         {
             int64 nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+
+            // The keys generated above, then new ones if the pool was emptied
+            // or the wallet encrypted meanwhile
+            if (nKey < vKeys.size() && vKeys[nKey].vchCryptedSecret.empty() == IsCrypted())
+                nKey = vKeys.size();
+            CPubKey vchPubKey = (nKey < vKeys.size() ? AddPoolKey(vKeys[nKey++]) : GenerateNewKey());
+            if (!walletdb.WritePool(nEnd, CKeyPool(vchPubKey)))
                 throw runtime_error("TopUpKeyPool() : writing generated key failed");
             setKeyPool.insert(nEnd);
             printf("keypool added key %"PRI64d", size=%d\n", nEnd, setKeyPool.size());
         }
+        if (!walletdb.Commit(true))
+            throw runtime_error("TopUpKeyPool() : writing generated keys failed");
+        if (setKeyPool.size() >= nTargetSize + 1)
+            break;
     }
     return true;
 }
@@ -1966,16 +2537,13 @@ int64 CWallet::GetOldestKeyPoolTime()
  * wallet. */
 bool CWallet::GetSingleAddressBalance(CTxDestination address, int64 &balance)
 {
-    std::map<CTxDestination, int64> addressbalances = GetAddressBalances();
-    /* If the address is not ours it won't be in the addressbalances and
-     * std::map::at will throw an out_of_range exception. If thrown, catch it
-     * and return false.*/
-    try {
-        balance = addressbalances.at(address);
-        return true;
-    } catch (const std::out_of_range &oor) {
+    LOCK(cs_wallet);
+    UpdateLedger();
+    map<CTxDestination, pair<int64, int> >::const_iterator mi = ledger.mapAddressBalances.find(address);
+    if (mi == ledger.mapAddressBalances.end())
         return false;
-    }
+    balance = (*mi).second.first;
+    return true;
 }
 
 /* Overload for the above that allows a CScript instead of CTxDestination.
@@ -1996,80 +2564,113 @@ std::map<CTxDestination, int64> CWallet::GetAddressBalances()
 
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
-        {
-            CWalletTx *pcoin = &walletEntry.second;
-
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                continue;
-
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+        UpdateLedger();
+        for (map<CTxDestination, pair<int64, int> >::const_iterator it = ledger.mapAddressBalances.begin(); it != ledger.mapAddressBalances.end(); ++it)
+            balances.insert(balances.end(), make_pair((*it).first, (*it).second.first));
+    }
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe() ? 0 : 1))
-                continue;
+    return balances;
+}
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                CTxDestination addr;
-                if (!IsMine(pcoin->vout[i]))
-                    continue;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
-                    continue;
+// Disjoint sets of addresses, merging two sets takes near constant time
+class CAddressGroupingSets
+{
+private:
+    map<CTxDestination, int> mapIds;
+    vector<int> vParent;
+    vector<int> vSize;
 
-                int64 n = pcoin->IsSpent(i) ? 0 : pcoin->vout[i].nValue;
+public:
+    int GetId(const CTxDestination& address)
+    {
+        pair<map<CTxDestination, int>::iterator, bool> ret = mapIds.insert(make_pair(address, (int)vParent.size()));
+        if (ret.second)
+        {
+            vParent.push_back(vParent.size());
+            vSize.push_back(1);
+        }
+        return (*ret.first).second;
+    }
 
-                if (!balances.count(addr))
-                    balances[addr] = 0;
-                balances[addr] += n;
-            }
+    int Find(int nId)
+    {
+        while (vParent[nId] != nId)
+        {
+            vParent[nId] = vParent[vParent[nId]];
+            nId = vParent[nId];
         }
+        return nId;
     }
 
-    return balances;
-}
+    void Union(int nIdA, int nIdB)
+    {
+        nIdA = Find(nIdA);
+        nIdB = Find(nIdB);
+        if (nIdA == nIdB)
+            return;
+        if (vSize[nIdA] < vSize[nIdB])
+            swap(nIdA, nIdB);
+        vParent[nIdB] = nIdA;
+        vSize[nIdA] += vSize[nIdB];
+    }
 
+    void GetSets(set< set<CTxDestination> >& setRet)
+    {
+        map<int, set<CTxDestination> > mapSets;
+        for (map<CTxDestination, int>::const_iterator it = mapIds.begin(); it != mapIds.end(); ++it)
+            mapSets[Find((*it).second)].insert((*it).first);
+        setRet.clear();
+        for (map<int, set<CTxDestination> >::const_iterator it = mapSets.begin(); it != mapSets.end(); ++it)
+            setRet.insert((*it).second);
+    }
+};
+
+// Addresses used as inputs of the same transaction, together with the change
+// it sends back, belong to the same owner
 set< set<CTxDestination> > CWallet::GetAddressGroupings()
 {
-    set< set<CTxDestination> > groupings;
-    set<CTxDestination> grouping;
+    LOCK(cs_wallet);
+    if (fAddressGroupingsValid && nAddressGroupingsBookSize == mapAddressBook.size())
+        return setAddressGroupings;
 
-    BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+    CAddressGroupingSets groupings;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
-        CWalletTx *pcoin = &walletEntry.second;
+        const CWalletTx* pcoin = &(*it).second;
 
         if (pcoin->vin.size() > 0)
         {
-            bool any_mine = false;
             // group all input addresses with each other
-            BOOST_FOREACH(CTxIn txin, pcoin->vin)
+            int nGroup = -1;
+            BOOST_FOREACH(const CTxIn& txin, pcoin->vin)
             {
                 CTxDestination address;
-                if(!IsMine(txin)) /* If this input isn't mine, ignore it */
+                map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
+                if (mi == mapWallet.end() || txin.prevout.n >= (*mi).second.vout.size())
                     continue;
-                if(!ExtractDestination(mapWallet[txin.prevout.hash].vout[txin.prevout.n].scriptPubKey, address))
+                const CTxOut& prevout = (*mi).second.vout[txin.prevout.n];
+                if (!IsMine(prevout)) /* If this input isn't mine, ignore it */
                     continue;
-                grouping.insert(address);
-                any_mine = true;
+                if (!ExtractDestination(prevout.scriptPubKey, address))
+                    continue;
+                int nId = groupings.GetId(address);
+                if (nGroup == -1)
+                    nGroup = nId;
+                else
+                    groupings.Union(nGroup, nId);
             }
 
             // group change with input addresses
-            if (any_mine)
+            if (nGroup != -1)
             {
-               BOOST_FOREACH(CTxOut txout, pcoin->vout)
-                   if (IsChange(txout))
-                   {
-                       CTxDestination txoutAddr;
-                       if(!ExtractDestination(txout.scriptPubKey, txoutAddr))
-                           continue;
-                       grouping.insert(txoutAddr);
-                   }
-            }
-            if (grouping.size() > 0)
-            {
-                groupings.insert(grouping);
-                grouping.clear();
+                BOOST_FOREACH(const CTxOut& txout, pcoin->vout)
+                    if (IsChange(txout))
+                    {
+                        CTxDestination txoutAddr;
+                        if (!ExtractDestination(txout.scriptPubKey, txoutAddr))
+                            continue;
+                        groupings.Union(nGroup, groupings.GetId(txoutAddr));
+                    }
             }
         }
 
@@ -2078,48 +2679,16 @@ set< set<CTxDestination> > CWallet::GetAddressGroupings()
             if (IsMine(pcoin->vout[i]))
             {
                 CTxDestination address;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, address))
+                if (!ExtractDestination(pcoin->vout[i].scriptPubKey, address))
                     continue;
-                grouping.insert(address);
-                groupings.insert(grouping);
-                grouping.clear();
+                groupings.GetId(address);
             }
     }
 
-    set< set<CTxDestination>* > uniqueGroupings; // a set of pointers to groups of addresses
-    map< CTxDestination, set<CTxDestination>* > setmap;  // map addresses to the unique group containing it
-    BOOST_FOREACH(set<CTxDestination> grouping, groupings)
-    {
-        // make a set of all the groups hit by this new group
-        set< set<CTxDestination>* > hits;
-        map< CTxDestination, set<CTxDestination>* >::iterator it;
-        BOOST_FOREACH(CTxDestination address, grouping)
-            if ((it = setmap.find(address)) != setmap.end())
-                hits.insert((*it).second);
-
-        // merge all hit groups into a new single group and delete old groups
-        set<CTxDestination>* merged = new set<CTxDestination>(grouping);
-        BOOST_FOREACH(set<CTxDestination>* hit, hits)
-        {
-            merged->insert(hit->begin(), hit->end());
-            uniqueGroupings.erase(hit);
-            delete hit;
-        }
-        uniqueGroupings.insert(merged);
-
-        // update setmap
-        BOOST_FOREACH(CTxDestination element, *merged)
-            setmap[element] = merged;
-    }
-
-    set< set<CTxDestination> > ret;
-    BOOST_FOREACH(set<CTxDestination>* uniqueGrouping, uniqueGroupings)
-    {
-        ret.insert(*uniqueGrouping);
-        delete uniqueGrouping;
-    }
-
-    return ret;
+    groupings.GetSets(setAddressGroupings);
+    fAddressGroupingsValid = true;
+    nAddressGroupingsBookSize = mapAddressBook.size();
+    return setAddressGroupings;
 }
 
 // trollocoin: check 'spent' consistency between wallet and txindex
@@ -2142,9 +2711,11 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64& nBalanceInQuestion, bool
         CTxIndex txindex;
         if (!txdb.ReadTxIndex(pcoin->GetHash(), txindex))
             continue;
+        CCoins coins;
+        txdb.ReadCoins(pcoin->GetHash(), coins);
         for (int n=0; n < pcoin->vout.size(); n++)
         {
-            if (IsMine(pcoin->vout[n]) && pcoin->IsSpent(n) && (txindex.vSpent.size() <= n || txindex.vSpent[n].IsNull()))
+            if (IsMine(pcoin->vout[n]) && pcoin->IsSpent(n) && coins.IsAvailable(n))
             {
                 printf("FixSpentCoins found lost coin %sxpy %s[%d], %s\n",
                     FormatMoney(pcoin->vout[n].nValue).c_str(), pcoin->GetHash().ToString().c_str(), n, fCheckOnly? "repair not attempted" : "repairing");
@@ -2154,9 +2725,10 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64& nBalanceInQuestion, bool
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdatedCoins(pcoin->GetHash());
                 }
             }
-            else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
+            else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && !coins.IsAvailable(n))
             {
                 printf("FixSpentCoins found spent coin %sxpy %s[%d], %s\n",
                     FormatMoney(pcoin->vout[n].nValue).c_str(), pcoin->GetHash().ToString().c_str(), n, fCheckOnly? "repair not attempted" : "repairing");
@@ -2166,6 +2738,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64& nBalanceInQuestion, bool
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdatedCoins(pcoin->GetHash());
                 }
             }
         }
@@ -2189,11 +2762,316 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdatedCoins(prev.GetHash());
             }
         }
     }
 }
 
+// trollocoin: add the wallet's transactions of a connected block, writing
+// them to the database in one batch
+void CWallet::BlockConnected(const CBlock& block)
+{
+    LOCK(cs_wallet);
+    auto_ptr<CWalletDBBatch> pwalletdbBatch(fFileBacked ? new CWalletDBBatch(strWalletFile) : NULL);
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        AddToWalletIfInvolvingMe(tx, &block, true);
+    if (pwalletdbBatch.get() && !pwalletdbBatch->Commit(true))
+        printf("ERROR: CWallet::BlockConnected() : writing the wallet transactions of block %s failed\n", block.GetHash().ToString().substr(0,20).c_str());
+}
+
+// trollocoin: the stake modifiers of outputs confirmed shortly before a
+// disconnected block may change with the new best chain
+void CWallet::BlockDisconnected(const CBlock& block)
+{
+    LOCK(cs_wallet);
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        EraseStakeCandidates(tx.GetHash());
+        UpdatedCoins(tx.GetHash());
+    }
+    for (map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.begin(); it != mapStakeCandidates.end(); ++it)
+        (*it).second.fStakeModifier = false;
+}
+
+// trollocoin: kernel inputs of a wallet output, requires cs_main and cs_wallet.
+// The tx index and block header are only read the first time an output is
+// looked up, the stake modifier is filled in once the chain is long enough.
+const CStakeCandidate* CWallet::GetStakeCandidate(const CWalletTx* pcoin, unsigned int n)
+{
+    COutPoint prevout(pcoin->GetHash(), n);
+    map<COutPoint, CStakeCandidate>::iterator mi = mapStakeCandidates.find(prevout);
+    if (mi != mapStakeCandidates.end())
+    {
+        // Forget outputs of blocks that are no longer in the best chain
+        map<uint256, CBlockIndex*>::iterator miBlock = mapBlockIndex.find((*mi).second.hashBlockFrom);
+        if (miBlock == mapBlockIndex.end() || !(*miBlock).second->IsInMainChain())
+        {
+            mapStakeCandidates.erase(mi);
+            mi = mapStakeCandidates.end();
+        }
+    }
+
+    if (mi == mapStakeCandidates.end())
+    {
+        CTxDB txdb("r");
+        CTxIndex txindex;
+        if (!txdb.ReadTxIndex(prevout.hash, txindex))
+            return NULL;
+
+        // Block header, from the block index when the wallet knows the block
+        // of the transaction
+        CStakeCandidate candidate;
+        unsigned int nTimeBlockFrom;
+        map<uint256, CBlockIndex*>::iterator miBlock = mapBlockIndex.find(pcoin->hashBlock);
+        if (miBlock != mapBlockIndex.end() && (*miBlock).second->nFile == txindex.pos.nFile && (*miBlock).second->nBlockPos == txindex.pos.nBlockPos)
+        {
+            candidate.hashBlockFrom = (*miBlock).first;
+            nTimeBlockFrom = (*miBlock).second->GetBlockTime();
+        }
+        else
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                return NULL;
+            candidate.hashBlockFrom = block.GetHash();
+            nTimeBlockFrom = block.GetBlockTime();
+        }
+        candidate.kernel = CStakeKernel(0, nTimeBlockFrom, txindex.pos.nTxPos - txindex.pos.nBlockPos, pcoin->nTime, prevout, pcoin->vout[n].nValue);
+        mi = mapStakeCandidates.insert(make_pair(prevout, candidate)).first;
+    }
+
+    CStakeCandidate& candidate = (*mi).second;
+    if (!candidate.fStakeModifier)
+    {
+        int nStakeModifierHeight = 0;
+        int64 nStakeModifierTime = 0;
+        candidate.fStakeModifier = GetKernelStakeModifier(candidate.hashBlockFrom, candidate.kernel.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false);
+    }
+    return &candidate;
+}
+
+void CWallet::EraseStakeCandidates(const uint256& hashTx)
+{
+    LOCK(cs_wallet);
+    map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.lower_bound(COutPoint(hashTx, 0));
+    while (it != mapStakeCandidates.end() && (*it).first.hash == hashTx)
+        mapStakeCandidates.erase(it++);
+}
+
+// trollocoin: the outputs of a transaction may have been spent, confirmed or
+// orphaned, the balance ledger and stake weight look at it on the next update
+void CWallet::UpdatedCoins(const uint256& hashTx)
+{
+    {
+        LOCK(cs_wallet);
+        if (!fLedgerRebuild)
+            setLedgerUpdated.insert(hashTx);
+    }
+    {
+        LOCK(cs_stakeweight);
+        if (!fStakeWeightRebuild)
+            setStakeWeightUpdated.insert(hashTx);
+    }
+}
+
+// trollocoin: update the stake weight buckets with the transactions changed
+// since the last update, requires cs_main and cs_wallet
+void CWallet::SyncStakeWeight()
+{
+    LOCK(cs_stakeweight);
+    if (fStakeWeightRebuild)
+    {
+        stakeWeight.SetNull();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            AddStakeWeightCoins((*it).second);
+        fStakeWeightRebuild = false;
+    }
+    else
+    {
+        BOOST_FOREACH(const uint256& hash, setStakeWeightUpdated)
+        {
+            stakeWeight.EraseCoins(hash);
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+            if (mi != mapWallet.end())
+                AddStakeWeightCoins((*mi).second);
+        }
+    }
+    setStakeWeightUpdated.clear();
+}
+
+// Unspent outputs of a transaction in the best chain, the same outputs
+// SelectCoins offers for staking once they are mature
+void CWallet::AddStakeWeightCoins(const CWalletTx& wtx)
+{
+    if (wtx.hashBlock == 0 || wtx.nIndex == -1)
+        return;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+        return;
+
+    // GetBlocksToMaturity() reaches 0 at this height
+    int nHeightMature = (*mi).second->nHeight;
+    if (wtx.IsCoinBase() || wtx.IsCoinStake())
+        nHeightMature += nCoinbaseMaturity + 19;
+
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]) && wtx.vout[i].nValue > 0)
+            stakeWeight.AddCoin(COutPoint(hash, i), wtx.vout[i].nValue, wtx.nTime, nHeightMature);
+}
+
+template<typename K>
+static void EraseFromQueue(multimap<K, COutPoint>& mapQueue, K key, const COutPoint& prevout)
+{
+    typename multimap<K, COutPoint>::iterator it = mapQueue.lower_bound(key);
+    for (; it != mapQueue.end() && (*it).first == key; ++it)
+    {
+        if ((*it).second == prevout)
+        {
+            mapQueue.erase(it);
+            return;
+        }
+    }
+}
+
+void CStakeWeight::SetNull()
+{
+    mapCoins.clear();
+    mapHeightQueue.clear();
+    mapTimeQueue.clear();
+    nTime = 0;
+    nHeight = -1;
+    nValueMature = 0;
+    bnValueGrowing = 0;
+    bnValueTimeGrowing = 0;
+    nWeightMax = 0;
+}
+
+// Put an output into the bucket for its age at nTime and queue it for the
+// next time or height it changes buckets
+void CStakeWeight::Insert(const COutPoint& prevout, CCoin& coin)
+{
+    if (nHeight < coin.nHeightMature)
+    {
+        coin.nState = COIN_IMMATURE;
+        mapHeightQueue.insert(make_pair(coin.nHeightMature, prevout));
+        return;
+    }
+
+    nValueMature += coin.nValue;
+    int64 nTimeWeight = nTime - coin.nTime - STAKE_MIN_AGE;
+    if (nTimeWeight <= 0)
+    {
+        coin.nState = COIN_YOUNG;
+        mapTimeQueue.insert(make_pair(coin.nTime + STAKE_MIN_AGE + 1, prevout));
+    }
+    else if (nTimeWeight < STAKE_MAX_AGE)
+    {
+        coin.nState = COIN_GROWING;
+        bnValueGrowing += coin.nValue;
+        bnValueTimeGrowing += CBigNum(coin.nValue) * (coin.nTime + STAKE_MIN_AGE);
+        mapTimeQueue.insert(make_pair(coin.nTime + STAKE_MIN_AGE + STAKE_MAX_AGE, prevout));
+    }
+    else
+    {
+        coin.nState = COIN_MAX;
+        nWeightMax += coin.nMaxWeight;
+    }
+}
+
+void CStakeWeight::Remove(const COutPoint& prevout, CCoin& coin)
+{
+    if (coin.nState == COIN_IMMATURE)
+    {
+        EraseFromQueue(mapHeightQueue, coin.nHeightMature, prevout);
+        return;
+    }
+
+    nValueMature -= coin.nValue;
+    if (coin.nState == COIN_YOUNG)
+        EraseFromQueue(mapTimeQueue, coin.nTime + STAKE_MIN_AGE + 1, prevout);
+    else if (coin.nState == COIN_GROWING)
+    {
+        bnValueGrowing -= coin.nValue;
+        bnValueTimeGrowing -= CBigNum(coin.nValue) * (coin.nTime + STAKE_MIN_AGE);
+        EraseFromQueue(mapTimeQueue, coin.nTime + STAKE_MIN_AGE + STAKE_MAX_AGE, prevout);
+    }
+    else
+        nWeightMax -= coin.nMaxWeight;
+}
+
+void CStakeWeight::AddCoin(const COutPoint& prevout, int64 nValue, int64 nTime, int nHeightMature)
+{
+    pair<map<COutPoint, CCoin>::iterator, bool> ret = mapCoins.insert(make_pair(prevout, CCoin()));
+    CCoin& coin = (*ret.first).second;
+    if (!ret.second)
+        Remove(prevout, coin);
+    coin.nValue = nValue;
+    coin.nTime = nTime;
+    coin.nHeightMature = nHeightMature;
+    CBigNum bnMaxWeight = CBigNum(nValue) * STAKE_MAX_AGE / COIN / (24 * 60 * 60);
+    coin.nMaxWeight = bnMaxWeight.getuint64();
+    Insert(prevout, coin);
+}
+
+void CStakeWeight::EraseCoins(const uint256& hashTx)
+{
+    map<COutPoint, CCoin>::iterator it = mapCoins.lower_bound(COutPoint(hashTx, 0));
+    while (it != mapCoins.end() && (*it).first.hash == hashTx)
+    {
+        Remove((*it).first, (*it).second);
+        mapCoins.erase(it++);
+    }
+}
+
+// Move the outputs that changed buckets since the last call, all outputs are
+// put into new buckets if time or height went back
+void CStakeWeight::SetTime(int64 nTimeIn, int nHeightIn)
+{
+    if (nTimeIn < nTime || nHeightIn < nHeight)
+    {
+        mapHeightQueue.clear();
+        mapTimeQueue.clear();
+        nValueMature = 0;
+        bnValueGrowing = 0;
+        bnValueTimeGrowing = 0;
+        nWeightMax = 0;
+        nTime = nTimeIn;
+        nHeight = nHeightIn;
+        for (map<COutPoint, CCoin>::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
+            Insert((*it).first, (*it).second);
+        return;
+    }
+
+    nTime = nTimeIn;
+    nHeight = nHeightIn;
+    while (!mapHeightQueue.empty() && (*mapHeightQueue.begin()).first <= nHeight)
+    {
+        COutPoint prevout = (*mapHeightQueue.begin()).second;
+        CCoin& coin = mapCoins[prevout];
+        Remove(prevout, coin);
+        Insert(prevout, coin);
+    }
+    while (!mapTimeQueue.empty() && (*mapTimeQueue.begin()).first <= nTime)
+    {
+        COutPoint prevout = (*mapTimeQueue.begin()).second;
+        CCoin& coin = mapCoins[prevout];
+        Remove(prevout, coin);
+        Insert(prevout, coin);
+    }
+}
+
+// Weight in coin days as GetStakeWeight used to sum it per output, growing
+// outputs are rounded down once for the whole bucket
+void CStakeWeight::GetWeight(uint64& nMinWeightRet, uint64& nMaxWeightRet, uint64& nWeightRet) const
+{
+    CBigNum bnMinWeight = (bnValueGrowing * nTime - bnValueTimeGrowing) / COIN / (24 * 60 * 60);
+    nMinWeightRet = bnMinWeight.getuint64();
+    nMaxWeightRet = nWeightMax;
+    nWeightRet = nMinWeightRet + nMaxWeightRet;
+}
+
 CPubKey CReserveKey::GetReservedKey()
 {
     if (nIndex == -1)
@@ -2278,58 +3156,171 @@ int64 GetWeight(int64 nIntervalBeginning, int64 nIntervalEnd)
 
 bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64& nMinWeight, uint64& nMaxWeight, uint64& nWeight)
 {
-    // Choose coins to use
-    int64 nBalance = GetBalance();
-
     int64 nReserveBalance = 0;
     if (mapArgs.count("-reservebalance") && !ParseMoney(mapArgs["-reservebalance"], nReserveBalance))
         return error("GetStakeWeight : invalid reserve balance amount");
 
-    if (nBalance <= nReserveBalance)
+    // Pick up changed transactions unless the wallet is busy, the buckets of
+    // the last update are used in that case
+    bool fRebuild, fUpdated;
+    {
+        LOCK(cs_stakeweight);
+        fRebuild = fStakeWeightRebuild;
+        fUpdated = !setStakeWeightUpdated.empty();
+    }
+    if (fRebuild)
+    {
+        LOCK2(cs_main, cs_wallet);
+        SyncStakeWeight();
+    }
+    else if (fUpdated)
+    {
+        TRY_LOCK(cs_main, lockMain);
+        if (lockMain)
+        {
+            TRY_LOCK(cs_wallet, lockWallet);
+            if (lockWallet)
+                SyncStakeWeight();
+        }
+    }
+
+    LOCK(cs_stakeweight);
+    stakeWeight.SetTime(GetTime(), nBestHeight);
+    if (stakeWeight.GetValue() <= nReserveBalance)
         return false;
 
-    vector<const CWalletTx*> vwtxPrev;
+    uint64 nMinWeightCoins, nMaxWeightCoins, nWeightCoins;
+    stakeWeight.GetWeight(nMinWeightCoins, nMaxWeightCoins, nWeightCoins);
+    nMinWeight += nMinWeightCoins;
+    nMaxWeight += nMaxWeightCoins;
+    nWeight += nWeightCoins;
+    return true;
+}
 
-    set<pair<const CWalletTx*,unsigned int> > setCoins;
-    int64 nValueIn = 0;
+void CWalletFilter::SetNull()
+{
+    vData.clear();
+    nHashFuncs = 0;
+    nTweak = 0;
+    nElements = 0;
+    nCapacity = 0;
+}
 
-    if (!SelectCoins(nBalance - nReserveBalance, GetTime(), setCoins, nValueIn))
-        return false;
+// About 0.1% false positives with nCapacityIn elements in the filter
+void CWalletFilter::Reset(unsigned int nCapacityIn)
+{
+    vData.assign((nCapacityIn * 15 + 7) / 8, 0);
+    nHashFuncs = 10;
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nElements = 0;
+    nCapacity = nCapacityIn;
+}
 
-    if (setCoins.empty())
-        return false;
+// The elements are hashes already, so their own first bytes pick the bits
+// of the filter. The random tweak keeps the bits from being known to others.
+void CWalletFilter::Insert(const unsigned char* pch)
+{
+    if (vData.empty())
+        return;
+    unsigned int nBit, nStep;
+    memcpy(&nBit, pch, sizeof(nBit));
+    memcpy(&nStep, pch + sizeof(nBit), sizeof(nStep));
+    nBit ^= nTweak;
+    nStep |= 1;
+    unsigned int nBits = vData.size() * 8;
+    for (unsigned int i = 0; i < nHashFuncs; i++, nBit += nStep)
+        vData[(nBit % nBits) >> 3] |= (1 << ((nBit % nBits) & 7));
+    nElements++;
+}
 
-    CTxDB txdb("r");
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+bool CWalletFilter::Contains(const unsigned char* pch) const
+{
+    if (vData.empty())
+        return true;
+    unsigned int nBit, nStep;
+    memcpy(&nBit, pch, sizeof(nBit));
+    memcpy(&nStep, pch + sizeof(nBit), sizeof(nStep));
+    nBit ^= nTweak;
+    nStep |= 1;
+    unsigned int nBits = vData.size() * 8;
+    for (unsigned int i = 0; i < nHashFuncs; i++, nBit += nStep)
+        if (!(vData[(nBit % nBits) >> 3] & (1 << ((nBit % nBits) & 7))))
+            return false;
+    return true;
+}
+
+// IsMine needs one of the wallet's key ids or script ids in the script: a
+// 20 byte push is a key id or script id, a push Solver takes for a public key
+// is hashed to its key id.
+bool CWalletFilter::MayBeMine(const CScript& scriptPubKey) const
+{
+    if (vData.empty())
+        return true;
+    CScript::const_iterator pc = scriptPubKey.begin();
+    opcodetype opcode;
+    vector<unsigned char> vch;
+    while (pc < scriptPubKey.end())
     {
-        CTxIndex txindex;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                continue;
-        }
+        if (!scriptPubKey.GetOp(pc, opcode, vch))
+            return false;
+        if (vch.size() == 20 && contains(uint160(vch)))
+            return true;
+        if (vch.size() >= 33 && vch.size() <= 120 && contains(Hash160(vch)))
+            return true;
+    }
+    return false;
+}
 
-        int64 nTimeWeight = GetWeight((int64)pcoin.first->nTime, (int64)GetTime());
-        CBigNum bnCoinDayWeight = CBigNum(pcoin.first->vout[pcoin.second].nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+// trollocoin: keep the wallet filter in step with the keystore and mapWallet
+void CWallet::AddToFilter(const uint160& hash)
+{
+    LOCK(cs_wallet);
+    if (fFilterRebuild)
+        return;
+    filter.insert(hash);
+    fFilterRebuild = filter.IsFull();
+}
 
-        // Weight is greater than zero
-        if (nTimeWeight > 0)
-        {
-            nWeight += bnCoinDayWeight.getuint64();
-        }
+void CWallet::AddToFilter(const uint256& hash)
+{
+    LOCK(cs_wallet);
+    if (fFilterRebuild)
+        return;
+    filter.insert(hash);
+    fFilterRebuild = filter.IsFull();
+}
 
-        // Weight is greater than zero, but the maximum value isn't reached yet
-        if (nTimeWeight > 0 && nTimeWeight < STAKE_MAX_AGE)
-        {
-            nMinWeight += bnCoinDayWeight.getuint64();
-        }
+// trollocoin: requires cs_wallet. Erased transactions stay in the filter as
+// false positives until it is rebuilt.
+void CWallet::RebuildFilter()
+{
+    set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    set<CScriptID> setScripts;
+    GetCScripts(setScripts);
 
-        // Maximum weight was reached
-        if (nTimeWeight == STAKE_MAX_AGE)
-        {
-            nMaxWeight += bnCoinDayWeight.getuint64();
-        }
-    }
+    // Room for as many elements again before the next rebuild
+    filter.Reset(2 * (setKeys.size() + setScripts.size() + mapWallet.size()) + 1000);
+    BOOST_FOREACH(const CKeyID& keyID, setKeys)
+        filter.insert(keyID);
+    BOOST_FOREACH(const CScriptID& scriptID, setScripts)
+        filter.insert(scriptID);
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        filter.insert(item.first);
+    fFilterRebuild = false;
+}
 
-    return true;
+// trollocoin: false only if tx is neither IsMine nor IsFromMe and spends
+// nothing of the wallet, requires cs_wallet
+bool CWallet::MayInvolveMe(const CTransaction& tx)
+{
+    if (fFilterRebuild)
+        RebuildFilter();
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (filter.contains(txin.prevout.hash))
+            return true;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        if (filter.MayBeMine(txout.scriptPubKey))
+            return true;
+    return false;
 }
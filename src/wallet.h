@@ -8,6 +8,7 @@
 #define BITCOIN_WALLET_H
 
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -59,6 +60,214 @@ public:
     )
 };
 
+/** A key for the key pool, generated outside cs_wallet and encrypted already
+ * if the wallet is */
+class CPoolKey
+{
+public:
+    CKey key;
+    CPubKey vchPubKey;
+    CPrivKey vchPrivKey;                            // unencrypted wallets
+    std::vector<unsigned char> vchCryptedSecret;    // encrypted wallets
+};
+
+/** Kernel inputs of a wallet output that may stake, cached so that the kernel
+ * search doesn't need to read the tx index or block headers from disk.
+ */
+class CStakeCandidate
+{
+public:
+    uint256 hashBlockFrom;
+    CStakeKernel kernel;
+    bool fStakeModifier; // kernel.nStakeModifier is known
+
+    CStakeCandidate()
+    {
+        hashBlockFrom = 0;
+        fStakeModifier = false;
+    }
+};
+
+/** Stake weight of a set of outputs, bucketed by coin age. Outputs only move
+ * between buckets when they mature, pass the minimum stake age or reach
+ * STAKE_MAX_AGE, so the weight at a later time doesn't need a pass over all
+ * outputs.
+ */
+class CStakeWeight
+{
+private:
+    enum
+    {
+        COIN_IMMATURE, // waiting for coinbase/coinstake maturity
+        COIN_YOUNG,    // mature, younger than STAKE_MIN_AGE
+        COIN_GROWING,  // weight grows with age
+        COIN_MAX       // full weight
+    };
+
+    class CCoin
+    {
+    public:
+        int64 nValue;
+        int64 nTime;
+        int nHeightMature;
+        uint64 nMaxWeight;
+        int nState;
+    };
+
+    std::map<COutPoint, CCoin> mapCoins;
+    std::multimap<int, COutPoint> mapHeightQueue;
+    std::multimap<int64, COutPoint> mapTimeQueue;
+
+    // time and height the buckets are for
+    int64 nTime;
+    int nHeight;
+
+    int64 nValueMature;
+    CBigNum bnValueGrowing;
+    CBigNum bnValueTimeGrowing; // sum of nValue * (nTime + STAKE_MIN_AGE)
+    uint64 nWeightMax;
+
+    void Insert(const COutPoint& prevout, CCoin& coin);
+    void Remove(const COutPoint& prevout, CCoin& coin);
+
+public:
+    CStakeWeight()
+    {
+        SetNull();
+    }
+
+    void SetNull();
+    void AddCoin(const COutPoint& prevout, int64 nValue, int64 nTime, int nHeightMature);
+    void EraseCoins(const uint256& hashTx);
+    void SetTime(int64 nTimeIn, int nHeightIn);
+    int64 GetValue() const { return nValueMature; }
+    void GetWeight(uint64& nMinWeightRet, uint64& nMaxWeightRet, uint64& nWeightRet) const;
+    unsigned int size() const { return mapCoins.size(); }
+};
+
+/** A spendable output in the wallet's coin index, ordered by value */
+class CLedgerCoin
+{
+public:
+    int64 nValue;
+    COutPoint prevout;
+    const CWalletTx* pcoin;
+    unsigned int nTime;
+    int nHeight; // height of the block with the transaction, -1 if unconfirmed
+    bool fFromMe;
+
+    CLedgerCoin(int64 nValueIn=0, const COutPoint& prevoutIn=COutPoint(0, 0))
+    {
+        nValue = nValueIn;
+        prevout = prevoutIn;
+        pcoin = NULL;
+        nTime = 0;
+        nHeight = -1;
+        fFromMe = false;
+    }
+
+    int GetDepthInMainChain() const
+    {
+        return nHeight == -1 ? 0 : nBestHeight - nHeight + 1;
+    }
+
+    friend bool operator<(const CLedgerCoin& a, const CLedgerCoin& b)
+    {
+        return (a.nValue < b.nValue || (a.nValue == b.nValue && a.prevout < b.prevout));
+    }
+};
+
+/** Balances of the wallet summed per transaction. A transaction's share only
+ * changes when it is updated, confirmed or orphaned, when its coinbase or
+ * coinstake matures, or while it is unconfirmed, so the totals are kept up to
+ * date by looking at those transactions only.
+ */
+class CWalletLedger
+{
+public:
+    class CEntry
+    {
+    public:
+        int64 nBalance;
+        int64 nUnconfirmed;
+        int64 nStake;
+        int64 nNewMint;
+        std::vector<std::pair<CTxDestination, int64> > vAddressBalances;
+        std::vector<CLedgerCoin> vCoins; // outputs SelectCoins may spend
+        int nHeightMature; // coinbase or coinstake in the best chain, -1 otherwise
+        bool fVolatile;    // unconfirmed or not final
+
+        CEntry()
+        {
+            nBalance = 0;
+            nUnconfirmed = 0;
+            nStake = 0;
+            nNewMint = 0;
+            nHeightMature = -1;
+            fVolatile = false;
+        }
+    };
+
+    std::map<uint256, CEntry> mapEntries;
+    std::set<uint256> setVolatile;
+    std::set<std::pair<int, uint256> > setMaturity;
+
+    int64 nBalance;
+    int64 nUnconfirmed;
+    int64 nStake;
+    int64 nNewMint;
+    std::map<CTxDestination, std::pair<int64, int> > mapAddressBalances; // balance, outputs
+    std::set<CLedgerCoin> setCoins;
+    int nHeight;
+
+    CWalletLedger()
+    {
+        SetNull();
+    }
+
+    void SetNull();
+    void Set(const uint256& hashTx, const CEntry& entry);
+    void Erase(const uint256& hashTx);
+    void GetMaturityChanges(int nHeightIn, std::set<uint256>& setRet) const;
+};
+
+/** Bloom filter over the key ids and script ids of a wallet and the hashes of
+ * its transactions. A transaction whose outputs and inputs all miss the filter
+ * is neither IsMine nor IsFromMe, so it is turned away without solving its
+ * scripts. False positives only cost the full checks.
+ */
+class CWalletFilter
+{
+private:
+    std::vector<unsigned char> vData;
+    unsigned int nHashFuncs;
+    unsigned int nTweak;
+    unsigned int nElements;
+    unsigned int nCapacity;
+
+    void Insert(const unsigned char* pch);
+    bool Contains(const unsigned char* pch) const;
+
+public:
+    CWalletFilter()
+    {
+        SetNull();
+    }
+
+    void SetNull();
+    void Reset(unsigned int nCapacityIn);
+    bool IsNull() const { return vData.empty(); }
+    bool IsFull() const { return nElements >= nCapacity; }
+
+    void insert(const uint160& hash) { Insert((const unsigned char*)BEGIN(hash)); }
+    void insert(const uint256& hash) { Insert((const unsigned char*)BEGIN(hash)); }
+    bool contains(const uint160& hash) const { return Contains((const unsigned char*)BEGIN(hash)); }
+    bool contains(const uint256& hash) const { return Contains((const unsigned char*)BEGIN(hash)); }
+
+    // False only if IsMine is false for scriptPubKey
+    bool MayBeMine(const CScript& scriptPubKey) const;
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -66,6 +275,10 @@ class CWallet : public CCryptoKeyStore
 {
 private:
     bool SelectCoins(int64 nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
+    bool IsSelectable(const CLedgerCoin& coin, unsigned int nSpendTime, int nConfMine, int nConfTheirs) const
+    {
+        return (coin.nTime <= nSpendTime && coin.GetDepthInMainChain() >= (coin.fFromMe ? nConfMine : nConfTheirs));
+    }
 
     CWalletDB *pwalletdbEncryption;
 
@@ -75,8 +288,45 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // trollocoin: stake weight of the wallet's outputs and transactions
+    // changed since it was last updated, guarded by cs_stakeweight
+    CStakeWeight stakeWeight;
+    std::set<uint256> setStakeWeightUpdated;
+    bool fStakeWeightRebuild;
+
+    void AddStakeWeightCoins(const CWalletTx& wtx);
+
+    // trollocoin: balances per transaction and transactions changed since
+    // the ledger was last updated, guarded by cs_wallet
+    mutable CWalletLedger ledger;
+    mutable std::set<uint256> setLedgerUpdated;
+    mutable bool fLedgerRebuild;
+
+    void GetLedgerEntry(const CWalletTx& wtx, CWalletLedger::CEntry& entry) const;
+    void UpdateLedger() const;
+
+    // trollocoin: result of GetAddressGroupings() until a transaction is
+    // added or erased or the address book changes, guarded by cs_wallet
+    std::set< std::set<CTxDestination> > setAddressGroupings;
+    bool fAddressGroupingsValid;
+    unsigned int nAddressGroupingsBookSize;
+
+    // trollocoin: filter over what makes a transaction the wallet's, rebuilt
+    // when it gets full, guarded by cs_wallet
+    CWalletFilter filter;
+    bool fFilterRebuild;
+
+    bool GeneratePoolKeys(std::vector<CPoolKey>& vKeys);
+    CPubKey AddPoolKey(const CPoolKey& poolkey);
+
+    void AddToFilter(const uint160& hash);
+    void AddToFilter(const uint256& hash);
+    void RebuildFilter();
+    bool MayInvolveMe(const CTransaction& tx);
+
 public:
     mutable CCriticalSection cs_wallet;
+    mutable CCriticalSection cs_stakeweight;
 
     bool fFileBacked;
     std::string strWalletFile;
@@ -95,6 +345,10 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        fStakeWeightRebuild = true;
+        fLedgerRebuild = true;
+        fAddressGroupingsValid = false;
+        fFilterRebuild = true;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -104,6 +358,10 @@ public:
         fFileBacked = true;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        fStakeWeightRebuild = true;
+        fLedgerRebuild = true;
+        fAddressGroupingsValid = false;
+        fFilterRebuild = true;
     }
 
     // Treefunder Additions
@@ -111,11 +369,18 @@ public:
     std::map<CTxDestination, int64> GetAddressBalances();
 
     std::map<uint256, CWalletTx> mapWallet;
+    // trollocoin: mapWallet ordered by the time each transaction was received,
+    // so the most recent transactions can be listed without sorting the wallet
+    typedef std::set<std::pair<int64, uint256> > TxTimeIndex;
+    TxTimeIndex setWalletByTime;
     std::vector<uint256> vWalletUpdated;
     std::vector<uint256> vMintingWalletUpdated;
 
     std::map<uint256, int> mapRequestCount;
 
+    // trollocoin: kernel inputs of staked and staking outputs
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+
     std::map<CTxDestination, std::string> mapAddressBook;
 
     CPubKey vchDefaultKey;
@@ -290,6 +555,14 @@ public:
 
     void FixSpentCoins(int& nMismatchSpent, int64& nBalanceInQuestion, bool fCheckOnly = false);
     void DisableTransaction(const CTransaction &tx);
+    void BlockConnected(const CBlock& block);
+    void BlockDisconnected(const CBlock& block);
+
+    const CStakeCandidate* GetStakeCandidate(const CWalletTx* pcoin, unsigned int n);
+    void EraseStakeCandidates(const uint256& hashTx);
+
+    void UpdatedCoins(const uint256& hashTx);
+    void SyncStakeWeight();
 
     bool GetStakeWeight(const CKeyStore& keystore, uint64& nMinWeight, uint64& nMaxWeight, uint64& nWeight);
 
@@ -323,6 +596,105 @@ public:
 };
 
 
+/** Serializes the supporting transactions of a CWalletTx. When read with
+ * SER_DEFERPREV only their serialized form is kept, and
+ * CWalletTx::ReadSupportingTransactions unserializes it when it is needed.
+ * A deferred form is written back as it was read.
+ */
+class CWalletTxPrev
+{
+protected:
+    std::vector<CMerkleTx>& vtxPrev;
+    std::vector<char>& vchDeferred;
+
+    template<typename Stream>
+    void ReadRaw(Stream& s, uint64 nSize)
+    {
+        if (nSize > (uint64)MAX_SIZE)
+            throw std::ios_base::failure("CWalletTxPrev::ReadRaw() : size too large");
+        if (nSize == 0)
+            return;
+        unsigned int nPos = vchDeferred.size();
+        vchDeferred.resize(nPos + nSize);
+        s.read(&vchDeferred[nPos], nSize);
+    }
+
+    template<typename Stream>
+    uint64 ReadRawCompactSize(Stream& s)
+    {
+        unsigned int nPos = vchDeferred.size();
+        ReadRaw(s, 1);
+        unsigned char chSize = vchDeferred[nPos];
+        if (chSize < 253)
+            return chSize;
+        unsigned int nBytes = (chSize == 253 ? 2 : chSize == 254 ? 4 : 8);
+        ReadRaw(s, nBytes);
+        uint64 nSize = 0;
+        for (unsigned int i = 0; i < nBytes; i++)
+            nSize |= (uint64)(unsigned char)vchDeferred[nPos + 1 + i] << (8 * i);
+        if (nSize > (uint64)MAX_SIZE)
+            throw std::ios_base::failure("CWalletTxPrev::ReadRawCompactSize() : size too large");
+        return nSize;
+    }
+
+public:
+    CWalletTxPrev(std::vector<CMerkleTx>& vtxPrevIn, std::vector<char>& vchDeferredIn) : vtxPrev(vtxPrevIn), vchDeferred(vchDeferredIn)
+    {
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        if (!vchDeferred.empty())
+            return vchDeferred.size();
+        return ::GetSerializeSize(vtxPrev, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        if (!vchDeferred.empty())
+            s.write(&vchDeferred[0], vchDeferred.size());
+        else
+            ::Serialize(s, vtxPrev, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        vtxPrev.clear();
+        vchDeferred.clear();
+        if (!(nType & SER_DEFERPREV))
+        {
+            ::Unserialize(s, vtxPrev, nType, nVersion);
+            return;
+        }
+
+        // Walk the CMerkleTx layout, copying the bytes
+        uint64 nTx = ReadRawCompactSize(s);
+        for (uint64 i = 0; i < nTx; i++)
+        {
+            ReadRaw(s, 8);                          // nVersion, nTime
+            uint64 nIn = ReadRawCompactSize(s);
+            for (uint64 j = 0; j < nIn; j++)
+            {
+                ReadRaw(s, 36);                     // prevout
+                ReadRaw(s, ReadRawCompactSize(s));  // scriptSig
+                ReadRaw(s, 4);                      // nSequence
+            }
+            uint64 nOut = ReadRawCompactSize(s);
+            for (uint64 j = 0; j < nOut; j++)
+            {
+                ReadRaw(s, 8);                      // nValue
+                ReadRaw(s, ReadRawCompactSize(s));  // scriptPubKey
+            }
+            ReadRaw(s, 4);                          // nLockTime
+            ReadRaw(s, 32);                         // hashBlock
+            ReadRaw(s, 32 * ReadRawCompactSize(s)); // vMerkleBranch
+            ReadRaw(s, 4);                          // nIndex
+        }
+    }
+};
+
 /** A transaction with a bunch of additional info that only the owner cares about.
  * It includes any unrecorded transactions needed to link it back to the block chain.
  */
@@ -350,6 +722,7 @@ public:
     mutable int64 nCreditCached;
     mutable int64 nAvailableCreditCached;
     mutable int64 nChangeCached;
+    std::vector<char> vchPrevDeferred; // serialized vtxPrev, see CWalletTxPrev
 
     CWalletTx()
     {
@@ -390,6 +763,7 @@ public:
         nCreditCached = 0;
         nAvailableCreditCached = 0;
         nChangeCached = 0;
+        vchPrevDeferred.clear();
     }
 
     IMPLEMENT_SERIALIZE
@@ -414,7 +788,7 @@ public:
         }
 
         nSerSize += SerReadWrite(s, *(CMerkleTx*)this, nType, nVersion,ser_action);
-        READWRITE(vtxPrev);
+        READWRITE(REF(CWalletTxPrev(pthis->vtxPrev, pthis->vchPrevDeferred)));
         READWRITE(mapValue);
         READWRITE(vOrderForm);
         READWRITE(fTimeReceivedIsTxTime);
@@ -607,6 +981,7 @@ public:
 
             if (mapPrev.empty())
             {
+                ReadSupportingTransactions();
                 BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
                     mapPrev[tx.GetHash()] = &tx;
             }
@@ -627,6 +1002,7 @@ public:
     int GetRequestCount() const;
 
     void AddSupportingTransactions(CTxDB& txdb);
+    void ReadSupportingTransactions() const;
 
     bool AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs=true);
     bool AcceptWalletTransaction();
@@ -759,4 +1135,6 @@ public:
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+bool SelectCoinsBranchAndBound(const std::vector<int64>& vValue, int64 nTargetValue, std::vector<char>& vfBestRet, int64& nBestRet);
+
 #endif
@@ -8,6 +8,7 @@
 #include "walletdb.h"
 #include "wallet.h"
 #include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
 
 using namespace std;
 using namespace boost;
@@ -107,12 +108,169 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 }
 
 
+// trollocoin: a transaction record queued for unserializing
+class CWalletLoadTx
+{
+public:
+    uint256 hash;
+    CDataStream ssValue;
+    CWalletTx* pwtx;
+    bool fUpgrade;
+
+    CWalletLoadTx(const uint256& hashIn, const CDataStream& ssValueIn, CWalletTx* pwtxIn) : hash(hashIn), ssValue(ssValueIn), pwtx(pwtxIn), fUpgrade(false)
+    {
+    }
+};
+
+// trollocoin: a key or wkey record queued for unserializing
+class CWalletLoadKey
+{
+public:
+    bool fWalletKey;
+    CDataStream ssKey;
+    CDataStream ssValue;
+    CKey key;
+
+    CWalletLoadKey(bool fWalletKeyIn, const CDataStream& ssKeyIn, const CDataStream& ssValueIn) : fWalletKey(fWalletKeyIn), ssKey(ssKeyIn), ssValue(ssValueIn)
+    {
+    }
+};
+
+// trollocoin: shared state of the threads unserializing wallet records
+class CWalletLoad
+{
+public:
+    boost::mutex mutex;
+    std::deque<CWalletLoadTx> vTx;
+    std::deque<CWalletLoadKey> vKey;
+    unsigned int nNextTx;
+    unsigned int nNextKey;
+    int64 nTxTime;
+    int64 nKeyTime;
+    bool fCorrupt;
+};
+
+static bool LoadWalletTx(CWalletLoadTx& record)
+{
+    CWalletTx& wtx = *record.pwtx;
+    record.ssValue >> wtx;
+
+    if (wtx.GetHash() != record.hash)
+        printf("Error in wallet.dat, hash mismatch\n");
+
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!record.ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            record.ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), record.hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, record.hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        record.fUpgrade = true;
+    }
+    return true;
+}
+
+static bool LoadWalletKey(CWalletLoadKey& record)
+{
+    vector<unsigned char> vchPubKey;
+    record.ssKey >> vchPubKey;
+    CKey& key = record.key;
+    if (!record.fWalletKey)
+    {
+        CPrivKey pkey;
+        record.ssValue >> pkey;
+        key.SetPubKey(vchPubKey);
+        key.SetPrivKey(pkey);
+        if (key.GetPubKey() != vchPubKey)
+            return error("Error reading wallet database: CPrivKey pubkey inconsistency");
+        if (!key.IsValid())
+            return error("Error reading wallet database: invalid CPrivKey");
+    }
+    else
+    {
+        CWalletKey wkey;
+        record.ssValue >> wkey;
+        key.SetPubKey(vchPubKey);
+        key.SetPrivKey(wkey.vchPrivKey);
+        if (key.GetPubKey() != vchPubKey)
+            return error("Error reading wallet database: CWalletKey pubkey inconsistency");
+        if (!key.IsValid())
+            return error("Error reading wallet database: invalid CWalletKey");
+    }
+    return true;
+}
+
+// trollocoin: unserialize queued transaction and key records, the
+// transactions first, until both queues are empty
+static void ThreadLoadWalletRecords(CWalletLoad* pload)
+{
+    int64 nTxTime = 0;
+    int64 nKeyTime = 0;
+    bool fCorrupt = false;
+    for (;;)
+    {
+        CWalletLoadTx* ptx = NULL;
+        CWalletLoadKey* pkey = NULL;
+        {
+            boost::mutex::scoped_lock lock(pload->mutex);
+            if (pload->fCorrupt)
+                break;
+            if (pload->nNextTx < pload->vTx.size())
+                ptx = &pload->vTx[pload->nNextTx++];
+            else if (pload->nNextKey < pload->vKey.size())
+                pkey = &pload->vKey[pload->nNextKey++];
+            else
+                break;
+        }
+
+        int64 nStart = GetTimeMicros();
+        try
+        {
+            fCorrupt = !(ptx ? LoadWalletTx(*ptx) : LoadWalletKey(*pkey));
+        }
+        catch (std::exception& e)
+        {
+            printf("Error reading wallet database: %s\n", e.what());
+            fCorrupt = true;
+        }
+        (ptx ? nTxTime : nKeyTime) += GetTimeMicros() - nStart;
+
+        if (fCorrupt)
+        {
+            boost::mutex::scoped_lock lock(pload->mutex);
+            pload->fCorrupt = true;
+            break;
+        }
+    }
+
+    boost::mutex::scoped_lock lock(pload->mutex);
+    pload->nTxTime += nTxTime;
+    pload->nKeyTime += nKeyTime;
+}
+
+// trollocoin: the records are read off the cursor first. Transactions and
+// keys, which make up nearly all of the unserializing work, are then
+// unserialized on all cores. With -fastwalletload (the default) the
+// supporting transactions in vtxPrev are only copied, and unserialized when
+// the wallet first needs them.
 int CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
     int nFileVersion = 0;
     vector<uint256> vWalletUpgrade;
     bool fIsEncrypted = false;
+    bool fFast = GetBoolArg("-fastwalletload", true);
+    map<string, unsigned int> mapRecordCount;
+    map<string, int64> mapRecordTime;
 
     //// todo: shouldn't we catch exceptions and try to recover and continue?
     {
@@ -133,6 +291,13 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
+        CWalletLoad load;
+        load.nNextTx = 0;
+        load.nNextKey = 0;
+        load.nTxTime = 0;
+        load.nKeyTime = 0;
+        load.fCorrupt = false;
+        int64 nReadStart = GetTimeMillis();
         for (;;)
         {
             // Read next record
@@ -150,6 +315,7 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             // Unserialize
             // Taking advantage of the fact that pair serialization
             // is just the two items serialized one after the other
+            int64 nStart = GetTimeMicros();
             string strType;
             ssKey >> strType;
             if (strType == "name")
@@ -162,39 +328,9 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             {
                 uint256 hash;
                 ssKey >> hash;
-                CWalletTx& wtx = pwallet->mapWallet[hash];
-                ssValue >> wtx;
-                wtx.BindWallet(pwallet);
-
-                if (wtx.GetHash() != hash)
-                    printf("Error in wallet.dat, hash mismatch\n");
-
-                // Undo serialize changes in 31600
-                if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-                {
-                    if (!ssValue.empty())
-                    {
-                        char fTmp;
-                        char fUnused;
-                        ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                        printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = fTmp;
-                    }
-                    else
-                    {
-                        printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = 0;
-                    }
-                    vWalletUpgrade.push_back(hash);
-                }
-
-                //// debug print
-                //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-                //printf(" %12"PRI64d"  %s  %s  %s\n",
-                //    wtx.vout[0].nValue,
-                //    DateTimeStrFormat(wtx.GetBlockTime()).c_str(),
-                //    wtx.hashBlock.ToString().substr(0,20).c_str(),
-                //    wtx.mapValue["message"].c_str());
+                if (fFast)
+                    ssValue.SetType(SER_DISK | SER_DEFERPREV);
+                load.vTx.push_back(CWalletLoadTx(hash, ssValue, &pwallet->mapWallet[hash]));
             }
             else if (strType == "acentry")
             {
@@ -207,48 +343,7 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             }
             else if (strType == "key" || strType == "wkey")
             {
-                vector<unsigned char> vchPubKey;
-                ssKey >> vchPubKey;
-                CKey key;
-                if (strType == "key")
-                {
-                    CPrivKey pkey;
-                    ssValue >> pkey;
-                    key.SetPubKey(vchPubKey);
-                    key.SetPrivKey(pkey);
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        printf("Error reading wallet database: CPrivKey pubkey inconsistency\n");
-                        return DB_CORRUPT;
-                    }
-                    if (!key.IsValid())
-                    {
-                        printf("Error reading wallet database: invalid CPrivKey\n");
-                        return DB_CORRUPT;
-                    }
-                }
-                else
-                {
-                    CWalletKey wkey;
-                    ssValue >> wkey;
-                    key.SetPubKey(vchPubKey);
-                    key.SetPrivKey(wkey.vchPrivKey);
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        printf("Error reading wallet database: CWalletKey pubkey inconsistency\n");
-                        return DB_CORRUPT;
-                    }
-                    if (!key.IsValid())
-                    {
-                        printf("Error reading wallet database: invalid CWalletKey\n");
-                        return DB_CORRUPT;
-                    }
-                }
-                if (!pwallet->LoadKey(key))
-                {
-                    printf("Error reading wallet database: LoadKey failed\n");
-                    return DB_CORRUPT;
-                }
+                load.vKey.push_back(CWalletLoadKey(strType == "wkey", ssKey, ssValue));
             }
             else if (strType == "mkey")
             {
@@ -306,8 +401,58 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
                     return DB_CORRUPT;
                 }
             }
+            mapRecordCount[strType]++;
+            mapRecordTime[strType] += GetTimeMicros() - nStart;
         }
         pcursor->close();
+        int64 nReadTime = GetTimeMillis() - nReadStart;
+
+        // Not worth starting threads for a small wallet
+        int64 nUnserializeStart = GetTimeMillis();
+        int nThreads = fFast ? min((int)boost::thread::hardware_concurrency(), (int)((load.vTx.size() + load.vKey.size()) / 64)) : 1;
+        if (nThreads <= 1)
+            ThreadLoadWalletRecords(&load);
+        else
+        {
+            boost::thread_group threadGroup;
+            for (int i = 0; i < nThreads; i++)
+                threadGroup.create_thread(boost::bind(&ThreadLoadWalletRecords, &load));
+            threadGroup.join_all();
+        }
+        if (load.fCorrupt)
+            return DB_CORRUPT;
+        int64 nUnserializeTime = GetTimeMillis() - nUnserializeStart;
+        mapRecordTime["tx"] += load.nTxTime;
+        mapRecordTime["key"] += load.nKeyTime;
+
+        BOOST_FOREACH(CWalletLoadTx& record, load.vTx)
+        {
+            record.pwtx->BindWallet(pwallet);
+            pwallet->setWalletByTime.insert(make_pair(record.pwtx->GetTxTime(), record.hash));
+            if (record.fUpgrade)
+                vWalletUpgrade.push_back(record.hash);
+
+            //// debug print
+            //printf("LoadWallet  %s\n", record.pwtx->GetHash().ToString().c_str());
+            //printf(" %12"PRI64d"  %s  %s  %s\n",
+            //    record.pwtx->vout[0].nValue,
+            //    DateTimeStrFormat(record.pwtx->GetBlockTime()).c_str(),
+            //    record.pwtx->hashBlock.ToString().substr(0,20).c_str(),
+            //    record.pwtx->mapValue["message"].c_str());
+        }
+        BOOST_FOREACH(const CWalletLoadKey& record, load.vKey)
+        {
+            if (!pwallet->LoadKey(record.key))
+            {
+                printf("Error reading wallet database: LoadKey failed\n");
+                return DB_CORRUPT;
+            }
+        }
+
+        printf("LoadWallet() : read records in %"PRI64d"ms, unserialized transactions and keys on %d threads in %"PRI64d"ms\n",
+            nReadTime, max(nThreads, 1), nUnserializeTime);
+        for (map<string, unsigned int>::iterator it = mapRecordCount.begin(); it != mapRecordCount.end(); ++it)
+            printf("LoadWallet() : %-12s %8u records %8"PRI64d"ms\n", (*it).first.c_str(), (*it).second, mapRecordTime[(*it).first] / 1000);
     }
 
     BOOST_FOREACH(uint256 hash, vWalletUpgrade)
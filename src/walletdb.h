@@ -147,4 +147,39 @@ public:
     int LoadWallet(CWallet* pwallet);
 };
 
+/** Writes to the wallet database in one transaction while in scope, instead
+ * of one transaction and checkpoint per CWalletDB. Every CWalletDB the thread
+ * opens on the file meanwhile writes in the batch, so the caller must hold
+ * cs_wallet until the batch is committed. Batches nest, the outermost one
+ * commits.
+ */
+class CWalletDBBatch : public CWalletDB
+{
+private:
+    bool fOwner;
+
+public:
+    CWalletDBBatch(std::string strFilename) : CWalletDB(strFilename)
+    {
+        fOwner = !fBatch && TxnBeginBatch();
+    }
+
+    ~CWalletDBBatch()
+    {
+        if (fOwner && !Commit(true))
+            printf("ERROR: CWalletDBBatch : failed to commit the writes to %s\n", strFile.c_str());
+    }
+
+    // Commit what was written so far and go on in a new transaction, unless
+    // it is the last commit of the batch
+    bool Commit(bool fLast=false)
+    {
+        if (!fOwner)
+            return true;
+        bool fCommitted = TxnCommitBatch();
+        fOwner = !fLast && TxnBeginBatch();
+        return fCommitted;
+    }
+};
+
 #endif // BITCOIN_WALLETDB_H
@@ -127,6 +127,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/net.h \
     src/key.h \
     src/db.h \
+    src/logdb.h \
+    src/blockfile.h \
     src/walletdb.h \
     src/script.h \
     src/init.h \
@@ -207,6 +209,8 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
     src/db.cpp \
+    src/logdb.cpp \
+    src/blockfile.cpp \
     src/walletdb.cpp \
     src/scrapesdb.cpp \
     src/primenodes.cpp \